@@ -0,0 +1,67 @@
+#!/bin/sh
+# Measure the DHT requests per second that DHTd answers with different
+# numbers of worker threads.
+#
+# usage: bench/bench.sh <address> [seconds] [workers...]
+#
+# Build first with: make FEATURES="cli workers" bench
+#
+# The address must be a local address other than 127.0.0.0/8, the DHT
+# ignores requests from there. DHTd listens on the default port and
+# must not run already. Each run uses --request-rate 0, so that all
+# requests are answered.
+
+BIN="${BIN:-build/dhtd}"
+LOADGEN="${LOADGEN:-build/loadgen}"
+PORT=6881
+# sending sockets and requests in flight per socket
+SOURCES="${SOURCES:-64}"
+WINDOW="${WINDOW:-16}"
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 <address> [seconds] [workers...]" >&2
+	exit 1
+fi
+
+ADDR="$1"
+DURATION="${2:-10}"
+shift
+[ $# -gt 0 ] && shift
+WORKERS="${*:-0 1 2 4}"
+
+if [ ! -x "$BIN" ] || [ ! -x "$LOADGEN" ]; then
+	echo "Missing $BIN or $LOADGEN, run: make FEATURES=\"cli workers\" bench" >&2
+	exit 1
+fi
+
+# utime + stime of a process in clock ticks
+cpu_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+CPUS=$(nproc)
+TICKS=$(getconf CLK_TCK)
+
+echo "CPUs: $CPUS, sources: $SOURCES, window: $WINDOW, seconds: $DURATION"
+echo "workers	replies/s	dhtd CPU %"
+
+for w in $WORKERS; do
+	if [ $((w + 2)) -gt "$CPUS" ]; then
+		echo "Note: $w workers, the event loop and the load generator share $CPUS CPUs." >&2
+	fi
+
+	"$BIN" --request-rate 0 --workers "$w" --verbosity quiet --cli-disable-stdin &
+	pid=$!
+	sleep 1
+
+	start=$(cpu_ticks $pid)
+	result=$("$LOADGEN" "$ADDR" "$PORT" "$DURATION" "$SOURCES" "$WINDOW")
+	end=$(cpu_ticks $pid)
+
+	kill -INT $pid
+	wait $pid 2> /dev/null
+
+	rate=$(echo "$result" | sed -n 's/.*replies\/s: \([0-9]*\).*/\1/p')
+	cpu=$(( (end - start) * 100 / (TICKS * DURATION) ))
+	echo "$w	$rate	$cpu"
+done
@@ -0,0 +1,448 @@
+// Microbenchmarks of the DHT code, see usage()
+//
+// The DHT code is included like in kad.c. Packets are not sent, the
+// clock only moves when a benchmark moves it.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../src/dht.c"
+
+// The clock of the DHT code in milliseconds
+static int64_t g_now_ms = 1000000;
+
+// Bytes passed to dht_sendto()
+static uint64_t g_sent_bytes = 0;
+
+// If set, dht_sendto() copies the packet here
+static uint8_t *g_capture = NULL;
+static int g_capture_len = 0;
+
+int dht_sendto(int sockfd, const void *buf, int buflen, int flags, const struct sockaddr *to, int tolen)
+{
+    if (g_capture) {
+        memcpy(g_capture, buf, buflen);
+        g_capture_len = buflen;
+    }
+    g_sent_bytes += buflen;
+    return buflen;
+}
+
+int dht_blacklisted(const struct sockaddr *sa, int salen)
+{
+    return 0;
+}
+
+void dht_hash(void *hash_return, int hash_size,
+        const void *v1, int len1,
+        const void *v2, int len2,
+        const void *v3, int len3)
+{
+    memset(hash_return, 0, hash_size);
+    memcpy(hash_return, v1, (len1 < hash_size) ? len1 : hash_size);
+}
+
+int dht_random_bytes(void *buf, size_t size)
+{
+    uint8_t *p = (uint8_t*) buf;
+
+    for (size_t i = 0; i < size; i++) {
+        p[i] = random() & 0xFF;
+    }
+
+    return size;
+}
+
+int64_t dht_time_ms(void)
+{
+    return g_now_ms;
+}
+
+static int64_t time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A node with a random id and a random public IPv4 address
+struct bench_node {
+    uint8_t id[20];
+    struct sockaddr_in sin;
+};
+
+static struct bench_node *bench_nodes(int count)
+{
+    struct bench_node *nodes = (struct bench_node*) calloc(count, sizeof(struct bench_node));
+
+    if (nodes == NULL) {
+        fprintf(stderr, "Cannot allocate %d nodes.\n", count);
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct bench_node *n = &nodes[i];
+        uint8_t *ip = (uint8_t*) &n->sin.sin_addr;
+
+        dht_random_bytes(n->id, sizeof(n->id));
+        n->sin.sin_family = AF_INET;
+        n->sin.sin_port = htons(1024 + random() % 60000);
+        // not martian, see is_martian()
+        ip[0] = 1 + random() % 126;
+        ip[1] = random() & 0xFF;
+        ip[2] = random() & 0xFF;
+        ip[3] = 1 + random() % 254;
+    }
+
+    return nodes;
+}
+
+// Start the DHT with an IPv4 routing table that holds at least nodes
+static void bench_init(int nodes)
+{
+    uint8_t id[20];
+    int depth = 0;
+
+    // bootstrap node table, see --split-depth
+    while ((8 << depth) < 2 * nodes && depth < 24) {
+        depth += 1;
+    }
+
+    if (dht_set_buckets(8, depth) < 0) {
+        fprintf(stderr, "dht_set_buckets() failed.\n");
+        exit(1);
+    }
+
+    dht_random_bytes(id, sizeof(id));
+    if (dht_init(socket(AF_INET, SOCK_DGRAM, 0), -1, id, NULL) < 0) {
+        fprintf(stderr, "dht_init() failed.\n");
+        exit(1);
+    }
+}
+
+static int node_count(void)
+{
+    return bucket_table(AF_INET)->nodes;
+}
+
+// Insert nodes into a growing table. At every doubling, print the time
+// per new node since the last line and the time per call for nodes that
+// are already in the table.
+static void bench_new_node(int count)
+{
+    struct bench_node *nodes = bench_nodes(count);
+    int next = 1000;
+    int last = 0;
+    int64_t start = time_ns();
+
+    bench_init(count);
+
+    printf("new_node() with up to %d IPv4 nodes (k 8, split depth %d)\n", count, split_depth);
+    printf("nodes\tbuckets\tns/new\tns/known\n");
+
+    for (int i = 0; i < count; i++) {
+        const struct bench_node *n = &nodes[i];
+
+        new_node(n->id, (const struct sockaddr*) &n->sin, sizeof(n->sin), 1);
+
+        if ((i + 1) != next && (i + 1) != count) {
+            continue;
+        }
+
+        int64_t end = time_ns();
+        double ns_new = (double) (end - start) / (i + 1 - last);
+
+        // nodes seen again, e.g. the senders of requests
+        int64_t known_start = time_ns();
+        for (int j = 0; j < 1000; j++) {
+            n = &nodes[random() % (i + 1)];
+            new_node(n->id, (const struct sockaddr*) &n->sin, sizeof(n->sin), 1);
+        }
+        double ns_known = (double) (time_ns() - known_start) / 1000;
+
+        printf("%d\t%d\t%.0f\t%.0f\n", node_count(), bucket_table(AF_INET)->count, ns_new, ns_known);
+
+        last = i + 1;
+        next *= 2;
+        start = time_ns();
+    }
+
+    free(nodes);
+}
+
+// Resident set size of this process in KiB
+static long rss_kib(void)
+{
+    char line[128];
+    long kib = -1;
+    FILE *fp = fopen("/proc/self/status", "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kib) == 1) {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return kib;
+}
+
+// Fill the routing table with count nodes and print the growth of the
+// resident set size. Nodes come from calloc(), dhtd uses a pool.
+static void bench_rss(int count)
+{
+    // candidates that do not fit into a full bucket are skipped
+    struct bench_node *nodes = bench_nodes(2 * count);
+    long start = rss_kib();
+    int i;
+
+    bench_init(count);
+
+    for (i = 0; i < 2 * count && node_count() < count; i++) {
+        const struct bench_node *n = &nodes[i];
+        new_node(n->id, (const struct sockaddr*) &n->sin, sizeof(n->sin), 1);
+    }
+
+    long end = rss_kib();
+
+    printf("nodes\tbuckets\tRSS KiB\tbytes/node\n");
+    printf("%d\t%d\t%ld\t%.0f\n", node_count(), bucket_table(AF_INET)->count,
+        end - start, (end - start) * 1024.0 / node_count());
+
+    free(nodes);
+}
+
+// Start count searches and time add_search_node(), which every
+// confirmed reply calls. The searches start with the nodes of the
+// routing table, they are then full.
+static void bench_searches(int count)
+{
+    int replies = 200000;
+    struct bench_node *nodes = bench_nodes(replies);
+    struct bench_node *table = bench_nodes(2000);
+    int started = 0;
+    int open = 0;
+
+    bench_init(2000);
+
+    // answered nodes, see find_search_node()
+    for (int i = 0; i < 2000; i++) {
+        new_node(table[i].id, (const struct sockaddr*) &table[i].sin, sizeof(table[i].sin), 2);
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint8_t target[20];
+        dht_random_bytes(target, sizeof(target));
+        started += dht_search(target, 0, AF_INET, NULL, NULL) >= 0;
+    }
+
+    int64_t start = time_ns();
+    for (int i = 0; i < replies; i++) {
+        const struct bench_node *n = &nodes[i];
+        add_search_node(n->id, (const struct sockaddr*) &n->sin, sizeof(n->sin));
+    }
+    int64_t end = time_ns();
+
+    for (struct search *sr = searches; sr; sr = sr->next) {
+        open += (sr->numnodes < SEARCH_NODES);
+    }
+
+    printf("searches\tnot full\treplies\tns/reply\n");
+    printf("%d\t%d\t%d\t%.1f\n", started, open, replies, (double) (end - start) / replies);
+
+    free(table);
+    free(nodes);
+}
+
+// KRPC messages of every type, built by the send_*() functions
+enum {
+    MSG_PING,
+    MSG_PONG,
+    MSG_FIND_NODE,
+    MSG_GET_PEERS,
+    MSG_ANNOUNCE_PEER,
+    MSG_PEER_ANNOUNCED,
+    MSG_ERROR,
+    MSG_NODES,
+    MSG_PEERS,
+    MSG_COUNT
+};
+
+static const char *g_message_names[MSG_COUNT] = {
+    "ping", "pong", "find_node", "get_peers", "announce_peer",
+    "announced", "error", "nodes", "peers"
+};
+
+static uint8_t g_tid[4] = {'g', 'p', 0, 1};
+static uint8_t g_token[8];
+static uint8_t g_target[20];
+static struct sockaddr_in g_peer;
+
+// A routing table to answer with and a stored infohash with 20 peers
+static void bench_messages_init(void)
+{
+    struct bench_node *nodes = bench_nodes(2000);
+
+    bench_init(2000);
+
+    for (int i = 0; i < 2000; i++) {
+        new_node(nodes[i].id, (const struct sockaddr*) &nodes[i].sin, sizeof(nodes[i].sin), 2);
+    }
+
+    dht_random_bytes(g_token, sizeof(g_token));
+    dht_random_bytes(g_target, sizeof(g_target));
+    g_peer = nodes[0].sin;
+
+    for (int i = 0; i < 20; i++) {
+        storage_store(g_target, (const struct sockaddr*) &nodes[i].sin, 1024 + i);
+    }
+
+    free(nodes);
+}
+
+static int bench_encode(int type)
+{
+    const struct sockaddr *sa = (const struct sockaddr*) &g_peer;
+    int salen = sizeof(g_peer);
+
+    switch (type) {
+    case MSG_PING:
+        return send_ping(sa, salen, g_tid, 4);
+    case MSG_PONG:
+        return send_pong(sa, salen, g_tid, 4);
+    case MSG_FIND_NODE:
+        return send_find_node(sa, salen, g_tid, 4, g_target, WANT4, 0);
+    case MSG_GET_PEERS:
+        return send_get_peers(sa, salen, g_tid, 4, g_target, 0, 0);
+    case MSG_ANNOUNCE_PEER:
+        return send_announce_peer(sa, salen, g_tid, 4, g_target, 6881, g_token, 8, 0);
+    case MSG_PEER_ANNOUNCED:
+        return send_peer_announced(sa, salen, g_tid, 4);
+    case MSG_ERROR:
+        return send_error(sa, salen, g_tid, 4, 203, "Get_peers with no info_hash");
+    case MSG_NODES:
+        return send_closest_nodes(sa, salen, g_tid, 4, g_target, WANT4, AF_INET, NULL, NULL, 0);
+    case MSG_PEERS:
+        return send_closest_nodes(sa, salen, g_tid, 4, g_target, WANT4, AF_INET,
+            find_storage(g_target), g_token, 8);
+    default:
+        return -1;
+    }
+}
+
+// Time the send_*() functions, packets end in dht_sendto()
+static void bench_encode_all(int count)
+{
+    bench_messages_init();
+
+    printf("message\tbytes\tns/message\n");
+
+    for (int type = 0; type < MSG_COUNT; type++) {
+        uint64_t sent = g_sent_bytes;
+        int64_t start = time_ns();
+
+        for (int i = 0; i < count; i++) {
+            if (bench_encode(type) < 0) {
+                fprintf(stderr, "Cannot encode %s.\n", g_message_names[type]);
+                exit(1);
+            }
+        }
+
+        int64_t end = time_ns();
+
+        printf("%s\t%d\t%.1f\n", g_message_names[type],
+            (int) ((g_sent_bytes - sent) / count), (double) (end - start) / count);
+    }
+}
+
+// Time parse_message() on messages built by bench_encode()
+static void bench_parse(int count)
+{
+    uint8_t buf[MSG_COUNT][2048];
+    int len[MSG_COUNT];
+
+    bench_messages_init();
+
+    for (int type = 0; type < MSG_COUNT; type++) {
+        g_capture = buf[type];
+        if (bench_encode(type) < 0) {
+            fprintf(stderr, "Cannot encode %s.\n", g_message_names[type]);
+            exit(1);
+        }
+        len[type] = g_capture_len;
+        // see dht_handle_packet()
+        buf[type][len[type]] = '\0';
+    }
+    g_capture = NULL;
+
+    printf("message\tbytes\tns/message\n");
+
+    for (int type = 0; type < MSG_COUNT; type++) {
+        struct parsed_message m;
+        int64_t start = time_ns();
+
+        for (int i = 0; i < count; i++) {
+            if (parse_message(buf[type], len[type], &m) < 0) {
+                fprintf(stderr, "Cannot parse %s.\n", g_message_names[type]);
+                exit(1);
+            }
+        }
+
+        int64_t end = time_ns();
+
+        printf("%s\t%d\t%.1f\n", g_message_names[type], len[type], (double) (end - start) / count);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s <benchmark> [count]\n"
+        "  new-node [nodes]  Time new_node() while the routing table grows (default: 100000)\n"
+        "  rss [nodes]       Memory used by a routing table of that size (default: 100000)\n"
+        "  searches [count]  Time add_search_node() with that many searches (default: 1000)\n"
+        "  parse [count]     Time parse_message() count times per message type (default: 1000000)\n"
+        "  encode [count]    Time the send_*() functions count times per message type (default: 1000000)\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int count = (argc > 2) ? atoi(argv[2]) : 0;
+
+    srandom(1);
+
+    if (strcmp(argv[1], "new-node") == 0) {
+        bench_new_node((count > 0) ? count : 100000);
+    } else if (strcmp(argv[1], "rss") == 0) {
+        bench_rss((count > 0) ? count : 100000);
+    } else if (strcmp(argv[1], "searches") == 0) {
+        bench_searches((count > 0) ? count : 1000);
+    } else if (strcmp(argv[1], "parse") == 0) {
+        bench_parse((count > 0) ? count : 1000000);
+    } else if (strcmp(argv[1], "encode") == 0) {
+        bench_encode_all((count > 0) ? count : 1000000);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
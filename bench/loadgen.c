@@ -0,0 +1,213 @@
+// Load generator for DHTd, see bench.sh
+//
+// Sends ping, find_node and get_peers requests from many UDP sockets
+// and counts the replies. Every socket stands for one node with its
+// own id and source port, so SO_REUSEPORT spreads them over the
+// sockets of the workers.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define MAX_SOURCES 1024
+#define PACKET_SIZE 1500
+
+struct source {
+    int sock;
+    uint8_t id[20];
+    // requests without a reply
+    int inflight;
+    uint64_t replies;
+    // replies at the last check for lost requests
+    uint64_t checked;
+};
+
+static struct source g_sources[MAX_SOURCES];
+
+static int64_t time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void random_bytes(uint8_t buf[], size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = random() & 0xFF;
+    }
+}
+
+// Build the next request, the type rotates with the sequence number
+static int make_request(uint8_t buf[], const struct source *src, uint32_t seq)
+{
+    uint8_t target[20];
+    int len = 0;
+
+    random_bytes(target, sizeof(target));
+
+    memcpy(buf + len, "d1:ad2:id20:", 12);
+    len += 12;
+    memcpy(buf + len, src->id, 20);
+    len += 20;
+
+    switch (seq % 3) {
+    case 0:
+        len += sprintf((char*) buf + len, "e1:q4:ping");
+        break;
+    case 1:
+        len += sprintf((char*) buf + len, "6:target20:");
+        memcpy(buf + len, target, 20);
+        len += 20;
+        len += sprintf((char*) buf + len, "e1:q9:find_node");
+        break;
+    default:
+        len += sprintf((char*) buf + len, "9:info_hash20:");
+        memcpy(buf + len, target, 20);
+        len += 20;
+        len += sprintf((char*) buf + len, "e1:q9:get_peers");
+        break;
+    }
+
+    len += sprintf((char*) buf + len, "1:t4:");
+    memcpy(buf + len, &seq, 4);
+    len += 4;
+    len += sprintf((char*) buf + len, "1:y1:qe");
+
+    return len;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s <address> <port> [seconds] [sources] [window]\n"
+        "Send DHT requests from sources sockets with up to window\n"
+        "requests in flight each and print the replies per second.\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *dst = NULL;
+    struct pollfd fds[MAX_SOURCES];
+    uint8_t buf[PACKET_SIZE];
+    uint32_t seq = 0;
+
+    if (argc < 3 || argc > 6) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int seconds = (argc > 3) ? atoi(argv[3]) : 10;
+    int count = (argc > 4) ? atoi(argv[4]) : 64;
+    int window = (argc > 5) ? atoi(argv[5]) : 16;
+
+    if (seconds < 1 || count < 1 || count > MAX_SOURCES || window < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int rc = getaddrinfo(argv[1], argv[2], &hints, &dst);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(rc));
+        return 1;
+    }
+
+    srandom(time_ms());
+
+    for (int i = 0; i < count; i++) {
+        struct source *src = &g_sources[i];
+
+        src->sock = socket(dst->ai_family, SOCK_DGRAM, 0);
+        if (src->sock < 0 || connect(src->sock, dst->ai_addr, dst->ai_addrlen) < 0) {
+            fprintf(stderr, "socket(): %s\n", strerror(errno));
+            return 1;
+        }
+        fcntl(src->sock, F_SETFL, fcntl(src->sock, F_GETFL) | O_NONBLOCK);
+        random_bytes(src->id, sizeof(src->id));
+
+        fds[i].fd = src->sock;
+        fds[i].events = POLLIN;
+    }
+
+    freeaddrinfo(dst);
+
+    int64_t start = time_ms();
+    int64_t end = start + 1000LL * seconds;
+    int64_t check = start;
+    uint64_t sent = 0;
+    uint64_t replies = 0;
+
+    while (true) {
+        int64_t now = time_ms();
+
+        if (now >= end) {
+            break;
+        }
+
+        // Requests that got no reply for a while are lost
+        if (now >= check + 200) {
+            for (int i = 0; i < count; i++) {
+                struct source *src = &g_sources[i];
+                if (src->replies == src->checked) {
+                    src->inflight = 0;
+                }
+                src->checked = src->replies;
+            }
+            check = now;
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct source *src = &g_sources[i];
+            while (src->inflight < window) {
+                int len = make_request(buf, src, seq++);
+                if (send(src->sock, buf, len, 0) < 0) {
+                    break;
+                }
+                src->inflight += 1;
+                sent += 1;
+            }
+        }
+
+        if (poll(fds, count, 10) <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct source *src = &g_sources[i];
+
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            while (recv(src->sock, buf, sizeof(buf), 0) > 0) {
+                src->replies += 1;
+                replies += 1;
+                if (src->inflight > 0) {
+                    src->inflight -= 1;
+                }
+            }
+        }
+    }
+
+    double secs = (time_ms() - start) / 1000.0;
+
+    printf("sent: %llu, replies: %llu, replies/s: %.0f\n",
+        (unsigned long long) sent, (unsigned long long) replies, replies / secs);
+
+    return 0;
+}
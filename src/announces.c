@@ -10,15 +10,18 @@
 #include "net.h"
 #include "kad.h"
 #include "announces.h"
+#include "pool.h"
 
 
 // Announce values every 20 minutes
 #define ANNOUNCES_INTERVAL (20*60)
 
+// Announcements allocated up front with --preallocate
+#define ANNOUNCES_PREALLOC 64
+
 
-static time_t g_announces_expire = 0;
-static time_t g_announces_announce = 0;
 static struct announcement_t *g_values = NULL;
+static struct pool g_value_pool;
 
 
 struct announcement_t* announces_get(void)
@@ -26,6 +29,12 @@ struct announcement_t* announces_get(void)
     return g_values;
 }
 
+int announces_count(void)
+{
+    // Every announcement is taken from the pool
+    return g_value_pool.used;
+}
+
 struct announcement_t* announces_find(const uint8_t id[])
 {
     struct announcement_t *value;
@@ -77,6 +86,8 @@ void announces_print(FILE *fp)
     fprintf(fp, " Found %d entries.\n", value_counter);
 }
 
+static void announces_handle_announce(void);
+
 // Announce a sanitized query
 struct announcement_t *announces_add(FILE *fp, uint8_t id[], int port, time_t lifetime)
 {
@@ -98,14 +109,19 @@ struct announcement_t *announces_add(FILE *fp, uint8_t id[], int port, time_t li
         }
 
         // Trigger immediate handling
-        g_announces_announce = 0;
+        net_add_timer(time_now_ms(), &announces_handle_announce);
 
         if (fp) fprintf(fp, "Announcement already exists. Triggered again.\n");
         return cur;
     }
 
     // Prepend new entry
-    new = (struct announcement_t*) calloc(1, sizeof(struct announcement_t));
+    new = (struct announcement_t*) pool_alloc(&g_value_pool);
+    if (new == NULL) {
+        if (fp) fprintf(fp, "Failed to allocate announcement.\n");
+        return NULL;
+    }
+
     memcpy(new->id, id, SHA1_BIN_LENGTH);
     new->port = port;
     new->refresh = now - 1; // Send first announcement as soon as possible
@@ -122,7 +138,7 @@ struct announcement_t *announces_add(FILE *fp, uint8_t id[], int port, time_t li
     g_values = new;
 
     // Trigger immediate handling
-    g_announces_announce = 0;
+    net_add_timer(time_now_ms(), &announces_handle_announce);
 
     if (fp) fprintf(fp, "Announcement started (port %d).\n", port);
 
@@ -131,7 +147,7 @@ struct announcement_t *announces_add(FILE *fp, uint8_t id[], int port, time_t li
 
 void value_free(struct announcement_t *value)
 {
-    free(value);
+    pool_free(&g_value_pool, value);
 }
 
 bool announcement_remove(const uint8_t id[])
@@ -199,28 +215,35 @@ static void announces_announce(void)
     }
 }
 
-static void announces_handle(int _rc, int _sock)
+static void announces_handle_expire(void)
 {
     // Expire search results
-    if (g_announces_expire <= time_now_sec()) {
-        announces_expire();
+    announces_expire();
 
-        // Try again in ~1 minute
-        g_announces_expire = time_add_mins(1);
-    }
+    // Try again in ~1 minute
+    net_add_timer(time_add_mins(1), &announces_handle_expire);
+}
 
-    if (g_announces_announce <= time_now_sec() && kad_count_nodes(false) != 0) {
+static void announces_handle_announce(void)
+{
+    if (kad_count_nodes(false) != 0) {
         announces_announce();
 
         // Try again in ~1 minute
-        g_announces_announce = time_add_mins(1);
+        net_add_timer(time_add_mins(1), &announces_handle_announce);
+    } else {
+        // Wait for nodes to announce to
+        net_add_timer(time_add_secs(5), &announces_handle_announce);
     }
 }
 
 void announces_setup(void)
 {
-    // Cause the callback to be called in intervals
-    net_add_handler(-1, &announces_handle);
+    pool_init(&g_value_pool, "announcements", sizeof(struct announcement_t), 16, ANNOUNCES_PREALLOC);
+
+    // Cause the callbacks to be called in intervals
+    net_add_timer(time_now_ms(), &announces_handle_expire);
+    net_add_timer(time_now_ms(), &announces_handle_announce);
 }
 
 void announces_free(void)
@@ -235,4 +258,6 @@ void announces_free(void)
         cur = next;
     }
     g_values = NULL;
+
+    pool_destroy(&g_value_pool);
 }
@@ -22,6 +22,7 @@ void announces_setup(void);
 void announces_free(void);
 
 struct announcement_t* announces_get(void);
+int announces_count(void);
 struct announcement_t* announces_find(const uint8_t id[]);
 bool announcement_remove(const uint8_t id[]);
 
@@ -36,6 +36,12 @@ const char *dhtd_version_str = PROGRAM_NAME " " PROGRAM_VERSION " ("
 #ifdef LPD
 " local-peer-discovery"
 #endif
+#ifdef URING
+" io-uring"
+#endif
+#ifdef WORKERS
+" workers"
+#endif
 " )";
 
 static const char *dhtd_usage_str =
@@ -46,6 +52,7 @@ static const char *dhtd_usage_str =
 " --announce <id>[:<port>}		Announce a id and optional port.\n"
 "					This option may occur multiple times.\n\n"
 " --peerfile <file>			Import/Export peers from and to a file.\n\n"
+" --table-file <file>			Save the routing table on exit and restore it at startup.\n\n"
 " --peer <address>			Add a static peer address.\n"
 "					This option may occur multiple times.\n\n"
 " --execute <file>			Execute a script for each result.\n\n"
@@ -55,6 +62,21 @@ static const char *dhtd_usage_str =
 "					option on each line. Comments start after '#'.\n\n"
 " --ifname <interface>			Bind to this interface.\n"
 "					Default: <any>\n\n"
+" --recv-budget <n>			Receive up to n DHT packets per wakeup.\n"
+"					Default: "STR(DHT_RECV_BUDGET)"\n\n"
+#ifdef WORKERS
+" --workers <n>				Receive and send DHT packets in n extra threads.\n"
+"					Default: 0\n\n"
+#endif
+" --node-ids <n>				Serve n node ids on n ports, starting at --port.\n"
+"					Default: 1\n\n"
+" --bucket-size <k>			Keep up to k nodes in each bucket.\n"
+"					Default: "STR(DHT_BUCKET_SIZE)"\n\n"
+" --split-depth <n>			Split all buckets up to depth n, for bootstrap nodes.\n"
+"					Default: 0\n\n"
+" --request-rate <n>			Answer up to n DHT requests per second, 0 for no limit.\n"
+"					Default: "STR(DHT_REQUEST_RATE)"\n\n"
+" --preallocate				Allocate memory pools for nodes, searches, results and announcements up front.\n\n"
 " --daemon, -d				Run the node in background.\n\n"
 " --verbosity <level>			Verbosity level: quiet, verbose or debug.\n"
 "					Default: verbose\n\n"
@@ -103,6 +125,7 @@ void conf_info(void)
 
     log_info("Verbosity: %s", verbosity_str(gconf->verbosity));
     log_info("Peer File: %s", gconf->peerfile ? gconf->peerfile : "none");
+    log_info("Table File: %s", gconf->table_file ? gconf->table_file : "none");
 #ifdef LPD
     log_info("Local Peer Discovery: %s", gconf->lpd_disable ? "disabled" : "enabled");
 #endif
@@ -113,6 +136,7 @@ void conf_free(void)
     free(gconf->user);
     free(gconf->pidfile);
     free(gconf->peerfile);
+    free(gconf->table_file);
     free(gconf->dht_ifname);
     free(gconf->configfile);
 
@@ -128,6 +152,7 @@ enum {
     oAnnounce,
     oPidFile,
     oPeerFile,
+    oTableFile,
     oPeer,
     oVerbosity,
     oCliDisableStdin,
@@ -141,6 +166,13 @@ enum {
     oServiceRemove,
     oServiceStart,
     oIfname,
+    oRecvBudget,
+    oWorkers,
+    oNodeIds,
+    oBucketSize,
+    oSplitDepth,
+    oRequestRate,
+    oPreallocate,
     oExecute,
     oUser,
     oDaemon,
@@ -152,6 +184,7 @@ static const option_t g_options[] = {
     {"--announce", 1, oAnnounce},
     {"--pidfile", 1, oPidFile},
     {"--peerfile", 1, oPeerFile},
+    {"--table-file", 1, oTableFile},
     {"--peer", 1, oPeer},
     {"--verbosity", 1, oVerbosity},
 #ifdef CLI
@@ -173,6 +206,15 @@ static const option_t g_options[] = {
     {"--service-start", 0, oServiceStart},
 #endif
     {"--ifname", 1, oIfname},
+    {"--recv-budget", 1, oRecvBudget},
+#ifdef WORKERS
+    {"--workers", 1, oWorkers},
+#endif
+    {"--node-ids", 1, oNodeIds},
+    {"--bucket-size", 1, oBucketSize},
+    {"--split-depth", 1, oSplitDepth},
+    {"--request-rate", 1, oRequestRate},
+    {"--preallocate", 0, oPreallocate},
     {"--execute", 1, oExecute},
     {"--user", 1, oUser},
     {"--daemon", 0, oDaemon},
@@ -327,6 +369,8 @@ static bool conf_set(const char opt[], const char val[])
         return conf_str(opt, &gconf->pidfile, val);
     case oPeerFile:
         return conf_str(opt, &gconf->peerfile, val);
+    case oTableFile:
+        return conf_str(opt, &gconf->table_file, val);
     case oPeer:
         return peerfile_add_peer(val);
     case oVerbosity:
@@ -383,6 +427,65 @@ static bool conf_set(const char opt[], const char val[])
 #endif
     case oIfname:
         return conf_str(opt, &gconf->dht_ifname, val);
+    case oRecvBudget: {
+        int budget = parse_int(val, -1);
+        if (budget < 1 || budget > DHT_RECV_BUDGET_MAX) {
+            log_error("Invalid value for %s: %s (1-%d)", opt, val, DHT_RECV_BUDGET_MAX);
+            return false;
+        }
+        gconf->dht_recv_budget = budget;
+        break;
+    }
+#ifdef WORKERS
+    case oWorkers: {
+        int workers = parse_int(val, -1);
+        if (workers < 0 || workers > DHT_WORKERS_MAX) {
+            log_error("Invalid value for %s: %s (0-%d)", opt, val, DHT_WORKERS_MAX);
+            return false;
+        }
+        gconf->dht_workers = workers;
+        break;
+    }
+#endif
+    case oNodeIds: {
+        int node_ids = parse_int(val, -1);
+        if (node_ids < 1 || node_ids > DHT_NODE_IDS_MAX) {
+            log_error("Invalid value for %s: %s (1-%d)", opt, val, DHT_NODE_IDS_MAX);
+            return false;
+        }
+        gconf->dht_node_ids = node_ids;
+        break;
+    }
+    case oBucketSize: {
+        int size = parse_int(val, -1);
+        if (size < DHT_BUCKET_SIZE || size > DHT_BUCKET_SIZE_MAX) {
+            log_error("Invalid value for %s: %s (%d-%d)", opt, val, DHT_BUCKET_SIZE, DHT_BUCKET_SIZE_MAX);
+            return false;
+        }
+        gconf->dht_bucket_size = size;
+        break;
+    }
+    case oSplitDepth: {
+        int depth = parse_int(val, -1);
+        if (depth < 0 || depth > DHT_SPLIT_DEPTH_MAX) {
+            log_error("Invalid value for %s: %s (0-%d)", opt, val, DHT_SPLIT_DEPTH_MAX);
+            return false;
+        }
+        gconf->dht_split_depth = depth;
+        break;
+    }
+    case oRequestRate: {
+        int rate = parse_int(val, -1);
+        if (rate < 0 || rate > DHT_REQUEST_RATE_MAX) {
+            log_error("Invalid value for %s: %s (0-%d)", opt, val, DHT_REQUEST_RATE_MAX);
+            return false;
+        }
+        gconf->dht_request_rate = rate;
+        break;
+    }
+    case oPreallocate:
+        gconf->preallocate = true;
+        break;
     case oExecute:
         return conf_str(opt, &gconf->execute_path, val);
     case oUser:
@@ -425,11 +528,13 @@ bool conf_load(void)
 
 static struct gconf_t *conf_alloc(void)
 {
-    time_t now = time(NULL);
-
     struct gconf_t *conf = (struct gconf_t*) calloc(1, sizeof(struct gconf_t));
     *conf = ((struct gconf_t) {
         .dht_port = DHT_PORT,
+        .dht_recv_budget = DHT_RECV_BUDGET,
+        .dht_node_ids = 1,
+        .dht_bucket_size = DHT_BUCKET_SIZE,
+        .dht_request_rate = DHT_REQUEST_RATE,
         .af = AF_UNSPEC,
 #ifdef DEBUG
         .verbosity = VERBOSITY_DEBUG,
@@ -439,8 +544,6 @@ static struct gconf_t *conf_alloc(void)
 #ifdef CLI
         .cli_path = strdup(CLI_PATH),
 #endif
-        .time_now = now,
-        .startup_time = now,
         .is_running = true
     });
 
@@ -453,6 +556,8 @@ bool conf_setup(int argc, char **argv)
     const char *val;
 
     gconf = conf_alloc();
+    time_update();
+    gconf->startup_time = time_now_sec();
 
     for (size_t i = 1; i < argc; ++i) {
         opt = argv[i];
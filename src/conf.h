@@ -11,6 +11,27 @@
 // Measurement duration for traffic
 #define TRAFFIC_DURATION_SECONDS 8
 
+// Maximum number of DHT packets received per wakeup
+#define DHT_RECV_BUDGET 32
+#define DHT_RECV_BUDGET_MAX 1024
+
+// Maximum number of DHT worker threads
+#define DHT_WORKERS_MAX 64
+
+// Maximum number of node ids served by one process
+#define DHT_NODE_IDS_MAX 64
+
+// Routing table size, see --bucket-size and --split-depth.
+// Tables up to depth 12 (4096 buckets) are refreshed in time,
+// see DHT_MAINTENANCE_BATCH in dht.c.
+#define DHT_BUCKET_SIZE 8
+#define DHT_BUCKET_SIZE_MAX 1024
+#define DHT_SPLIT_DEPTH_MAX 12
+
+// Requests answered per second, see --request-rate
+#define DHT_REQUEST_RATE 100
+#define DHT_REQUEST_RATE_MAX 1000000
+
 extern const char *dhtd_version_str;
 
 bool conf_setup(int argc, char **argv);
@@ -20,8 +41,9 @@ void conf_free(void);
 
 
 struct gconf_t {
-    // Current time
+    // Current time, see time_update()
     time_t time_now;
+    int64_t time_now_ms;
 
     // DHTd startup time
     time_t startup_time;
@@ -35,6 +57,9 @@ struct gconf_t {
     // Import/Export peers from this file
     char *peerfile;
 
+    // Save/Restore the routing table to/from this file
+    char *table_file;
+
     // Path to configuration file
     char *configfile;
 
@@ -59,6 +84,27 @@ struct gconf_t {
     // DHT interface
     char *dht_ifname;
 
+    // Maximum number of DHT packets received per wakeup
+    int dht_recv_budget;
+
+#ifdef WORKERS
+    // Number of threads with their own DHT sockets
+    int dht_workers;
+#endif
+
+    // Number of node ids served from the DHT sockets
+    int dht_node_ids;
+
+    // Minimum bucket size and depth up to which all buckets are split
+    int dht_bucket_size;
+    int dht_split_depth;
+
+    // Requests answered per second, 0 for no limit
+    int dht_request_rate;
+
+    // Allocate memory pools up front
+    bool preallocate;
+
     // Script to execute on each new result
     char* execute_path;
 
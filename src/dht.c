@@ -30,14 +30,13 @@ THE SOFTWARE.
    gratuitious changes to the coding style.  And please send back any
    improvements to the author. */
 
-/* For memmem. */
-#define _GNU_SOURCE
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
 
 #if !defined(_WIN32) || defined(__MINGW32__)
 #include <sys/time.h>
@@ -64,21 +63,10 @@ THE SOFTWARE.
 
 #include "dht.h"
 
-#ifndef HAVE_MEMMEM
-#ifdef __GLIBC__
-#define HAVE_MEMMEM
-#endif
-#endif
-
 #ifndef MSG_CONFIRM
 #define MSG_CONFIRM 0
 #endif
 
-#if !defined(_WIN32) || defined(__MINGW32__)
-#define dht_gettimeofday(_ts, _tz) gettimeofday((_ts), (_tz))
-#else
-extern int dht_gettimeofday(struct timeval *tv, struct timezone *tz);
-#endif
 
 #ifdef _WIN32
 
@@ -125,36 +113,73 @@ extern const char *inet_ntop(int, const void *, char *, socklen_t);
 #define MAX(x, y) ((x) >= (y) ? (x) : (y))
 #define MIN(x, y) ((x) <= (y) ? (x) : (y))
 
+/* A compact node address.  For IPv4, only the first 4 bytes of ip are
+   used and the rest is zero.  The port is in network byte order. */
+struct node_addr {
+    unsigned short family;      /* 0 if unset */
+    unsigned short port;
+    unsigned char ip[16];
+};
+
 struct node {
     unsigned char id[20];
-    struct sockaddr_storage ss;
-    int sslen;
-    time_t time;                /* time of last message received */
-    time_t reply_time;          /* time of last correct reply received */
-    time_t pinged_time;         /* time of last request */
+    struct node_addr addr;
+    int64_t time;               /* time of last message received */
+    int64_t reply_time;         /* time of last correct reply received */
+    int64_t pinged_time;        /* time of last request */
     int pinged;                 /* how many requests we sent since last reply */
+    int srtt;                   /* smoothed round trip time, 0 if unknown */
+    int rttvar;                 /* round trip time variation */
     struct node *next;
 };
 
+/* A candidate for a bucket that was full when we heard of it. */
+struct replacement {
+    unsigned char id[20];
+    struct node_addr addr;
+    int64_t time;               /* time of last message, 0 if only heard of */
+    int64_t reply_time;         /* time of last reply, 0 if none */
+};
+
 struct bucket {
     int af;
     unsigned char first[20];
     int count;                  /* number of nodes */
     int max_count;              /* max number of nodes for this bucket */
-    time_t time;                /* time of last reply in this bucket */
+    int64_t time;               /* time of last reply in this bucket */
     struct node *nodes;
-    struct sockaddr_storage cached;  /* the address of a likely candidate */
-    int cachedlen;
-    struct bucket *next;
+    struct replacement *cache;  /* candidates, most recent first */
+    int cache_count;
+    int index;                  /* position in the bucket table */
+    unsigned char *good;        /* compact encoding of the good nodes */
+    int good_count;
+    int good_max;               /* number of allocated entries */
+    int good_valid;             /* zero if good must be rebuilt */
+    int64_t good_expiry;        /* time the first good node turns dubious */
+};
+
+/* The buckets of one address family, sorted by first. */
+struct bucket_table {
+    struct bucket **list;
+    int count;
+    int max;
+    int nodes;                  /* number of nodes in all buckets */
+    int good;                   /* number of good nodes, see count_good */
+    int good_valid;             /* zero if a bucket changed */
+    int64_t good_expiry;        /* time the first good node turns dubious */
+    int64_t maintenance_time;   /* no bucket gets stale before */
+    int maintenance_index;      /* where bucket_maintenance continues */
+    int cached;                 /* number of replacement candidates */
 };
 
 struct search_node {
     unsigned char id[20];
-    struct sockaddr_storage ss;
-    int sslen;
-    time_t request_time;        /* the time of the last unanswered request */
-    time_t reply_time;          /* the time of the last reply */
+    struct node_addr addr;
+    int64_t request_time;       /* the time of the last unanswered request */
+    int64_t reply_time;         /* the time of the last reply */
     int pinged;
+    int srtt;                   /* smoothed round trip time, 0 if unknown */
+    int rttvar;                 /* round trip time variation */
     unsigned char token[40];
     int token_len;
     int replied;                /* whether we have received a reply */
@@ -169,22 +194,42 @@ struct search_node {
 struct search {
     unsigned short tid;
     int af;
-    time_t step_time;           /* the time of the last search_step */
+    int64_t step_time;          /* the time of the last search_step */
     unsigned char id[20];
     unsigned short port;        /* 0 for pure searches */
     int done;
     struct search_node nodes[SEARCH_NODES];
     int numnodes;
+    int window;                 /* maximum number of requests in flight */
+    int srtt;                   /* round trip time of all nodes, 0 if unknown */
+    int rttvar;
     struct search *next;
+    struct search *tid_next;    /* chain in searches_by_tid */
+    struct search *id_next;     /* chain in searches_by_id */
+    int64_t deadline;           /* time of the next search_step */
+    int queue_index;            /* position in search_queue, -1 if none */
+    struct search *open_next;   /* list of searches that are not full */
+    struct search **open_pprev; /* NULL if not in open_searches */
 };
 
 struct peer {
-    time_t time;
+    int64_t time;
     unsigned char ip[16];
     unsigned short len;
     unsigned short port;
 };
 
+/* Allocation of nodes and searches, the user may provide a pool. */
+#ifndef DHT_NODE_ALLOC
+#define DHT_NODE_ALLOC() calloc(1, sizeof(struct node))
+#define DHT_NODE_FREE(n) free(n)
+#endif
+
+#ifndef DHT_SEARCH_ALLOC
+#define DHT_SEARCH_ALLOC() calloc(1, sizeof(struct search))
+#define DHT_SEARCH_FREE(sr) free(sr)
+#endif
+
 /* The maximum number of peers we store for a given hash. */
 #ifndef DHT_MAX_PEERS
 #define DHT_MAX_PEERS 2048
@@ -200,19 +245,47 @@ struct peer {
 #define DHT_MAX_SEARCHES 1024
 #endif
 
+/* The maximum number of stale buckets of one family refreshed per
+   maintenance cycle, see bucket_maintenance. */
+#ifndef DHT_MAINTENANCE_BATCH
+#define DHT_MAINTENANCE_BATCH 128
+#endif
+
+/* All times are in milliseconds, see dht_time_ms(). */
+
 /* The time after which we consider a search to be expirable. */
 #ifndef DHT_SEARCH_EXPIRE_TIME
-#define DHT_SEARCH_EXPIRE_TIME (62 * 60)
+#define DHT_SEARCH_EXPIRE_TIME (62 * 60 * 1000)
 #endif
 
-/* The maximum number of in-flight queries per search. */
+/* The number of in-flight queries per search.  A search starts with
+   DHT_INFLIGHT_QUERIES, adds one for every timely reply and drops one
+   for every request that timed out. */
 #ifndef DHT_INFLIGHT_QUERIES
 #define DHT_INFLIGHT_QUERIES 4
 #endif
 
-/* The retransmit timeout when performing searches. */
+#ifndef DHT_INFLIGHT_MIN
+#define DHT_INFLIGHT_MIN 2
+#endif
+
+#ifndef DHT_INFLIGHT_MAX
+#define DHT_INFLIGHT_MAX 16
+#endif
+
+/* The maximum number of replacement candidates per bucket. */
+#ifndef DHT_BUCKET_CACHE
+#define DHT_BUCKET_CACHE 8
+#endif
+
+/* The retransmit timeout when performing searches.  Nodes with a known
+   round trip time get a shorter timeout, but never below DHT_RTO_MIN. */
 #ifndef DHT_SEARCH_RETRANSMIT
-#define DHT_SEARCH_RETRANSMIT 10
+#define DHT_SEARCH_RETRANSMIT 3000
+#endif
+
+#ifndef DHT_RTO_MIN
+#define DHT_RTO_MIN 250
 #endif
 
 struct storage {
@@ -243,6 +316,7 @@ static int send_closest_nodes(const struct sockaddr *sa, int salen,
                               const unsigned char *id, int want,
                               int af, struct storage *st,
                               const unsigned char *token, int token_len);
+static int count_good(int af);
 static int send_get_peers(const struct sockaddr *sa, int salen,
                           unsigned char *tid, int tid_len,
                           unsigned char *infohash, int want, int confirm);
@@ -251,9 +325,9 @@ static int send_announce_peer(const struct sockaddr *sa, int salen,
                               unsigned char *infohas, unsigned short port,
                               unsigned char *token, int token_len, int confirm);
 static int send_peer_announced(const struct sockaddr *sa, int salen,
-                               unsigned char *tid, int tid_len);
+                               const unsigned char *tid, int tid_len);
 static int send_error(const struct sockaddr *sa, int salen,
-                      unsigned char *tid, int tid_len,
+                      const unsigned char *tid, int tid_len,
                       int code, const char *message);
 
 static void
@@ -273,60 +347,115 @@ add_search_node(const unsigned char *id, const struct sockaddr *sa, int salen);
 #define PARSE_TOKEN_LEN 128
 #define PARSE_NODES_LEN (26 * 16)
 #define PARSE_NODES6_LEN (38 * 16)
-#define PARSE_VALUES_LEN 2048
-#define PARSE_VALUES6_LEN 2048
 
+/* All pointers are views into the received packet, missing ids point
+   to zeroes.  The values list is kept bencoded, see values_next(). */
 struct parsed_message {
-    unsigned char tid[PARSE_TID_LEN];
+    const unsigned char *tid;
     unsigned short tid_len;
-    unsigned char id[20];
-    unsigned char info_hash[20];
-    unsigned char target[20];
+    const unsigned char *id;
+    const unsigned char *info_hash;
+    const unsigned char *target;
     unsigned short port;
     unsigned short implied_port;
-    unsigned char token[PARSE_TOKEN_LEN];
+    const unsigned char *token;
     unsigned short token_len;
-    unsigned char nodes[PARSE_NODES_LEN];
+    const unsigned char *nodes;
     unsigned short nodes_len;
-    unsigned char nodes6[PARSE_NODES6_LEN];
+    const unsigned char *nodes6;
     unsigned short nodes6_len;
-    unsigned char values[PARSE_VALUES_LEN];
+    const unsigned char *values;
     unsigned short values_len;
-    unsigned char values6[PARSE_VALUES6_LEN];
-    unsigned short values6_len;
+    unsigned short values_count;
+    unsigned short values6_count;
     unsigned short want;
 };
 
 static int parse_message(const unsigned char *buf, int buflen,
                          struct parsed_message *m);
+static int values_next(const unsigned char **p, const unsigned char *end,
+                       const unsigned char **value, int *value_len);
 
 static const unsigned char zeroes[20] = {0};
 static const unsigned char v4prefix[16] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0
 };
 
-static int dht_socket = -1;
-static int dht_socket6 = -1;
+static int64_t rotate_secrets_time;
 
-static time_t search_time;
-static time_t confirm_nodes_time;
-static time_t rotate_secrets_time;
-
-static unsigned char myid[20];
 static int have_v = 0;
 static unsigned char my_v[9];
+
 static unsigned char secret[8];
 static unsigned char oldsecret[8];
 
-static struct bucket *buckets = NULL;
-static struct bucket *buckets6 = NULL;
+/* The state of one node id.  The first id is set up by dht_init, more
+   ids can be added with dht_add_id.  Every id has its own sockets, so
+   that other nodes see one id per address.  All ids share the storage,
+   the searches and the blacklist.  Searches are driven by the routing
+   table of the first id. */
+struct dht_id {
+    unsigned char myid[20];
+    int socket, socket6;
+    /* "d1:ad2:id20:" and "d1:rd2:id20:" followed by myid. */
+    unsigned char query_prefix[32];
+    unsigned char reply_prefix[32];
+    struct bucket_table buckets;
+    struct bucket_table buckets6;
+    int64_t mybucket_grow_time, mybucket6_grow_time;
+    int64_t confirm_nodes_time;
+    unsigned short index;       /* position in ids */
+};
+
+#ifndef DHT_MAX_IDS
+#define DHT_MAX_IDS 64
+#endif
+
+/* Defined by programs that call dht_answer from several threads. */
+#ifndef DHT_THREAD_LOCAL
+#define DHT_THREAD_LOCAL
+#endif
+#ifndef DHT_SEEN_LOCK
+#define DHT_SEEN_LOCK()
+#define DHT_SEEN_UNLOCK()
+#endif
+
+static struct dht_id *ids[DHT_MAX_IDS];
+static int numids;
+/* The id being served.  This is the first id, except while
+   dht_periodic handles a message received on the sockets of another
+   id or maintains another id. */
+static DHT_THREAD_LOCAL struct dht_id *self;
+
+/* The minimum bucket size and the depth up to which all buckets are
+   split, see dht_set_buckets. */
+static int bucket_size = 8;
+static int split_depth = 0;
+
 static struct storage *storage;
 static int numstorage;
+static int numstorage_peers;
 
 static struct search *searches = NULL;
 static int numsearches;
+/* Number of searches indexed by IPv6 and done, see search_account. */
+static int numsearches_state[2][2];
+/* Searches hashed by tid and by target, see search_hash. */
+#define SEARCH_HASH_SIZE 256
+static struct search *searches_by_tid[SEARCH_HASH_SIZE];
+static struct search *searches_by_id[SEARCH_HASH_SIZE];
+/* Searches that are not done, as a binary heap ordered by deadline. */
+static struct search *search_queue[DHT_MAX_SEARCHES];
+static int search_queue_len;
+/* Searches that have space for more nodes, indexed by IPv6. */
+static struct search *open_searches[2];
 static unsigned short search_id;
 
+/* Replacement candidates that took the place of a failed node or were
+   pinged to fill a bucket. */
+static unsigned long cache_promoted;
+static unsigned long cache_pinged;
+
 /* The maximum number of nodes that we snub.  There is probably little
    reason to increase this value. */
 #ifndef DHT_MAX_BLACKLISTED
@@ -335,14 +464,44 @@ static unsigned short search_id;
 static struct sockaddr_storage blacklist[DHT_MAX_BLACKLISTED];
 int next_blacklisted;
 
-static struct timeval now;
-static time_t mybucket_grow_time, mybucket6_grow_time;
-static time_t expire_stuff_time;
+static DHT_THREAD_LOCAL int64_t now;
+static int64_t expire_stuff_time;
 
-#define MAX_TOKEN_BUCKET_TOKENS 400
-static time_t token_bucket_time;
+/* Requests answered per second, see dht_set_rate.  The bucket holds
+   up to TOKEN_BUCKET_SECONDS worth of tokens. */
+#define TOKEN_BUCKET_SECONDS 4
+static int request_rate = 100;
+static int64_t token_bucket_time;
 static int token_bucket_tokens;
 
+/* Set while dht_answer runs.  The tables must not be modified, the
+   nodes that sent requests are remembered in seen instead. */
+static DHT_THREAD_LOCAL int read_only;
+
+#ifndef DHT_MAX_SEEN
+#define DHT_MAX_SEEN 64
+#endif
+
+struct seen_node {
+    unsigned char id[20];
+    struct sockaddr_storage ss;
+    int sslen;
+    struct dht_id *d;
+};
+
+static DHT_THREAD_LOCAL struct seen_node seen[DHT_MAX_SEEN];
+static DHT_THREAD_LOCAL int numseen;
+
+/* The nodes handed over by dht_answer_flush.  dht_periodic swaps the
+   two buffers, all of this is guarded by DHT_SEEN_LOCK. */
+#ifndef DHT_MAX_SEEN_PENDING
+#define DHT_MAX_SEEN_PENDING (4 * DHT_MAX_SEEN)
+#endif
+
+static struct seen_node seen_pending[2][DHT_MAX_SEEN_PENDING];
+static int seen_pending_index;
+static int numseen_pending;
+
 FILE *dht_debug = NULL;
 
 #ifdef __GNUC__
@@ -406,6 +565,44 @@ is_martian(const struct sockaddr *sa)
     }
 }
 
+static void
+node_addr_set(struct node_addr *a, const struct sockaddr *sa)
+{
+    memset(a, 0, sizeof(struct node_addr));
+    a->family = sa->sa_family;
+    if(sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+        memcpy(a->ip, &sin->sin_addr, 4);
+        a->port = sin->sin_port;
+    } else if(sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+        memcpy(a->ip, &sin6->sin6_addr, 16);
+        a->port = sin6->sin6_port;
+    }
+}
+
+/* Build the socket address of a node, sa must have room for the address
+   family.  Returns the length of the address. */
+static int
+node_sockaddr(const struct node_addr *a, struct sockaddr *sa)
+{
+    if(a->family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)sa;
+        memset(sin, 0, sizeof(struct sockaddr_in));
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, a->ip, 4);
+        sin->sin_port = a->port;
+        return sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
+        memset(sin6, 0, sizeof(struct sockaddr_in6));
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, a->ip, 16);
+        sin6->sin6_port = a->port;
+        return sizeof(struct sockaddr_in6);
+    }
+}
+
 /* Forget about the ``XOR-metric''.  An id is just a path from the
    root of the tree, so bits are numbered from the start. */
 
@@ -480,47 +677,111 @@ xorcmp(const unsigned char *id1, const unsigned char *id2,
     return 0;
 }
 
-/* We keep buckets in a sorted linked list.  A bucket b ranges from
-   b->first inclusive up to b->next->first exclusive. */
+/* We keep buckets in a sorted array.  A bucket b ranges from b->first
+   inclusive up to the first of the next bucket exclusive. */
+static struct bucket_table *
+bucket_table(int af)
+{
+    return af == AF_INET ? &self->buckets : &self->buckets6;
+}
+
+static struct bucket *
+first_bucket(int af)
+{
+    struct bucket_table *t = bucket_table(af);
+    return t->count > 0 ? t->list[0] : NULL;
+}
+
+static struct bucket *
+next_bucket(struct bucket *b)
+{
+    struct bucket_table *t = bucket_table(b->af);
+    return b->index + 1 < t->count ? t->list[b->index + 1] : NULL;
+}
+
+static struct bucket *
+previous_bucket(struct bucket *b)
+{
+    struct bucket_table *t = bucket_table(b->af);
+    return b->index > 0 ? t->list[b->index - 1] : NULL;
+}
+
 static int
 in_bucket(const unsigned char *id, struct bucket *b)
 {
+    struct bucket *next = next_bucket(b);
     return id_cmp(b->first, id) <= 0 &&
-        (b->next == NULL || id_cmp(id, b->next->first) < 0);
+        (next == NULL || id_cmp(id, next->first) < 0);
 }
 
+/* Binary search for the last bucket with first <= id. */
 static struct bucket *
 find_bucket(unsigned const char *id, int af)
 {
-    struct bucket *b = af == AF_INET ? buckets : buckets6;
+    struct bucket_table *t = bucket_table(af);
+    int lo = 0, hi = t->count - 1;
 
-    if(b == NULL)
+    if(t->count == 0)
         return NULL;
 
-    while(1) {
-        if(b->next == NULL)
-            return b;
-        if(id_cmp(id, b->next->first) < 0)
-            return b;
-        b = b->next;
+    /* The first bucket starts at zero and matches any id. */
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(id_cmp(t->list[mid]->first, id) <= 0)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
+    return t->list[lo];
 }
 
-static struct bucket *
-previous_bucket(struct bucket *b)
+/* Insert a bucket at position index. */
+static int
+insert_bucket(struct bucket *b, int index)
 {
-    struct bucket *p = b->af == AF_INET ? buckets : buckets6;
+    struct bucket_table *t = bucket_table(b->af);
+    int i;
 
-    if(b == p)
-        return NULL;
+    if(t->count >= t->max) {
+        int max = t->max == 0 ? 32 : 2 * t->max;
+        struct bucket **list = realloc(t->list, max * sizeof(struct bucket*));
+        if(list == NULL)
+            return -1;
+        t->list = list;
+        t->max = max;
+    }
 
-    while(1) {
-        if(p->next == NULL)
-            return NULL;
-        if(p->next == b)
-            return p;
-        p = p->next;
+    memmove(t->list + index + 1, t->list + index,
+            (t->count - index) * sizeof(struct bucket*));
+    t->list[index] = b;
+    t->count++;
+    t->maintenance_time = 0;
+
+    for(i = index; i < t->count; i++)
+        t->list[i]->index = i;
+
+    return 1;
+}
+
+static void
+free_buckets(struct bucket_table *t)
+{
+    int i;
+
+    for(i = 0; i < t->count; i++) {
+        struct bucket *b = t->list[i];
+        while(b->nodes) {
+            struct node *n = b->nodes;
+            b->nodes = n->next;
+            DHT_NODE_FREE(n);
+        }
+        free(b->cache);
+        free(b->good);
+        free(b);
     }
+
+    free(t->list);
+    memset(t, 0, sizeof(struct bucket_table));
 }
 
 /* Every bucket contains an unordered list of nodes. */
@@ -561,13 +822,29 @@ random_node(struct bucket *b)
     return n;
 }
 
+/* Return the number of leading bits shared by all ids of a bucket. */
+static int
+bucket_depth(struct bucket *b)
+{
+    struct bucket *next = next_bucket(b);
+    int bit1 = lowbit(b->first);
+    int bit2 = next ? lowbit(next->first) : -1;
+    return MAX(bit1, bit2) + 1;
+}
+
+/* We split the bucket of our id.  Bootstrap nodes also split all other
+   buckets up to split_depth. */
+static int
+bucket_splittable(struct bucket *b)
+{
+    return in_bucket(self->myid, b) || bucket_depth(b) < split_depth;
+}
+
 /* Return the middle id of a bucket. */
 static int
 bucket_middle(struct bucket *b, unsigned char *id_return)
 {
-    int bit1 = lowbit(b->first);
-    int bit2 = b->next ? lowbit(b->next->first) : -1;
-    int bit = MAX(bit1, bit2) + 1;
+    int bit = bucket_depth(b);
 
     if(bit >= 160)
         return -1;
@@ -581,9 +858,7 @@ bucket_middle(struct bucket *b, unsigned char *id_return)
 static int
 bucket_random(struct bucket *b, unsigned char *id_return)
 {
-    int bit1 = lowbit(b->first);
-    int bit2 = b->next ? lowbit(b->next->first) : -1;
-    int bit = MAX(bit1, bit2) + 1;
+    int bit = bucket_depth(b);
     int i;
 
     if(bit >= 160) {
@@ -605,14 +880,42 @@ node_good(struct node *node)
 {
     return
         node->pinged <= 2 &&
-        node->reply_time >= now.tv_sec - 7200 &&
-        node->time >= now.tv_sec - 900;
+        node->reply_time >= now - 7200 * 1000 &&
+        node->time >= now - 900 * 1000;
 }
 
 /* Our transaction-ids are 4-bytes long, with the first two bytes identi-
    fying the kind of request, and the remaining two a sequence number in
    host order. */
 
+/* Update a round trip time estimate with a new sample (RFC 6298).  Only
+   replies to a single outstanding request are sampled, since we cannot
+   tell which of several requests a reply belongs to. */
+static void
+rtt_sample(int *srtt, int *rttvar, int64_t sample)
+{
+    int r = (int)MIN(MAX(sample, 1), DHT_SEARCH_RETRANSMIT);
+
+    if(*srtt == 0) {
+        *srtt = r;
+        *rttvar = r / 2;
+    } else {
+        *rttvar += (abs(*srtt - r) - *rttvar) / 4;
+        *srtt += (r - *srtt) / 8;
+        if(*srtt == 0)
+            *srtt = 1;
+    }
+}
+
+/* The retransmit timeout for a node. */
+static int
+rtt_timeout(int srtt, int rttvar)
+{
+    if(srtt == 0)
+        return DHT_SEARCH_RETRANSMIT;
+    return MIN(MAX(srtt + 4 * rttvar, DHT_RTO_MIN), DHT_SEARCH_RETRANSMIT);
+}
+
 static void
 make_tid(unsigned char *tid_return, const char *prefix, unsigned short seqno)
 {
@@ -633,33 +936,189 @@ tid_match(const unsigned char *tid, const char *prefix,
         return 0;
 }
 
-/* Every bucket caches the address of a likely node.  Ping it. */
+/* Whether id is one of the ids we serve. */
+static int
+is_my_id(const unsigned char *id)
+{
+    int i;
+    for(i = 0; i < numids; i++) {
+        if(id_cmp(id, ids[i]->myid) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Select the id that owns the socket a message was received on. */
+static struct dht_id *
+socket_id(int s)
+{
+    int i;
+
+    for(i = 0; s >= 0 && i < numids; i++) {
+        if(ids[i]->socket == s || ids[i]->socket6 == s)
+            return ids[i];
+    }
+    return ids[0];
+}
+
+/* Called when a node of the bucket was added, removed or might have
+   become good or bad.  Time based changes are tracked by good_expiry. */
+static void
+bucket_changed(struct bucket *b)
+{
+    if(b) {
+        b->good_valid = 0;
+        bucket_table(b->af)->good_valid = 0;
+    }
+}
+
+/* Remove a replacement candidate from a bucket. */
+static void
+cache_remove(struct bucket *b, int i)
+{
+    b->cache_count--;
+    bucket_table(b->af)->cached--;
+    memmove(b->cache + i, b->cache + i + 1,
+            (b->cache_count - i) * sizeof(struct replacement));
+}
+
+static int
+cache_find(struct bucket *b, const unsigned char *id)
+{
+    int i;
+    for(i = 0; i < b->cache_count; i++) {
+        if(id_cmp(b->cache[i].id, id) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Remember a node for a full bucket.  Nodes that contacted us go to the
+   front, nodes we only heard of are kept only if there is space. */
+static void
+cache_add(struct bucket *b, const unsigned char *id,
+          const struct node_addr *addr, int confirm)
+{
+    struct replacement *r;
+    int64_t reply_time = 0;
+    int i = cache_find(b, id);
+
+    if(i >= 0) {
+        /* Known candidate, keep its last reply. */
+        if(!confirm)
+            return;
+        reply_time = b->cache[i].reply_time;
+        cache_remove(b, i);
+    } else if(!confirm && b->cache_count >= DHT_BUCKET_CACHE) {
+        return;
+    }
+
+    if(b->cache == NULL) {
+        b->cache = malloc(DHT_BUCKET_CACHE * sizeof(struct replacement));
+        if(b->cache == NULL)
+            return;
+    }
+
+    if(b->cache_count >= DHT_BUCKET_CACHE) {
+        /* Drop the least recent candidate. */
+        cache_remove(b, b->cache_count - 1);
+    }
+
+    if(confirm) {
+        memmove(b->cache + 1, b->cache,
+                b->cache_count * sizeof(struct replacement));
+        r = &b->cache[0];
+    } else {
+        r = &b->cache[b->cache_count];
+    }
+
+    memcpy(r->id, id, 20);
+    r->addr = *addr;
+    r->time = confirm ? now : 0;
+    r->reply_time = confirm >= 2 ? now : reply_time;
+    b->cache_count++;
+    bucket_table(b->af)->cached++;
+}
+
+/* Ping the most recent replacement candidate of a bucket. */
 static int
 send_cached_ping(struct bucket *b)
 {
+    struct sockaddr_storage ss;
     unsigned char tid[4];
-    int rc;
-    /* We set family to 0 when there's no cached node. */
-    if(b->cached.ss_family == 0)
+    int sslen;
+
+    if(b->cache_count == 0)
         return 0;
 
     debugf("Sending ping to cached node.\n");
     make_tid(tid, "pn", 0);
-    rc = send_ping((struct sockaddr*)&b->cached, b->cachedlen, tid, 4);
-    b->cached.ss_family = 0;
-    b->cachedlen = 0;
-    return rc;
+    sslen = node_sockaddr(&b->cache[0].addr, (struct sockaddr*)&ss);
+    cache_remove(b, 0);
+    cache_pinged++;
+    return send_ping((struct sockaddr*)&ss, sslen, tid, 4);
+}
+
+/* Replace a node that failed to reply with the most recent replacement
+   candidate.  A candidate that did not reply recently is pinged and is not
+   good until it replies. */
+static int
+promote_cached(struct node *n, struct bucket *b)
+{
+    struct sockaddr_storage ss;
+    unsigned char tid[4];
+    struct node *m;
+    int sslen;
+
+    while(b->cache_count > 0) {
+        struct replacement r = b->cache[0];
+        cache_remove(b, 0);
+
+        /* The candidate might have made it into the bucket meanwhile. */
+        for(m = b->nodes; m; m = m->next) {
+            if(id_cmp(m->id, r.id) == 0)
+                break;
+        }
+        if(m)
+            continue;
+
+        debugf("Promoting cached node.\n");
+        memcpy(n->id, r.id, 20);
+        n->addr = r.addr;
+        n->time = r.time;
+        n->reply_time = r.reply_time;
+        n->srtt = 0;
+        n->rttvar = 0;
+        n->pinged = 0;
+        n->pinged_time = 0;
+        cache_promoted++;
+
+        if(!node_good(n)) {
+            make_tid(tid, "pn", 0);
+            sslen = node_sockaddr(&n->addr, (struct sockaddr*)&ss);
+            send_ping((struct sockaddr*)&ss, sslen, tid, 4);
+            n->pinged = 1;
+            n->pinged_time = now;
+        }
+        return 1;
+    }
+
+    return 0;
 }
 
 /* Called whenever we send a request to a node, increases the ping count
-   and, if that reaches 3, sends a ping to a new candidate. */
+   and, if that reaches 3, replaces it with a new candidate. */
 static void
 pinged(struct node *n, struct bucket *b)
 {
     n->pinged++;
-    n->pinged_time = now.tv_sec;
-    if(n->pinged >= 3)
-        send_cached_ping(b ? b : find_bucket(n->id, n->ss.ss_family));
+    n->pinged_time = now;
+    if(n->pinged >= 3) {
+        if(b == NULL)
+            b = find_bucket(n->id, n->addr.family);
+        bucket_changed(b);
+        promote_cached(n, b);
+    }
 }
 
 /* The internal blacklist is an LRU cache of nodes that have sent
@@ -732,12 +1191,20 @@ append_nodes(struct node *n1, struct node *n2)
     return n1;
 }
 
+/* Free a node that was part of the routing table. */
+static void
+free_node(struct node *n)
+{
+    bucket_table(n->addr.family)->nodes--;
+    DHT_NODE_FREE(n);
+}
+
 /* Insert a new node into a bucket, don't check for duplicates.
    Returns 1 if the node was inserted, 0 if a bucket must be split. */
 static int
 insert_node(struct node *node, struct bucket **split_return)
 {
-    struct bucket *b = find_bucket(node->id, node->ss.ss_family);
+    struct bucket *b = find_bucket(node->id, node->addr.family);
 
     if(b == NULL)
         return -1;
@@ -758,10 +1225,10 @@ static int
 split_bucket_helper(struct bucket *b, struct node **nodes_return)
 {
     struct bucket *new;
-    int rc;
+    int rc, i;
     unsigned char new_id[20];
 
-    if(!in_bucket(myid, b)) {
+    if(!bucket_splittable(b)) {
         debugf("Attempted to split wrong bucket.\n");
         return -1;
     }
@@ -774,23 +1241,40 @@ split_bucket_helper(struct bucket *b, struct node **nodes_return)
     if(new == NULL)
         return -1;
 
-    send_cached_ping(b);
-
     new->af = b->af;
     memcpy(new->first, new_id, 20);
     new->time = b->time;
 
+    if(insert_bucket(new, b->index + 1) < 0) {
+        free(new);
+        return -1;
+    }
+
+    /* Move the candidates that belong to the new bucket, in order. */
+    for(i = 0; i < b->cache_count;) {
+        if(id_cmp(b->cache[i].id, new->first) < 0) {
+            i++;
+            continue;
+        }
+        if(new->cache == NULL)
+            new->cache = malloc(DHT_BUCKET_CACHE * sizeof(struct replacement));
+        if(new->cache) {
+            new->cache[new->cache_count++] = b->cache[i];
+            bucket_table(new->af)->cached++;
+        }
+        cache_remove(b, i);
+    }
+
     *nodes_return = b->nodes;
     b->nodes = NULL;
     b->count = 0;
-    new->next = b->next;
-    b->next = new;
+    bucket_changed(b);
 
-    if(in_bucket(myid, b)) {
+    if(in_bucket(self->myid, b)) {
         new->max_count = b->max_count;
-        b->max_count = MAX(b->max_count / 2, 8);
+        b->max_count = MAX(b->max_count / 2, bucket_size);
     } else {
-        new->max_count = MAX(b->max_count / 2, 8);
+        new->max_count = MAX(b->max_count / 2, bucket_size);
     }
 
     return 1;
@@ -820,12 +1304,12 @@ split_bucket(struct bucket *b)
         rc = insert_node(n, &split);
         if(rc < 0) {
             debugf("Couldn't insert node.\n");
-            free(n);
+            free_node(n);
             n = NULL;
         } else if(rc > 0) {
             n = NULL;
-        } else if(!in_bucket(myid, split)) {
-            free(n);
+        } else if(!bucket_splittable(split)) {
+            free_node(n);
             n = NULL;
         } else {
             struct node *insert = NULL;
@@ -833,7 +1317,7 @@ split_bucket(struct bucket *b)
             rc = split_bucket_helper(split, &insert);
             if(rc < 0) {
                 debugf("Couldn't split bucket.\n");
-                free(n);
+                free_node(n);
                 n = NULL;
             } else {
                 nodes = append_nodes(nodes, insert);
@@ -851,7 +1335,10 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
 {
     struct bucket *b;
     struct node *n;
-    int mybucket;
+    struct node_addr addr;
+    int mybucket, i;
+
+    node_addr_set(&addr, sa);
 
  again:
 
@@ -859,27 +1346,32 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
     if(b == NULL)
         return NULL;
 
-    if(id_cmp(id, myid) == 0)
+    if(is_my_id(id))
         return NULL;
 
     if(is_martian(sa) || node_blacklisted(sa, salen))
         return NULL;
 
-    mybucket = in_bucket(myid, b);
+    mybucket = in_bucket(self->myid, b);
 
     if(confirm == 2)
-        b->time = now.tv_sec;
+        b->time = now;
 
     n = b->nodes;
     while(n) {
         if(id_cmp(n->id, id) == 0) {
-            if(confirm || n->time < now.tv_sec - 15 * 60) {
+            if(confirm || n->time < now - 15 * 60 * 1000) {
                 /* Known node.  Update stuff. */
-                memcpy((struct sockaddr*)&n->ss, sa, salen);
+                if(!node_good(n) ||
+                   memcmp(&n->addr, &addr, sizeof(addr)) != 0)
+                    bucket_changed(b);
+                n->addr = addr;
                 if(confirm)
-                    n->time = now.tv_sec;
+                    n->time = now;
                 if(confirm >= 2) {
-                    n->reply_time = now.tv_sec;
+                    if(n->pinged == 1 && n->pinged_time > 0)
+                        rtt_sample(&n->srtt, &n->rttvar, now - n->pinged_time);
+                    n->reply_time = now;
                     n->pinged = 0;
                     n->pinged_time = 0;
                 }
@@ -895,21 +1387,28 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
 
     if(mybucket) {
         if(sa->sa_family == AF_INET)
-            mybucket_grow_time = now.tv_sec;
+            self->mybucket_grow_time = now;
         else
-            mybucket6_grow_time = now.tv_sec;
+            self->mybucket6_grow_time = now;
     }
 
     /* First, try to get rid of a known-bad node. */
     n = b->nodes;
     while(n) {
-        if(n->pinged >= 3 && n->pinged_time < now.tv_sec - 15) {
+        if(n->pinged >= 3 && n->pinged_time < now - 15 * 1000) {
+            /* The node is no longer a replacement candidate. */
+            i = cache_find(b, id);
+            if(i >= 0)
+                cache_remove(b, i);
+            bucket_changed(b);
             memcpy(n->id, id, 20);
-            memcpy((struct sockaddr*)&n->ss, sa, salen);
-            n->time = confirm ? now.tv_sec : 0;
-            n->reply_time = confirm >= 2 ? now.tv_sec : 0;
+            n->addr = addr;
+            n->time = confirm ? now : 0;
+            n->reply_time = confirm >= 2 ? now : 0;
             n->pinged_time = 0;
             n->pinged = 0;
+            n->srtt = 0;
+            n->rttvar = 0;
             if(confirm == 2)
                 add_search_node(id, sa, salen);
             return n;
@@ -928,21 +1427,23 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
                of bad nodes fast. */
             if(!node_good(n)) {
                 dubious = 1;
-                if(n->pinged_time < now.tv_sec - 15) {
+                if(n->pinged_time < now - 15 * 1000) {
+                    struct sockaddr_storage ss;
                     unsigned char tid[4];
+                    int sslen = node_sockaddr(&n->addr,
+                                              (struct sockaddr*)&ss);
                     debugf("Sending ping to dubious node.\n");
                     make_tid(tid, "pn", 0);
-                    send_ping((struct sockaddr*)&n->ss, n->sslen,
-                              tid, 4);
+                    send_ping((struct sockaddr*)&ss, sslen, tid, 4);
                     n->pinged++;
-                    n->pinged_time = now.tv_sec;
+                    n->pinged_time = now;
                     break;
                 }
             }
             n = n->next;
         }
 
-        if(mybucket && !dubious) {
+        if(bucket_splittable(b) && !dubious) {
             int rc;
             rc = split_bucket(b);
             if(rc > 0)
@@ -951,10 +1452,7 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
         }
 
         /* No space for this node.  Cache it away for later. */
-        if(confirm || b->cached.ss_family == 0) {
-            memcpy(&b->cached, sa, salen);
-            b->cachedlen = salen;
-        }
+        cache_add(b, id, &addr, confirm);
 
         if(confirm == 2)
             add_search_node(id, sa, salen);
@@ -962,28 +1460,69 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
     }
 
     /* Create a new node. */
-    n = calloc(1, sizeof(struct node));
+    n = DHT_NODE_ALLOC();
     if(n == NULL)
         return NULL;
+    i = cache_find(b, id);
+    if(i >= 0)
+        cache_remove(b, i);
+    bucket_table(b->af)->nodes++;
     memcpy(n->id, id, 20);
-    memcpy(&n->ss, sa, salen);
-    n->sslen = salen;
-    n->time = confirm ? now.tv_sec : 0;
-    n->reply_time = confirm >= 2 ? now.tv_sec : 0;
+    n->addr = addr;
+    n->time = confirm ? now : 0;
+    n->reply_time = confirm >= 2 ? now : 0;
     n->next = b->nodes;
     b->nodes = n;
     b->count++;
+    bucket_changed(b);
     if(confirm == 2)
         add_search_node(id, sa, salen);
     return n;
 }
 
+/* A node sent us a request.  While the tables are read-only, remember
+   it for dht_periodic unless it is known and was heard from recently. */
+static void
+node_seen(const unsigned char *id, const struct sockaddr *sa, int salen)
+{
+    struct node *n;
+    struct node_addr addr;
+    int i;
+
+    if(!read_only) {
+        new_node(id, sa, salen, 1);
+        return;
+    }
+
+    node_addr_set(&addr, sa);
+    n = find_node(id, sa->sa_family);
+    if(n && node_good(n) && n->time >= now - 5 * 60 * 1000 &&
+       memcmp(&n->addr, &addr, sizeof(addr)) == 0)
+        return;
+
+    for(i = 0; i < numseen; i++) {
+        if(seen[i].d == self && id_cmp(seen[i].id, id) == 0)
+            return;
+    }
+
+    if(numseen >= DHT_MAX_SEEN || (unsigned)salen > sizeof(seen[0].ss))
+        return;
+
+    memcpy(seen[numseen].id, id, 20);
+    memcpy(&seen[numseen].ss, sa, salen);
+    seen[numseen].sslen = salen;
+    seen[numseen].d = self;
+    numseen++;
+}
+
 /* Called periodically to purge known-bad nodes.  Note that we're very
    conservative here: broken nodes in the table don't do much harm, we'll
    recover as soon as we find better ones. */
 static int
-expire_buckets(struct bucket *b)
+expire_buckets(int af)
 {
+    struct bucket *b = first_bucket(af);
+
     while(b) {
         struct node *n, *p;
         int changed = 0;
@@ -992,8 +1531,8 @@ expire_buckets(struct bucket *b)
             n = b->nodes;
             b->nodes = n->next;
             b->count--;
-            changed = 1;
-            free(n);
+            changed++;
+            free_node(n);
         }
 
         p = b->nodes;
@@ -1002,39 +1541,190 @@ expire_buckets(struct bucket *b)
                 n = p->next;
                 p->next = n->next;
                 b->count--;
-                changed = 1;
-                free(n);
+                changed++;
+                free_node(n);
             }
             p = p->next;
         }
 
-        if(changed)
-            send_cached_ping(b);
+        if(changed) {
+            bucket_changed(b);
+            /* Ping a candidate for every free slot. */
+            while(changed-- > 0 && send_cached_ping(b) != 0)
+                ;
+        }
 
-        b = b->next;
+        b = next_bucket(b);
     }
-    expire_stuff_time = now.tv_sec + 120 + random() % 240;
+    expire_stuff_time = now + 120 * 1000 + random() % (240 * 1000);
     return 1;
 }
 
+/* Count a search by family and state.  Call with -1 before changing either
+   and with 1 afterwards. */
+static void
+search_account(struct search *sr, int delta)
+{
+    numsearches_state[sr->af == AF_INET6][!!sr->done] += delta;
+}
+
 /* While a search is in progress, we don't necessarily keep the nodes being
    walked in the main bucket table.  A search in progress is identified by
    a unique transaction id, a short (and hence small enough to fit in the
    transaction id of the protocol packets). */
 
-static struct search *
-find_search(unsigned short tid, int af)
+static unsigned
+search_tid_hash(unsigned short tid)
 {
-    struct search *sr = searches;
-    while(sr) {
-        if(sr->tid == tid && sr->af == af)
-            return sr;
-        sr = sr->next;
-    }
-    return NULL;
+    return tid % SEARCH_HASH_SIZE;
 }
 
-/* A search contains a list of nodes, sorted by decreasing distance to the
+/* Targets are hashes themselves. */
+static unsigned
+search_id_hash(const unsigned char *id)
+{
+    return ((id[0] << 8) | id[1]) % SEARCH_HASH_SIZE;
+}
+
+/* Add a search to the indexes.  The tid, family and target must not change
+   while the search is indexed. */
+static void
+search_hash(struct search *sr)
+{
+    unsigned h = search_tid_hash(sr->tid);
+    sr->tid_next = searches_by_tid[h];
+    searches_by_tid[h] = sr;
+
+    h = search_id_hash(sr->id);
+    sr->id_next = searches_by_id[h];
+    searches_by_id[h] = sr;
+}
+
+static void
+search_unhash(struct search *sr)
+{
+    struct search **p;
+
+    p = &searches_by_tid[search_tid_hash(sr->tid)];
+    while(*p && *p != sr)
+        p = &(*p)->tid_next;
+    if(*p)
+        *p = sr->tid_next;
+
+    p = &searches_by_id[search_id_hash(sr->id)];
+    while(*p && *p != sr)
+        p = &(*p)->id_next;
+    if(*p)
+        *p = sr->id_next;
+}
+
+static struct search *
+find_search(unsigned short tid, int af)
+{
+    struct search *sr = searches_by_tid[search_tid_hash(tid)];
+    while(sr) {
+        if(sr->tid == tid && sr->af == af)
+            return sr;
+        sr = sr->tid_next;
+    }
+    return NULL;
+}
+
+static struct search *
+find_search_id(const unsigned char *id, int af)
+{
+    struct search *sr = searches_by_id[search_id_hash(id)];
+    while(sr) {
+        if(sr->af == af && id_cmp(sr->id, id) == 0)
+            return sr;
+        sr = sr->id_next;
+    }
+    return NULL;
+}
+
+/* Add or remove a search from the list of searches that are not full.
+   The family must not change while the search is in the list. */
+static void
+search_set_open(struct search *sr, int open)
+{
+    if(open && sr->open_pprev == NULL) {
+        struct search **head = &open_searches[sr->af == AF_INET6];
+        sr->open_next = *head;
+        if(*head)
+            (*head)->open_pprev = &sr->open_next;
+        *head = sr;
+        sr->open_pprev = head;
+    } else if(!open && sr->open_pprev != NULL) {
+        *sr->open_pprev = sr->open_next;
+        if(sr->open_next)
+            sr->open_next->open_pprev = sr->open_pprev;
+        sr->open_next = NULL;
+        sr->open_pprev = NULL;
+    }
+}
+
+static void
+search_queue_set(int i, struct search *sr)
+{
+    search_queue[i] = sr;
+    sr->queue_index = i;
+}
+
+/* Move the search at position i to its place in the heap. */
+static void
+search_queue_fix(int i)
+{
+    struct search *sr = search_queue[i];
+
+    while(i > 0 && search_queue[(i - 1) / 2]->deadline > sr->deadline) {
+        search_queue_set(i, search_queue[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+
+    while(2 * i + 1 < search_queue_len) {
+        int c = 2 * i + 1;
+        if(c + 1 < search_queue_len &&
+           search_queue[c + 1]->deadline < search_queue[c]->deadline)
+            c++;
+        if(search_queue[c]->deadline >= sr->deadline)
+            break;
+        search_queue_set(i, search_queue[c]);
+        i = c;
+    }
+
+    search_queue_set(i, sr);
+}
+
+/* Queue a search for its next step, or move its deadline. */
+static void
+search_schedule(struct search *sr, int64_t deadline)
+{
+    sr->deadline = deadline;
+    if(sr->queue_index < 0) {
+        if(search_queue_len >= DHT_MAX_SEARCHES)
+            return;
+        search_queue_set(search_queue_len++, sr);
+    }
+    search_queue_fix(sr->queue_index);
+}
+
+static void
+search_unschedule(struct search *sr)
+{
+    int i = sr->queue_index;
+
+    if(i < 0)
+        return;
+
+    sr->queue_index = -1;
+    search_queue_len--;
+    if(i < search_queue_len) {
+        search_queue_set(i, search_queue[search_queue_len]);
+        search_queue_fix(i);
+    }
+}
+
+/* A search contains a list of nodes, sorted by decreasing distance to the
    target.  We just got a new candidate, insert it at the right spot or
    discard it. */
 
@@ -1042,9 +1732,10 @@ static struct search_node*
 insert_search_node(const unsigned char *id,
                    const struct sockaddr *sa, int salen,
                    struct search *sr, int replied,
-                   unsigned char *token, int token_len)
+                   const unsigned char *token, int token_len)
 {
     struct search_node *n;
+    struct node *node;
     int i, j;
 
     if(sa->sa_family != sr->af) {
@@ -1052,6 +1743,11 @@ insert_search_node(const unsigned char *id,
         return NULL;
     }
 
+    /* Full and the node is farther than all of ours. */
+    if(sr->numnodes == SEARCH_NODES &&
+       xorcmp(id, sr->nodes[SEARCH_NODES - 1].id, sr->id) > 0)
+        return NULL;
+
     for(i = 0; i < sr->numnodes; i++) {
         if(id_cmp(id, sr->nodes[i].id) == 0) {
             n = &sr->nodes[i];
@@ -1064,8 +1760,11 @@ insert_search_node(const unsigned char *id,
     if(i == SEARCH_NODES)
         return NULL;
 
-    if(sr->numnodes < SEARCH_NODES)
+    if(sr->numnodes < SEARCH_NODES) {
         sr->numnodes++;
+        if(sr->numnodes == SEARCH_NODES)
+            search_set_open(sr, 0);
+    }
 
     for(j = sr->numnodes - 1; j > i; j--) {
         sr->nodes[j] = sr->nodes[j - 1];
@@ -1076,13 +1775,25 @@ insert_search_node(const unsigned char *id,
     memset(n, 0, sizeof(struct search_node));
     memcpy(n->id, id, 20);
 
+    /* Start with the round trip time known from the routing table. */
+    node = find_node(id, sa->sa_family);
+    if(node) {
+        n->srtt = node->srtt;
+        n->rttvar = node->rttvar;
+    }
+
 found:
-    memcpy(&n->ss, sa, salen);
-    n->sslen = salen;
+    node_addr_set(&n->addr, sa);
 
     if(replied) {
+        if(n->pinged == 1 && n->request_time > 0) {
+            rtt_sample(&n->srtt, &n->rttvar, now - n->request_time);
+            rtt_sample(&sr->srtt, &sr->rttvar, now - n->request_time);
+            /* Answered at the first try, allow another request. */
+            sr->window = MIN(sr->window + 1, DHT_INFLIGHT_MAX);
+        }
         n->replied = 1;
-        n->reply_time = now.tv_sec;
+        n->reply_time = now;
         n->request_time = 0;
         n->pinged = 0;
     }
@@ -1105,6 +1816,7 @@ flush_search_node(struct search_node *n, struct search *sr)
     for(j = i; j < sr->numnodes - 1; j++)
         sr->nodes[j] = sr->nodes[j + 1];
     sr->numnodes--;
+    search_set_open(sr, 1);
 }
 
 static void
@@ -1114,12 +1826,16 @@ expire_searches(dht_callback_t *callback, void *closure)
 
     while(sr) {
         struct search *next = sr->next;
-        if(sr->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME) {
+        if(sr->step_time < now - DHT_SEARCH_EXPIRE_TIME) {
             if(previous)
                 previous->next = next;
             else
                 searches = next;
             numsearches--;
+            search_account(sr, -1);
+            search_unhash(sr);
+            search_unschedule(sr);
+            search_set_open(sr, 0);
             if (!sr->done) {
                 if(callback)
                     (*callback)(closure,
@@ -1131,7 +1847,7 @@ expire_searches(dht_callback_t *callback, void *closure)
             if(callback)
                 (*callback)(closure, DHT_EVENT_SEARCH_EXPIRED, sr->id, NULL, 0);
 
-            free(sr);
+            DHT_SEARCH_FREE(sr);
         } else {
             previous = sr;
         }
@@ -1139,51 +1855,170 @@ expire_searches(dht_callback_t *callback, void *closure)
     }
 }
 
+/* Nodes without a round trip time of their own get the one of the
+   search. */
+static int
+search_node_timeout(const struct search *sr, const struct search_node *n)
+{
+    if(n->srtt)
+        return rtt_timeout(n->srtt, n->rttvar);
+    return rtt_timeout(sr->srtt, sr->rttvar);
+}
+
+/* Whether a node did not reply to our request in time.  Such nodes are
+   still retried, but do not hold up the end of a search. */
+static int
+search_node_stale(const struct search *sr, const struct search_node *n)
+{
+    if(n->replied)
+        return 0;
+    return n->pinged >= 2 ||
+        (n->pinged == 1 && n->request_time > 0 &&
+         n->request_time <= now - search_node_timeout(sr, n));
+}
+
+/* The time at which the next outstanding request of a search times out. */
+static int64_t
+search_expiry(const struct search *sr)
+{
+    int64_t expiry = sr->step_time + DHT_SEARCH_RETRANSMIT;
+    int i;
+
+    for(i = 0; i < sr->numnodes; i++) {
+        const struct search_node *n = &sr->nodes[i];
+        if(n->pinged < 3 && n->request_time > 0 &&
+           (!n->replied || (sr->port && !n->acked)))
+            expiry = MIN(expiry,
+                         n->request_time + search_node_timeout(sr, n));
+    }
+
+    /* Do not step more often than the smallest timeout. */
+    return MAX(expiry, sr->step_time + DHT_RTO_MIN);
+}
+
+/* Whether search node a should be queried before search node b, both in
+   the same search.  Closer nodes go first, but among nodes at the same
+   log distance to the target, faster nodes go first. */
+static int
+search_node_before(const struct search *sr,
+                   const struct search_node *a, const struct search_node *b)
+{
+    int ca = common_bits(a->id, sr->id);
+    int cb = common_bits(b->id, sr->id);
+    int ra = a->srtt ? a->srtt : DHT_SEARCH_RETRANSMIT;
+    int rb = b->srtt ? b->srtt : DHT_SEARCH_RETRANSMIT;
+
+    if(ca != cb)
+        return ca > cb;
+    if(ra != rb)
+        return ra < rb;
+    return xorcmp(a->id, b->id, sr->id) < 0;
+}
+
 /* This must always return 0 or 1, never -1, not even on failure (see below). */
 static int
 search_send_get_peers(struct search *sr, struct search_node *n)
 {
+    struct sockaddr_storage ss;
     struct node *node;
+    struct dht_id *d = self;
+    int sslen;
     unsigned char tid[4];
 
-    if(n == NULL) {
-        int i;
-        for(i = 0; i < sr->numnodes; i++) {
-            if(sr->nodes[i].pinged < 3 && !sr->nodes[i].replied &&
-               sr->nodes[i].request_time < now.tv_sec - DHT_SEARCH_RETRANSMIT)
-                n = &sr->nodes[i];
-        }
-    }
-
-    if(!n || n->pinged >= 3 || n->replied ||
-       n->request_time >= now.tv_sec - DHT_SEARCH_RETRANSMIT)
+    if(n->pinged >= 3 || n->replied ||
+       n->request_time >= now - search_node_timeout(sr, n))
         return 0;
 
+    /* Searches belong to the first id.  Send from its sockets so that
+       replies and tokens are tied to a single address. */
+    self = ids[0];
+
+    /* A retransmission, the previous request timed out. */
+    if(n->pinged > 0)
+        sr->window = MAX(sr->window - 1, DHT_INFLIGHT_MIN);
+
     debugf("Sending get_peers.\n");
     make_tid(tid, "gp", sr->tid);
-    send_get_peers((struct sockaddr*)&n->ss, n->sslen, tid, 4, sr->id, -1,
-                   n->reply_time >= now.tv_sec - DHT_SEARCH_RETRANSMIT);
+    sslen = node_sockaddr(&n->addr, (struct sockaddr*)&ss);
+    send_get_peers((struct sockaddr*)&ss, sslen, tid, 4, sr->id, -1,
+                   n->reply_time >= now - DHT_SEARCH_RETRANSMIT);
     n->pinged++;
-    n->request_time = now.tv_sec;
+    n->request_time = now;
+    /* Step again when this request times out. */
+    if(!sr->done && (sr->queue_index < 0 ||
+                     sr->deadline > now + search_node_timeout(sr, n)))
+        search_schedule(sr, now + search_node_timeout(sr, n));
     /* If the node happens to be in our main routing table, mark it
        as pinged. */
-    node = find_node(n->id, n->ss.ss_family);
+    node = find_node(n->id, n->addr.family);
     if(node) pinged(node, NULL);
+    self = d;
     return 1;
 }
 
+/* Send requests to the closest nodes until the window of requests in
+   flight is full.  Nodes that were not asked yet go before
+   retransmissions. */
+static int
+search_send_requests(struct search *sr)
+{
+    int order[SEARCH_NODES];
+    int i, j, pass, inflight = 0, sent = 0;
+
+    for(i = 0; i < sr->numnodes; i++) {
+        struct search_node *n = &sr->nodes[i];
+        if(!n->replied && n->pinged < 3 && n->request_time > 0 &&
+           n->request_time > now - search_node_timeout(sr, n))
+            inflight++;
+    }
+
+    /* Query order: sort the nodes by distance and round trip time. */
+    for(i = 0; i < sr->numnodes; i++) {
+        order[i] = i;
+        for(j = i; j > 0 && search_node_before(sr, &sr->nodes[order[j]],
+                                               &sr->nodes[order[j - 1]]); j--) {
+            int k = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = k;
+        }
+    }
+
+    for(pass = 0; pass < 2; pass++) {
+        for(i = 0; i < sr->numnodes && inflight < sr->window; i++) {
+            struct search_node *n = &sr->nodes[order[i]];
+            if((n->pinged == 0) != (pass == 0))
+                continue;
+            if(search_send_get_peers(sr, n)) {
+                inflight++;
+                sent++;
+            }
+        }
+    }
+
+    return sent;
+}
+
+/* Step the search when its next request times out.  The jitter keeps
+   the steps of many searches apart. */
+static void
+search_reschedule(struct search *sr)
+{
+    search_schedule(sr, search_expiry(sr) + random() % (DHT_RTO_MIN / 5));
+}
+
 /* Insert a new node into any incomplete search. */
 static void
 add_search_node(const unsigned char *id, const struct sockaddr *sa, int salen)
 {
-    struct search *sr;
-    for(sr = searches; sr; sr = sr->next) {
-        if(sr->af == sa->sa_family && sr->numnodes < SEARCH_NODES) {
-            struct search_node *n =
-                insert_search_node(id, sa, salen, sr, 0, NULL, 0);
-            if(n)
-                search_send_get_peers(sr, n);
-        }
+    struct search *sr = open_searches[sa->sa_family == AF_INET6];
+    while(sr) {
+        /* The search leaves the list once it is full. */
+        struct search *next = sr->open_next;
+        struct search_node *n =
+            insert_search_node(id, sa, salen, sr, 0, NULL, 0);
+        if(n)
+            search_send_requests(sr);
+        sr = next;
     }
 }
 
@@ -1195,11 +2030,13 @@ search_step(struct search *sr, dht_callback_t *callback, void *closure)
     int i, j;
     int all_done = 1;
 
-    /* Check if the first 8 live nodes have replied. */
+    /* Check if the first 8 live nodes have replied.  Nodes that did not
+       reply in time are skipped, so the search ends as soon as the
+       closest responding nodes are known. */
     j = 0;
     for(i = 0; i < sr->numnodes && j < 8; i++) {
         struct search_node *n = &sr->nodes[i];
-        if(n->pinged >= 3)
+        if(n->pinged >= 3 || search_node_stale(sr, n))
             continue;
         if(!n->replied) {
             all_done = 0;
@@ -1227,17 +2064,24 @@ search_step(struct search *sr, dht_callback_t *callback, void *closure)
                 if(n->token_len == 0)
                     n->acked = 1;
                 if(!n->acked) {
+                    struct sockaddr_storage ss;
+                    int sslen;
                     all_acked = 0;
+                    /* Wait for the reply to the last announcement. */
+                    if(n->request_time > now - search_node_timeout(sr, n)) {
+                        j++;
+                        continue;
+                    }
                     debugf("Sending announce_peer.\n");
                     make_tid(tid, "ap", sr->tid);
-                    send_announce_peer((struct sockaddr*)&n->ss,
-                                       sizeof(struct sockaddr_storage),
+                    sslen = node_sockaddr(&n->addr, (struct sockaddr*)&ss);
+                    send_announce_peer((struct sockaddr*)&ss, sslen,
                                        tid, 4, sr->id, sr->port,
                                        n->token, n->token_len,
-                                       n->reply_time >= now.tv_sec - 15);
+                                       n->reply_time >= now - 15 * 1000);
                     n->pinged++;
-                    n->request_time = now.tv_sec;
-                    node = find_node(n->id, n->ss.ss_family);
+                    n->request_time = now;
+                    node = find_node(n->id, n->addr.family);
                     if(node) pinged(node, NULL);
                 }
                 j++;
@@ -1245,34 +2089,33 @@ search_step(struct search *sr, dht_callback_t *callback, void *closure)
             if(all_acked)
                 goto done;
         }
-        sr->step_time = now.tv_sec;
+        sr->step_time = now;
         return;
     }
 
-    if(sr->step_time + DHT_SEARCH_RETRANSMIT >= now.tv_sec)
+    if(search_expiry(sr) > now)
         return;
 
-    j = 0;
-    for(i = 0; i < sr->numnodes; i++) {
-        j += search_send_get_peers(sr, &sr->nodes[i]);
-        if(j >= DHT_INFLIGHT_QUERIES)
-            break;
-    }
-    sr->step_time = now.tv_sec;
+    search_send_requests(sr);
+    sr->step_time = now;
     return;
 
  done:
+    search_account(sr, -1);
     sr->done = 1;
+    search_account(sr, 1);
+    search_unschedule(sr);
     if(callback)
         (*callback)(closure,
                     sr->af == AF_INET ?
                     DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
                     sr->id, NULL, 0);
-    sr->step_time = now.tv_sec;
+    sr->step_time = now;
 }
 
+/* Reusing a slot expires its search, see expire_searches. */
 static struct search *
-new_search(void)
+new_search(dht_callback_t *callback, void *closure)
 {
     struct search *sr, *oldest = NULL;
 
@@ -1285,14 +2128,23 @@ new_search(void)
         sr = sr->next;
     }
 
-    /* The oldest slot is expired. */
-    if(oldest && oldest->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME)
+    /* The oldest slot is expired.  The caller counts and indexes it
+       again. */
+    if(oldest && oldest->step_time < now - DHT_SEARCH_EXPIRE_TIME) {
+        search_account(oldest, -1);
+        search_unhash(oldest);
+        search_unschedule(oldest);
+        search_set_open(oldest, 0);
+        if(callback)
+            (*callback)(closure, DHT_EVENT_SEARCH_EXPIRED, oldest->id, NULL, 0);
         return oldest;
+    }
 
     /* Allocate a new slot. */
     if(numsearches < DHT_MAX_SEARCHES) {
-        sr = calloc(1, sizeof(struct search));
+        sr = DHT_SEARCH_ALLOC();
         if(sr != NULL) {
+            sr->queue_index = -1;
             sr->next = searches;
             searches = sr;
             numsearches++;
@@ -1301,6 +2153,14 @@ new_search(void)
     }
 
     /* Oh, well, never mind.  Reuse the oldest slot. */
+    if(oldest) {
+        search_account(oldest, -1);
+        search_unhash(oldest);
+        search_unschedule(oldest);
+        search_set_open(oldest, 0);
+        if(callback)
+            (*callback)(closure, DHT_EVENT_SEARCH_EXPIRED, oldest->id, NULL, 0);
+    }
     return oldest;
 }
 
@@ -1308,10 +2168,13 @@ new_search(void)
 static void
 insert_search_bucket(struct bucket *b, struct search *sr)
 {
+    struct sockaddr_storage ss;
     struct node *n;
+    int sslen;
     n = b->nodes;
     while(n) {
-        insert_search_node(n->id, (struct sockaddr*)&n->ss, n->sslen,
+        sslen = node_sockaddr(&n->addr, (struct sockaddr*)&ss);
+        insert_search_node(n->id, (struct sockaddr*)&ss, sslen,
                            sr, 0, NULL, 0);
         n = n->next;
     }
@@ -1325,8 +2188,12 @@ dht_search(const unsigned char *id, int port, int af,
 {
     struct search *sr;
     struct storage *st;
-    struct bucket *b = find_bucket(id, af);
+    struct bucket *b;
 
+    /* Requests are timestamped for the round trip time. */
+    now = dht_time_ms();
+
+    b = find_bucket(id, af);
     if(b == NULL) {
         errno = EAFNOSUPPORT;
         return -1;
@@ -1362,12 +2229,7 @@ dht_search(const unsigned char *id, int port, int af,
         }
     }
 
-    sr = searches;
-    while(sr) {
-        if(sr->af == af && id_cmp(sr->id, id) == 0)
-            break;
-        sr = sr->next;
-    }
+    sr = find_search_id(id, af);
 
     int sr_duplicate = sr && !sr->done;
 
@@ -1375,13 +2237,16 @@ dht_search(const unsigned char *id, int port, int af,
         /* We're reusing data from an old search.  Reusing the same tid
            means that we can merge replies for both searches. */
         int i;
+        search_account(sr, -1);
         sr->done = 0;
+        search_account(sr, 1);
+        sr->window = DHT_INFLIGHT_QUERIES;
     again:
         for(i = 0; i < sr->numnodes; i++) {
             struct search_node *n;
             n = &sr->nodes[i];
             /* Discard any doubtful nodes. */
-            if(n->pinged >= 3 || n->reply_time < now.tv_sec - 7200) {
+            if(n->pinged >= 3 || n->reply_time < now - 7200 * 1000) {
                 flush_search_node(n, sr);
                 goto again;
             }
@@ -1391,7 +2256,7 @@ dht_search(const unsigned char *id, int port, int af,
             n->acked = 0;
         }
     } else {
-        sr = new_search();
+        sr = new_search(callback, closure);
         if(sr == NULL) {
             errno = ENOSPC;
             return -1;
@@ -1402,6 +2267,12 @@ dht_search(const unsigned char *id, int port, int af,
         memcpy(sr->id, id, 20);
         sr->done = 0;
         sr->numnodes = 0;
+        sr->window = DHT_INFLIGHT_QUERIES;
+        sr->srtt = 0;
+        sr->rttvar = 0;
+        search_account(sr, 1);
+        search_hash(sr);
+        search_set_open(sr, 1);
     }
 
     sr->port = port;
@@ -1410,16 +2281,17 @@ dht_search(const unsigned char *id, int port, int af,
 
     if(sr->numnodes < SEARCH_NODES) {
         struct bucket *p = previous_bucket(b);
-        if(b->next)
-            insert_search_bucket(b->next, sr);
+        if(next_bucket(b))
+            insert_search_bucket(next_bucket(b), sr);
         if(p)
             insert_search_bucket(p, sr);
     }
     if(sr->numnodes < SEARCH_NODES)
-        insert_search_bucket(find_bucket(myid, af), sr);
+        insert_search_bucket(find_bucket(self->myid, af), sr);
 
     search_step(sr, callback, closure);
-    search_time = now.tv_sec;
+    if(!sr->done)
+        search_reschedule(sr);
     if(sr_duplicate) {
         return 0;
     } else {
@@ -1484,7 +2356,7 @@ storage_store(const unsigned char *id,
 
     if(i < st->numpeers) {
         /* Already there, only need to refresh */
-        st->peers[i].time = now.tv_sec;
+        st->peers[i].time = now;
         return 0;
     } else {
         struct peer *p;
@@ -1503,7 +2375,8 @@ storage_store(const unsigned char *id,
             st->maxpeers = n;
         }
         p = &st->peers[st->numpeers++];
-        p->time = now.tv_sec;
+        numstorage_peers++;
+        p->time = now;
         p->len = len;
         memcpy(p->ip, ip, len);
         p->port = port;
@@ -1518,10 +2391,11 @@ expire_storage(void)
     while(st) {
         int i = 0;
         while(i < st->numpeers) {
-            if(st->peers[i].time < now.tv_sec - 32 * 60) {
+            if(st->peers[i].time < now - 32 * 60 * 1000) {
                 if(i != st->numpeers - 1)
                     st->peers[i] = st->peers[st->numpeers - 1];
                 st->numpeers--;
+                numstorage_peers--;
             } else {
                 i++;
             }
@@ -1556,7 +2430,7 @@ rotate_secrets(void)
 {
     int rc;
 
-    rotate_secrets_time = now.tv_sec + 900 + random() % 1800;
+    rotate_secrets_time = now + 900 * 1000 + random() % (1800 * 1000);
 
     memcpy(oldsecret, secret, sizeof(secret));
     rc = dht_random_bytes(secret, sizeof(secret));
@@ -1617,7 +2491,7 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
           int *incoming_return)
 {
     int good = 0, dubious = 0, cached = 0, incoming = 0;
-    struct bucket *b = af == AF_INET ? buckets : buckets6;
+    struct bucket *b = first_bucket(af);
 
     while(b) {
         struct node *n = b->nodes;
@@ -1631,9 +2505,8 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
             }
             n = n->next;
         }
-        if(b->cached.ss_family > 0)
-            cached++;
-        b = b->next;
+        cached += b->cache_count;
+        b = next_bucket(b);
     }
     if(good_return)
         *good_return = good;
@@ -1652,38 +2525,33 @@ dump_bucket(FILE *f, struct bucket *b)
     struct node *n = b->nodes;
     fprintf(f, "Bucket ");
     print_hex(f, b->first, 20);
-    fprintf(f, " count %d/%d age %d%s%s:\n",
-            b->count, b->max_count, (int)(now.tv_sec - b->time),
-            in_bucket(myid, b) ? " (mine)" : "",
-            b->cached.ss_family ? " (cached)" : "");
+    fprintf(f, " count %d/%d age %d%s cached %d:\n",
+            b->count, b->max_count, (int)((now - b->time) / 1000),
+            in_bucket(self->myid, b) ? " (mine)" : "",
+            b->cache_count);
     while(n) {
         char buf[512];
         unsigned short port;
         fprintf(f, "    Node ");
         print_hex(f, n->id, 20);
-        if(n->ss.ss_family == AF_INET) {
-            struct sockaddr_in *sin = (struct sockaddr_in*)&n->ss;
-            inet_ntop(AF_INET, &sin->sin_addr, buf, 512);
-            port = ntohs(sin->sin_port);
-        } else if(n->ss.ss_family == AF_INET6) {
-            struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&n->ss;
-            inet_ntop(AF_INET6, &sin6->sin6_addr, buf, 512);
-            port = ntohs(sin6->sin6_port);
+        if(n->addr.family == AF_INET || n->addr.family == AF_INET6) {
+            inet_ntop(n->addr.family, n->addr.ip, buf, 512);
+            port = ntohs(n->addr.port);
         } else {
-            snprintf(buf, 512, "unknown(%d)", n->ss.ss_family);
+            snprintf(buf, 512, "unknown(%d)", n->addr.family);
             port = 0;
         }
 
-        if(n->ss.ss_family == AF_INET6)
+        if(n->addr.family == AF_INET6)
             fprintf(f, " [%s]:%d ", buf, port);
         else
             fprintf(f, " %s:%d ", buf, port);
         if(n->time != n->reply_time)
             fprintf(f, "age %ld, %ld",
-                    (long)(now.tv_sec - n->time),
-                    (long)(now.tv_sec - n->reply_time));
+                    (long)((now - n->time) / 1000),
+                    (long)((now - n->reply_time) / 1000));
         else
-            fprintf(f, "age %ld", (long)(now.tv_sec - n->time));
+            fprintf(f, "age %ld", (long)((now - n->time) / 1000));
         if(n->pinged)
             fprintf(f, " (%d)", n->pinged);
         if(node_good(n))
@@ -1703,27 +2571,27 @@ dht_dump_tables(FILE *f)
     struct search *sr = searches;
 
     fprintf(f, "My id ");
-    print_hex(f, myid, 20);
+    print_hex(f, self->myid, 20);
     fprintf(f, "\n");
 
-    b = buckets;
+    b = first_bucket(AF_INET);
     while(b) {
         dump_bucket(f, b);
-        b = b->next;
+        b = next_bucket(b);
     }
 
     fprintf(f, "\n");
 
-    b = buckets6;
+    b = first_bucket(AF_INET6);
     while(b) {
         dump_bucket(f, b);
-        b = b->next;
+        b = next_bucket(b);
     }
 
     while(sr) {
         fprintf(f, "\nSearch%s id ", sr->af == AF_INET6 ? " (IPv6)" : "");
         print_hex(f, sr->id, 20);
-        fprintf(f, " age %d%s\n", (int)(now.tv_sec - sr->step_time),
+        fprintf(f, " age %d%s\n", (int)((now - sr->step_time) / 1000),
                sr->done ? " (done)" : "");
         for(i = 0; i < sr->numnodes; i++) {
             struct search_node *n = &sr->nodes[i];
@@ -1731,8 +2599,8 @@ dht_dump_tables(FILE *f)
             print_hex(f, n->id, 20);
             fprintf(f, " bits %d age ", common_bits(sr->id, n->id));
             if(n->request_time)
-                fprintf(f, "%d, ", (int)(now.tv_sec - n->request_time));
-            fprintf(f, "%d", (int)(now.tv_sec - n->reply_time));
+                fprintf(f, "%d, ", (int)((now - n->request_time) / 1000));
+            fprintf(f, "%d", (int)((now - n->reply_time) / 1000));
             if(n->pinged)
                 fprintf(f, " (%d)", n->pinged);
             fprintf(f, "%s%s.\n",
@@ -1759,7 +2627,7 @@ dht_dump_tables(FILE *f)
             }
             fprintf(f, " %s:%u (%ld)",
                     buf, st->peers[i].port,
-                    (long)(now.tv_sec - st->peers[i].time));
+                    (long)((now - st->peers[i].time) / 1000));
         }
         st = st->next;
     }
@@ -1768,39 +2636,97 @@ dht_dump_tables(FILE *f)
     fflush(f);
 }
 
+/* Allocate the state of an id with an empty bucket for each of its
+   sockets and make it the current id. */
+static int
+new_id(const unsigned char *id, int s, int s6)
+{
+    struct dht_id *d;
+
+    if(numids >= DHT_MAX_IDS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    d = calloc(1, sizeof(struct dht_id));
+    if(d == NULL)
+        return -1;
+
+    self = d;
+
+    if(s >= 0) {
+        struct bucket *b = calloc(1, sizeof(struct bucket));
+        if(b == NULL)
+            goto fail;
+        b->max_count = MAX(128, bucket_size);
+        b->af = AF_INET;
+        if(insert_bucket(b, 0) < 0) {
+            free(b);
+            goto fail;
+        }
+    }
+
+    if(s6 >= 0) {
+        struct bucket *b = calloc(1, sizeof(struct bucket));
+        if(b == NULL)
+            goto fail;
+        b->max_count = MAX(128, bucket_size);
+        b->af = AF_INET6;
+        if(insert_bucket(b, 0) < 0) {
+            free(b);
+            goto fail;
+        }
+    }
+
+    memcpy(d->myid, id, 20);
+    d->socket = s;
+    d->socket6 = s6;
+    memcpy(d->query_prefix, "d1:ad2:id20:", 12);
+    memcpy(d->query_prefix + 12, d->myid, 20);
+    memcpy(d->reply_prefix, "d1:rd2:id20:", 12);
+    memcpy(d->reply_prefix + 12, d->myid, 20);
+
+    d->mybucket_grow_time = now;
+    d->mybucket6_grow_time = now;
+    d->confirm_nodes_time = now + random() % (3 * 1000);
+    d->index = numids;
+    ids[numids++] = d;
+    return 1;
+
+ fail:
+    free_buckets(&d->buckets);
+    free_buckets(&d->buckets6);
+    free(d);
+    self = numids > 0 ? ids[0] : NULL;
+    return -1;
+}
+
 int
 dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
 {
     int rc;
 
-    if(dht_socket >= 0 || dht_socket6 >= 0 || buckets || buckets6) {
+    if(numids > 0) {
         errno = EBUSY;
         return -1;
     }
 
     searches = NULL;
     numsearches = 0;
+    memset(numsearches_state, 0, sizeof(numsearches_state));
+    memset(searches_by_tid, 0, sizeof(searches_by_tid));
+    memset(searches_by_id, 0, sizeof(searches_by_id));
 
     storage = NULL;
     numstorage = 0;
+    numstorage_peers = 0;
 
-    if(s >= 0) {
-        buckets = calloc(1, sizeof(struct bucket));
-        if(buckets == NULL)
-            return -1;
-        buckets->max_count = 128;
-        buckets->af = AF_INET;
-    }
+    now = dht_time_ms();
 
-    if(s6 >= 0) {
-        buckets6 = calloc(1, sizeof(struct bucket));
-        if(buckets6 == NULL)
-            return -1;
-        buckets6->max_count = 128;
-        buckets6->af = AF_INET6;
-    }
+    rc = new_id(id, s, s6);
+    if(rc < 0)
+        return -1;
 
-    memcpy(myid, id, 20);
     if(v) {
         memcpy(my_v, "1:v4:", 5);
         memcpy(my_v + 5, v, 4);
@@ -1809,73 +2735,113 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
         have_v = 0;
     }
 
-    dht_gettimeofday(&now, NULL);
-
-    mybucket_grow_time = now.tv_sec;
-    mybucket6_grow_time = now.tv_sec;
-    confirm_nodes_time = now.tv_sec + random() % 3;
-
     search_id = random() & 0xFFFF;
-    search_time = 0;
+    search_queue_len = 0;
+    memset(open_searches, 0, sizeof(open_searches));
 
     next_blacklisted = 0;
 
-    token_bucket_time = now.tv_sec;
-    token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
+    token_bucket_time = now;
+    token_bucket_tokens = TOKEN_BUCKET_SECONDS * request_rate;
 
     memset(secret, 0, sizeof(secret));
     rc = rotate_secrets();
     if(rc < 0)
         goto fail;
 
-    dht_socket = s;
-    dht_socket6 = s6;
-
-    expire_buckets(buckets);
-    expire_buckets(buckets6);
+    expire_buckets(AF_INET);
+    expire_buckets(AF_INET6);
 
     return 1;
 
  fail:
-    free(buckets);
-    buckets = NULL;
-    free(buckets6);
-    buckets6 = NULL;
+    free_buckets(&self->buckets);
+    free_buckets(&self->buckets6);
+    free(self);
+    ids[0] = self = NULL;
+    numids = 0;
     return -1;
 }
 
+/* Set the minimum bucket size and split all buckets up to a depth, the
+   table then holds up to k * 2^depth nodes.  This is meant for bootstrap
+   nodes and must be called before dht_init.  Tables of more than
+   60 * DHT_MAINTENANCE_BATCH buckets are not refreshed every 10 minutes,
+   see bucket_maintenance. */
 int
-dht_uninit(void)
+dht_set_buckets(int k, int depth)
 {
-    if(dht_socket < 0 && dht_socket6 < 0) {
+    if(numids > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if(k < 8 || depth < 0 || depth >= 160) {
         errno = EINVAL;
         return -1;
     }
 
-    dht_socket = -1;
-    dht_socket6 = -1;
+    bucket_size = k;
+    split_depth = depth;
+    return 1;
+}
 
-    while(buckets) {
-        struct bucket *b = buckets;
-        buckets = b->next;
-        while(b->nodes) {
-            struct node *n = b->nodes;
-            b->nodes = n->next;
-            free(n);
-        }
-        free(b);
+/* Answer up to rate requests per second, all requests if rate is 0. */
+int
+dht_set_rate(int rate)
+{
+    if(numids > 0) {
+        errno = EBUSY;
+        return -1;
     }
 
-    while(buckets6) {
-        struct bucket *b = buckets6;
-        buckets6 = b->next;
-        while(b->nodes) {
-            struct node *n = b->nodes;
-            b->nodes = n->next;
-            free(n);
-        }
-        free(b);
+    if(rate < 0 || rate > INT_MAX / TOKEN_BUCKET_SECONDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    request_rate = rate;
+    return 1;
+}
+
+/* Serve another node id on its own sockets.  It gets its own routing
+   table, which is filled with the help of the first id. */
+int
+dht_add_id(int s, int s6, const unsigned char *id)
+{
+    int rc;
+
+    if(numids == 0 || (s < 0 && s6 < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(is_my_id(id)) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    rc = new_id(id, s, s6);
+    self = ids[0];
+    return rc;
+}
+
+int
+dht_uninit(void)
+{
+    if(numids == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while(numids > 0) {
+        struct dht_id *d = ids[--numids];
+        self = d;
+        free_buckets(&d->buckets);
+        free_buckets(&d->buckets6);
+        free(d);
     }
+    self = NULL;
 
     while(storage) {
         struct storage *st = storage;
@@ -1887,27 +2853,87 @@ dht_uninit(void)
     while(searches) {
         struct search *sr = searches;
         searches = searches->next;
-        free(sr);
+        DHT_SEARCH_FREE(sr);
     }
+    memset(searches_by_tid, 0, sizeof(searches_by_tid));
+    memset(searches_by_id, 0, sizeof(searches_by_id));
+    search_queue_len = 0;
+    memset(open_searches, 0, sizeof(open_searches));
 
     return 1;
 }
 
-/* Rate control for requests we receive. */
+/* Rate control for requests we receive.  The bucket is shared by the
+   threads that call dht_answer, so it is only updated atomically. */
 
 static int
 token_bucket(void)
 {
-    if(token_bucket_tokens == 0) {
-        token_bucket_tokens = MIN(MAX_TOKEN_BUCKET_TOKENS,
-                                  100 * (now.tv_sec - token_bucket_time));
-        token_bucket_time = now.tv_sec;
+    int tokens;
+
+    if(request_rate == 0)
+        return 1;
+
+    tokens = __atomic_load_n(&token_bucket_tokens, __ATOMIC_RELAXED);
+    if(tokens == 0) {
+        int64_t last = __atomic_load_n(&token_bucket_time, __ATOMIC_RELAXED);
+        int64_t add = (now - last) * request_rate / 1000;
+        /* Only the thread that moves the time refills. */
+        if(add > 0 &&
+           __atomic_compare_exchange_n(&token_bucket_time, &last, now, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            tokens = __atomic_add_fetch(&token_bucket_tokens,
+                                        MIN(TOKEN_BUCKET_SECONDS *
+                                            request_rate, add),
+                                        __ATOMIC_RELAXED);
+    }
+
+    while(tokens > 0) {
+        if(__atomic_compare_exchange_n(&token_bucket_tokens,
+                                       &tokens, tokens - 1, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
     }
 
-    if(token_bucket_tokens == 0)
+    return 0;
+}
+
+/* An additional id starts with an empty routing table.  Until it knows
+   a few nodes, ask the nodes of the first id about its neighbourhood.
+   The request is sent from the sockets of this id, so the reply comes
+   back to it.  The node is not marked as pinged. */
+static int
+bootstrap_maintenance(int af)
+{
+    struct dht_id *d = self;
+    struct sockaddr_storage ss;
+    unsigned char tid[4];
+    struct bucket_table *t;
+    struct bucket *b;
+    struct node *n = NULL;
+    int sslen;
+
+    if(d == ids[0] || bucket_table(af)->count == 0 ||
+       bucket_table(af)->nodes >= 8)
+        return 0;
+
+    self = ids[0];
+    t = bucket_table(af);
+    b = find_bucket(d->myid, af);
+    if(b)
+        n = random_node(b);
+    if(n == NULL && t->count > 0)
+        n = random_node(t->list[random() % t->count]);
+    self = d;
+
+    if(n == NULL)
         return 0;
 
-    token_bucket_tokens--;
+    debugf("Sending find_node for%s bootstrap of id %d.\n",
+           af == AF_INET6 ? " IPv6" : "", d->index);
+    make_tid(tid, "fn", 0);
+    sslen = node_sockaddr(&n->addr, (struct sockaddr*)&ss);
+    send_find_node((struct sockaddr*)&ss, sslen, tid, 4, d->myid, -1, 0);
     return 1;
 }
 
@@ -1915,18 +2941,18 @@ static int
 neighbourhood_maintenance(int af)
 {
     unsigned char id[20];
-    struct bucket *b = find_bucket(myid, af);
+    struct bucket *b = find_bucket(self->myid, af);
     struct bucket *q;
     struct node *n;
 
     if(b == NULL)
         return 0;
 
-    memcpy(id, myid, 20);
+    memcpy(id, self->myid, 20);
     id[19] = random() & 0xFF;
     q = b;
-    if(q->next && (q->count == 0 || (random() & 7) == 0))
-        q = b->next;
+    if(next_bucket(q) && (q->count == 0 || (random() & 7) == 0))
+        q = next_bucket(b);
     if(q->count == 0 || (random() & 7) == 0) {
         struct bucket *r;
         r = previous_bucket(b);
@@ -1937,16 +2963,20 @@ neighbourhood_maintenance(int af)
     if(q) {
         /* Since our node-id is the same in both DHTs, it's probably
            profitable to query both families. */
-        int want = dht_socket >= 0 && dht_socket6 >= 0 ? (WANT4 | WANT6) : -1;
+        int want =
+            self->socket >= 0 && self->socket6 >= 0 ? (WANT4 | WANT6) : -1;
         n = random_node(q);
         if(n) {
+            struct sockaddr_storage ss;
             unsigned char tid[4];
+            int sslen;
             debugf("Sending find_node for%s neighborhood maintenance.\n",
                    af == AF_INET6 ? " IPv6" : "");
             make_tid(tid, "fn", 0);
-            send_find_node((struct sockaddr*)&n->ss, n->sslen,
+            sslen = node_sockaddr(&n->addr, (struct sockaddr*)&ss);
+            send_find_node((struct sockaddr*)&ss, sslen,
                            tid, 4, id, want,
-                           n->reply_time >= now.tv_sec - 15);
+                           n->reply_time >= now - 15 * 1000);
             pinged(n, q);
         }
         return 1;
@@ -1957,15 +2987,27 @@ neighbourhood_maintenance(int af)
 static int
 bucket_maintenance(int af)
 {
-    struct bucket *b;
+    struct bucket_table *t = bucket_table(af);
+    int64_t maintenance_time = INT64_MAX;
+    int i, batch, sent = 0;
 
-    b = af == AF_INET ? buckets : buckets6;
+    /* Large tables of bootstrap nodes are only scanned when a bucket
+       may have become stale. */
+    if(now < t->maintenance_time)
+        return 0;
 
-    while(b) {
+    /* A cycle takes 10 seconds on average.  Refresh enough buckets per
+       cycle to go through the whole table within 10 minutes, but do not
+       send more than DHT_MAINTENANCE_BATCH queries at once. */
+    batch = MIN(1 + t->count / 60, DHT_MAINTENANCE_BATCH);
+
+    for(i = 0; i < t->count; i++) {
+        /* Continue after the bucket maintained last time. */
+        struct bucket *b = t->list[(t->maintenance_index + i) % t->count];
         /* 10 minutes for an 8-node bucket */
-        int to = MAX(600 / (b->max_count / 8), 30);
+        int64_t to = MAX(600 / (b->max_count / 8), 30) * 1000;
         struct bucket *q;
-        if(b->time < now.tv_sec - to) {
+        if(b->time < now - to) {
             /* This bucket hasn't seen any positive confirmation for a long
                time.  Pick a random id in this bucket's range, and send
                a request to a random node. */
@@ -1981,8 +3023,8 @@ bucket_maintenance(int af)
             /* If the bucket is empty, we try to fill it from a neighbour.
                We also sometimes do it gratuitiously to recover from
                buckets full of broken nodes. */
-            if(q->next && (q->count == 0 || (random() & 7) == 0))
-                q = b->next;
+            if(next_bucket(q) && (q->count == 0 || (random() & 7) == 0))
+                q = next_bucket(b);
             if(q->count == 0 || (random() & 7) == 0) {
                 struct bucket *r;
                 r = previous_bucket(b);
@@ -1993,10 +3035,12 @@ bucket_maintenance(int af)
             if(q) {
                 n = random_node(q);
                 if(n) {
+                    struct sockaddr_storage ss;
                     unsigned char tid[4];
                     int want = -1;
+                    int sslen;
 
-                    if(dht_socket >= 0 && dht_socket6 >= 0) {
+                    if(self->socket >= 0 && self->socket6 >= 0) {
                         struct bucket *otherbucket;
                         otherbucket =
                             find_bucket(id, af == AF_INET ? AF_INET6 : AF_INET);
@@ -2016,62 +3060,261 @@ bucket_maintenance(int af)
                     debugf("Sending find_node for%s bucket maintenance.\n",
                            af == AF_INET6 ? " IPv6" : "");
                     make_tid(tid, "fn", 0);
-                    send_find_node((struct sockaddr*)&n->ss, n->sslen,
+                    sslen = node_sockaddr(&n->addr, (struct sockaddr*)&ss);
+                    send_find_node((struct sockaddr*)&ss, sslen,
                                    tid, 4, id, want,
-                                   n->reply_time >= now.tv_sec - 15);
+                                   n->reply_time >= now - 15 * 1000);
                     pinged(n, q);
-                    /* In order to avoid sending queries back-to-back,
-                       give up for now and reschedule us soon. */
-                    return 1;
+                    t->maintenance_index = b->index + 1;
+                    /* Give up for now once the batch is sent, and
+                       reschedule us soon. */
+                    if(++sent >= batch)
+                        return 1;
+                    continue;
                 }
             }
         }
-        b = b->next;
+        maintenance_time = MIN(maintenance_time, b->time + to);
     }
+
+    /* The refreshed buckets stay stale until a reply arrives. */
+    if(sent > 0)
+        return 1;
+
+    t->maintenance_time = maintenance_time;
     return 0;
 }
 
+/* Maintain the routing table of the current id. */
+static void
+confirm_nodes(void)
+{
+    int soon = 0;
+
+    soon |= bootstrap_maintenance(AF_INET);
+    soon |= bootstrap_maintenance(AF_INET6);
+    soon |= bucket_maintenance(AF_INET);
+    soon |= bucket_maintenance(AF_INET6);
+
+    if(!soon) {
+        if(self->mybucket_grow_time >= now - 150 * 1000)
+            soon |= neighbourhood_maintenance(AF_INET);
+        if(self->mybucket6_grow_time >= now - 150 * 1000)
+            soon |= neighbourhood_maintenance(AF_INET6);
+    }
+
+    /* Given the timeouts in bucket_maintenance, with a 22-bucket
+       table, worst case is a ping every 18 seconds (22 buckets plus
+       11 buckets overhead for the larger buckets).  Keep the "soon"
+       case within 15 seconds, which gives some margin for neighbourhood
+       maintenance.  Larger tables refresh several buckets per cycle. */
+
+    if(soon)
+        self->confirm_nodes_time = now + 5 * 1000 + random() % (10 * 1000);
+    else
+        self->confirm_nodes_time = now + 60 * 1000 + random() % (120 * 1000);
+}
+
+/* Parse a received message and select the id that handles it.  Returns
+   the type of the message, or -1 if it is dropped. */
+static int
+receive_message(int s, const void *buf, size_t buflen,
+                const struct sockaddr *from, int fromlen,
+                struct parsed_message *m)
+{
+    int message;
+
+    if(is_martian(from))
+        return -1;
+
+    if(node_blacklisted(from, fromlen)) {
+        debugf("Received packet from blacklisted node.\n");
+        return -1;
+    }
+
+    message = parse_message(buf, buflen, m);
+
+    if(message < 0 || message == ERROR || id_cmp(m->id, zeroes) == 0) {
+        debugf("Unparseable message: ");
+        debug_printable(buf, buflen);
+        debugf("\n");
+        return -1;
+    }
+
+    if(is_my_id(m->id)) {
+        debugf("Received message from self.\n");
+        return -1;
+    }
+
+    self = socket_id(s);
+    return message;
+}
+
+/* Answer a ping, find_node or get_peers.  Nothing but node_seen
+   modifies the tables, see dht_answer. */
+static void
+answer_request(int message, const struct parsed_message *m,
+               const struct sockaddr *from, int fromlen)
+{
+    switch(message) {
+    case PING:
+        debugf("Ping (%d)!\n", m->tid_len);
+        node_seen(m->id, from, fromlen);
+        debugf("Sending pong.\n");
+        send_pong(from, fromlen, m->tid, m->tid_len);
+        break;
+    case FIND_NODE:
+        debugf("Find node!\n");
+        node_seen(m->id, from, fromlen);
+        debugf("Sending closest nodes (%d).\n", m->want);
+        send_closest_nodes(from, fromlen,
+                           m->tid, m->tid_len, m->target, m->want,
+                           0, NULL, NULL, 0);
+        break;
+    case GET_PEERS:
+        debugf("Get_peers!\n");
+        node_seen(m->id, from, fromlen);
+        if(id_cmp(m->info_hash, zeroes) == 0) {
+            debugf("Eek!  Got get_peers with no info_hash.\n");
+            send_error(from, fromlen, m->tid, m->tid_len,
+                       203, "Get_peers with no info_hash");
+        } else {
+            struct storage *st = find_storage(m->info_hash);
+            unsigned char token[TOKEN_SIZE];
+            make_token(from, 0, token);
+            if(st && st->numpeers > 0) {
+                 debugf("Sending found%s peers.\n",
+                        from->sa_family == AF_INET6 ? " IPv6" : "");
+                 send_closest_nodes(from, fromlen,
+                                    m->tid, m->tid_len,
+                                    m->info_hash, m->want,
+                                    from->sa_family, st,
+                                    token, TOKEN_SIZE);
+            } else {
+                debugf("Sending nodes for get_peers.\n");
+                send_closest_nodes(from, fromlen,
+                                   m->tid, m->tid_len, m->info_hash, m->want,
+                                   0, NULL, token, TOKEN_SIZE);
+            }
+        }
+        break;
+    }
+}
+
+/* Answer a request without modifying the routing tables, the searches
+   or the storage.  Several threads may call this at the same time, as
+   long as no thread is in any other function of this file except
+   dht_answer_flush.  The nodes that sent the requests are added to the
+   routing table after dht_answer_flush.  Returns 0 if the message must
+   be passed to dht_periodic instead and 1 if it was handled. */
+int
+dht_answer(int s, const void *buf, size_t buflen,
+           const struct sockaddr *from, int fromlen)
+{
+    struct parsed_message m;
+    int message;
+
+    if(((const char*)buf)[buflen] != '\0') {
+        debugf("Unterminated message.\n");
+        return 1;
+    }
+
+    now = dht_time_ms();
+
+    message = receive_message(s, buf, buflen, from, fromlen, &m);
+    if(message < 0)
+        return 1;
+
+    if(message != PING && message != FIND_NODE && message != GET_PEERS)
+        return 0;
+
+    if(!token_bucket()) {
+        debugf("Dropping request due to rate limiting.\n");
+        return 1;
+    }
+
+    read_only = 1;
+    answer_request(message, &m, from, fromlen);
+    read_only = 0;
+
+    return 1;
+}
+
+/* Hand the nodes remembered by dht_answer on this thread over to the
+   next call to dht_periodic, which may run on another thread at the
+   same time.  Returns 1 if they fill half of the buffer and
+   dht_periodic should be called soon, 0 otherwise. */
 int
-dht_periodic(const void *buf, size_t buflen,
+dht_answer_flush(void)
+{
+    struct seen_node *pending;
+    int n, half;
+
+    if(numseen == 0)
+        return 0;
+
+    DHT_SEEN_LOCK();
+    pending = seen_pending[seen_pending_index];
+    n = MIN(numseen, DHT_MAX_SEEN_PENDING - numseen_pending);
+    memcpy(pending + numseen_pending, seen, n * sizeof(struct seen_node));
+    half = numseen_pending < DHT_MAX_SEEN_PENDING / 2 &&
+        numseen_pending + n >= DHT_MAX_SEEN_PENDING / 2;
+    numseen_pending += n;
+    DHT_SEEN_UNLOCK();
+
+    numseen = 0;
+    return half;
+}
+
+int
+dht_periodic(int s, const void *buf, size_t buflen,
              const struct sockaddr *from, int fromlen,
-             time_t *tosleep,
+             int64_t *tosleep,
              dht_callback_t *callback, void *closure)
 {
-    dht_gettimeofday(&now, NULL);
+    struct seen_node *pending;
+    int64_t confirm_time;
+    int i, count;
+
+    now = dht_time_ms();
+
+    /* Add the nodes that sent requests answered by dht_answer. */
+    dht_answer_flush();
+    DHT_SEEN_LOCK();
+    pending = seen_pending[seen_pending_index];
+    count = numseen_pending;
+    seen_pending_index ^= 1;
+    numseen_pending = 0;
+    DHT_SEEN_UNLOCK();
+
+    for(i = 0; i < count; i++) {
+        self = pending[i].d;
+        new_node(pending[i].id, (struct sockaddr*)&pending[i].ss,
+                 pending[i].sslen, 1);
+    }
+
+    /* dht_answer cannot rebuild the encoding of changed buckets. */
+    for(i = 0; i < numids; i++) {
+        self = ids[i];
+        count_good(AF_INET);
+        count_good(AF_INET6);
+    }
+    self = ids[0];
 
     if(buflen > 0) {
         int message;
         struct parsed_message m;
         unsigned short ttid;
 
-        if(is_martian(from))
-            goto dontread;
-
-        if(node_blacklisted(from, fromlen)) {
-            debugf("Received packet from blacklisted node.\n");
-            goto dontread;
-        }
-
         if(((char*)buf)[buflen] != '\0') {
             debugf("Unterminated message.\n");
             errno = EINVAL;
             return -1;
         }
 
-        memset(&m, 0, sizeof(m));
-        message = parse_message(buf, buflen, &m);
-
-        if(message < 0 || message == ERROR || id_cmp(m.id, zeroes) == 0) {
-            debugf("Unparseable message: ");
-            debug_printable(buf, buflen);
-            debugf("\n");
+        message = receive_message(s, buf, buflen, from, fromlen, &m);
+        if(message < 0)
             goto dontread;
-        }
-
-        if(id_cmp(m.id, myid) == 0) {
-            debugf("Received message from self.\n");
-            goto dontread;
-        }
 
         if(message > REPLY) {
             /* Rate limit requests. */
@@ -2117,9 +3360,9 @@ dht_periodic(const void *buf, size_t buflen,
                     int i;
                     new_node(m.id, from, fromlen, 2);
                     for(i = 0; i < m.nodes_len / 26; i++) {
-                        unsigned char *ni = m.nodes + i * 26;
+                        const unsigned char *ni = m.nodes + i * 26;
                         struct sockaddr_in sin;
-                        if(id_cmp(ni, myid) == 0)
+                        if(is_my_id(ni))
                             continue;
                         memset(&sin, 0, sizeof(sin));
                         sin.sin_family = AF_INET;
@@ -2134,9 +3377,9 @@ dht_periodic(const void *buf, size_t buflen,
                         }
                     }
                     for(i = 0; i < m.nodes6_len / 38; i++) {
-                        unsigned char *ni = m.nodes6 + i * 38;
+                        const unsigned char *ni = m.nodes6 + i * 38;
                         struct sockaddr_in6 sin6;
-                        if(id_cmp(ni, myid) == 0)
+                        if(is_my_id(ni))
                             continue;
                         memset(&sin6, 0, sizeof(sin6));
                         sin6.sin6_family = AF_INET6;
@@ -2150,26 +3393,31 @@ dht_periodic(const void *buf, size_t buflen,
                                                sr, 0, NULL, 0);
                         }
                     }
-                    if(sr)
-                        /* Since we received a reply, the number of
-                           requests in flight has decreased.  Let's push
-                           another request. */
-                        search_send_get_peers(sr, NULL);
                 }
                 if(sr) {
                     insert_search_node(m.id, from, fromlen, sr,
                                        1, m.token, m.token_len);
-                    if(m.values_len > 0 || m.values6_len > 0) {
+                    /* Since we received a reply, the number of
+                       requests in flight has decreased.  Let's push
+                       more requests and check whether we are done. */
+                    search_send_requests(sr);
+                    if(!sr->done)
+                        search_schedule(sr, now);
+                    if(m.values_count > 0 || m.values6_count > 0) {
                         debugf("Got values (%d+%d)!\n",
-                               m.values_len / 6, m.values6_len / 18);
+                               m.values_count, m.values6_count);
                         if(callback) {
-                            if(m.values_len > 0)
-                                (*callback)(closure, DHT_EVENT_VALUES, sr->id,
-                                            (void*)m.values, m.values_len);
-
-                            if(m.values6_len > 0)
-                                (*callback)(closure, DHT_EVENT_VALUES6, sr->id,
-                                            (void*)m.values6, m.values6_len);
+                            const unsigned char *p = m.values;
+                            const unsigned char *v;
+                            int l;
+                            /* Pass the values in place, one at a time. */
+                            while(values_next(&p, m.values + m.values_len,
+                                              &v, &l)) {
+                                (*callback)(closure,
+                                            l == 6 ? DHT_EVENT_VALUES :
+                                                     DHT_EVENT_VALUES6,
+                                            sr->id, v, l);
+                            }
                         }
                     }
                 }
@@ -2185,14 +3433,20 @@ dht_periodic(const void *buf, size_t buflen,
                     new_node(m.id, from, fromlen, 2);
                     for(i = 0; i < sr->numnodes; i++)
                         if(id_cmp(sr->nodes[i].id, m.id) == 0) {
+                            struct search_node *n = &sr->nodes[i];
+                            if(n->pinged == 1 && n->request_time > 0)
+                                rtt_sample(&n->srtt, &n->rttvar,
+                                           now - n->request_time);
                             sr->nodes[i].request_time = 0;
-                            sr->nodes[i].reply_time = now.tv_sec;
+                            sr->nodes[i].reply_time = now;
                             sr->nodes[i].acked = 1;
                             sr->nodes[i].pinged = 0;
                             break;
                         }
                     /* See comment for gp above. */
-                    search_send_get_peers(sr, NULL);
+                    search_send_requests(sr);
+                    if(!sr->done)
+                        search_schedule(sr, now);
                 }
             } else {
                 debugf("Unexpected reply: ");
@@ -2201,46 +3455,9 @@ dht_periodic(const void *buf, size_t buflen,
             }
             break;
         case PING:
-            debugf("Ping (%d)!\n", m.tid_len);
-            new_node(m.id, from, fromlen, 1);
-            debugf("Sending pong.\n");
-            send_pong(from, fromlen, m.tid, m.tid_len);
-            break;
         case FIND_NODE:
-            debugf("Find node!\n");
-            new_node(m.id, from, fromlen, 1);
-            debugf("Sending closest nodes (%d).\n", m.want);
-            send_closest_nodes(from, fromlen,
-                               m.tid, m.tid_len, m.target, m.want,
-                               0, NULL, NULL, 0);
-            break;
         case GET_PEERS:
-            debugf("Get_peers!\n");
-            new_node(m.id, from, fromlen, 1);
-            if(id_cmp(m.info_hash, zeroes) == 0) {
-                debugf("Eek!  Got get_peers with no info_hash.\n");
-                send_error(from, fromlen, m.tid, m.tid_len,
-                           203, "Get_peers with no info_hash");
-                break;
-            } else {
-                struct storage *st = find_storage(m.info_hash);
-                unsigned char token[TOKEN_SIZE];
-                make_token(from, 0, token);
-                if(st && st->numpeers > 0) {
-                     debugf("Sending found%s peers.\n",
-                            from->sa_family == AF_INET6 ? " IPv6" : "");
-                     send_closest_nodes(from, fromlen,
-                                        m.tid, m.tid_len,
-                                        m.info_hash, m.want,
-                                        from->sa_family, st,
-                                        token, TOKEN_SIZE);
-                } else {
-                    debugf("Sending nodes for get_peers.\n");
-                    send_closest_nodes(from, fromlen,
-                                       m.tid, m.tid_len, m.info_hash, m.want,
-                                       0, NULL, token, TOKEN_SIZE);
-                }
-            }
+            answer_request(message, &m, from, fromlen);
             break;
         case ANNOUNCE_PEER:
             debugf("Announce peer!\n");
@@ -2284,76 +3501,51 @@ dht_periodic(const void *buf, size_t buflen,
     }
 
  dontread:
-    if(now.tv_sec >= rotate_secrets_time)
+    self = ids[0];
+
+    if(now >= rotate_secrets_time)
         rotate_secrets();
 
-    if(now.tv_sec >= expire_stuff_time) {
-        expire_buckets(buckets);
-        expire_buckets(buckets6);
+    if(now >= expire_stuff_time) {
+        for(i = 0; i < numids; i++) {
+            self = ids[i];
+            expire_buckets(AF_INET);
+            expire_buckets(AF_INET6);
+        }
+        self = ids[0];
         expire_storage();
         expire_searches(callback, closure);
     }
 
-    if(search_time > 0 && now.tv_sec >= search_time) {
-        struct search *sr;
-        sr = searches;
-        while(sr) {
-            if(!sr->done &&
-               sr->step_time + DHT_SEARCH_RETRANSMIT / 2 + 1 <= now.tv_sec) {
-                search_step(sr, callback, closure);
-            }
-            sr = sr->next;
-        }
-
-        search_time = 0;
-
-        sr = searches;
-        while(sr) {
-            if(!sr->done) {
-                time_t tm = sr->step_time +
-                    DHT_SEARCH_RETRANSMIT + random() % DHT_SEARCH_RETRANSMIT;
-                if(search_time == 0 || search_time > tm)
-                    search_time = tm;
-            }
-            sr = sr->next;
-        }
+    /* Only visit the searches that are due. */
+    while(search_queue_len > 0 && search_queue[0]->deadline <= now) {
+        struct search *sr = search_queue[0];
+        search_unschedule(sr);
+        search_step(sr, callback, closure);
+        if(!sr->done)
+            search_reschedule(sr);
     }
 
-    if(now.tv_sec >= confirm_nodes_time) {
-        int soon = 0;
-
-        soon |= bucket_maintenance(AF_INET);
-        soon |= bucket_maintenance(AF_INET6);
-
-        if(!soon) {
-            if(mybucket_grow_time >= now.tv_sec - 150)
-                soon |= neighbourhood_maintenance(AF_INET);
-            if(mybucket6_grow_time >= now.tv_sec - 150)
-                soon |= neighbourhood_maintenance(AF_INET6);
-        }
-
-        /* Given the timeouts in bucket_maintenance, with a 22-bucket
-           table, worst case is a ping every 18 seconds (22 buckets plus
-           11 buckets overhead for the larger buckets).  Keep the "soon"
-           case within 15 seconds, which gives some margin for neighbourhood
-           maintenance. */
-
-        if(soon)
-            confirm_nodes_time = now.tv_sec + 5 + random() % 10;
-        else
-            confirm_nodes_time = now.tv_sec + 60 + random() % 120;
+    confirm_time = INT64_MAX;
+    for(i = 0; i < numids; i++) {
+        self = ids[i];
+        if(now >= self->confirm_nodes_time)
+            confirm_nodes();
+        confirm_time = MIN(confirm_time, self->confirm_nodes_time);
     }
+    self = ids[0];
 
-    if(confirm_nodes_time > now.tv_sec)
-        *tosleep = confirm_nodes_time - now.tv_sec;
+    if(confirm_time > now)
+        *tosleep = confirm_time - now;
     else
         *tosleep = 0;
 
-    if(search_time > 0) {
-        if(search_time <= now.tv_sec)
+    if(search_queue_len > 0) {
+        int64_t search_time = search_queue[0]->deadline;
+        if(search_time <= now)
             *tosleep = 0;
-        else if(*tosleep > search_time - now.tv_sec)
-            *tosleep = search_time - now.tv_sec;
+        else if(*tosleep > search_time - now)
+            *tosleep = search_time - now;
     }
 
     return 1;
@@ -2371,64 +3563,64 @@ dht_get_nodes(struct sockaddr_in *sin, int *num,
 
     /* For restoring to work without discarding too many nodes, the list
        must start with the contents of our bucket. */
-    b = find_bucket(myid, AF_INET);
+    b = find_bucket(self->myid, AF_INET);
     if(b == NULL)
         goto no_ipv4;
 
     n = b->nodes;
     while(n && i < *num) {
         if(node_good(n)) {
-            sin[i] = *(struct sockaddr_in*)&n->ss;
+            node_sockaddr(&n->addr, (struct sockaddr*)&sin[i]);
             i++;
         }
         n = n->next;
     }
 
-    b = buckets;
+    b = first_bucket(AF_INET);
     while(b && i < *num) {
-        if(!in_bucket(myid, b)) {
+        if(!in_bucket(self->myid, b)) {
             n = b->nodes;
             while(n && i < *num) {
                 if(node_good(n)) {
-                    sin[i] = *(struct sockaddr_in*)&n->ss;
+                    node_sockaddr(&n->addr, (struct sockaddr*)&sin[i]);
                     i++;
                 }
                 n = n->next;
             }
         }
-        b = b->next;
+        b = next_bucket(b);
     }
 
  no_ipv4:
 
     j = 0;
 
-    b = find_bucket(myid, AF_INET6);
+    b = find_bucket(self->myid, AF_INET6);
     if(b == NULL)
         goto no_ipv6;
 
     n = b->nodes;
     while(n && j < *num6) {
         if(node_good(n)) {
-            sin6[j] = *(struct sockaddr_in6*)&n->ss;
+            node_sockaddr(&n->addr, (struct sockaddr*)&sin6[j]);
             j++;
         }
         n = n->next;
     }
 
-    b = buckets6;
+    b = first_bucket(AF_INET6);
     while(b && j < *num6) {
-        if(!in_bucket(myid, b)) {
+        if(!in_bucket(self->myid, b)) {
             n = b->nodes;
             while(n && j < *num6) {
                 if(node_good(n)) {
-                    sin6[j] = *(struct sockaddr_in6*)&n->ss;
+                    node_sockaddr(&n->addr, (struct sockaddr*)&sin6[j]);
                     j++;
                 }
                 n = n->next;
             }
         }
-        b = b->next;
+        b = next_bucket(b);
     }
 
  no_ipv6:
@@ -2482,6 +3674,62 @@ dht_ping_node(const struct sockaddr *sa, int salen)
         COPY(buf, offset, my_v, sizeof(my_v), size);    \
     }
 
+/* Append a string literal. */
+#define ADD(buf, offset, str, size)                     \
+    COPY(buf, offset, str, sizeof(str) - 1, size)
+
+/* Append a decimal number. */
+#define ADD_UINT(buf, offset, value, size)              \
+    rc = format_uint(buf + offset, size - offset, value);   \
+    INC(offset, rc, size)
+
+/* Append the list of wanted address families. */
+#define ADD_WANT(buf, offset, want, size)               \
+    ADD(buf, offset, "4:wantl", size);                  \
+    if((want) & WANT4) {                                \
+        ADD(buf, offset, "2:n4", size);                 \
+    }                                                   \
+    if((want) & WANT6) {                                \
+        ADD(buf, offset, "2:n6", size);                 \
+    }                                                   \
+    ADD(buf, offset, "e", size)
+
+/* Append a bencoded string. */
+#define ADD_STR(buf, offset, src, len, size)            \
+    ADD_UINT(buf, offset, len, size);                   \
+    ADD(buf, offset, ":", size);                        \
+    COPY(buf, offset, src, len, size)
+
+/* Append the transaction id, version and message type, these end
+   every message. */
+#define ADD_TAIL(buf, offset, tid, tid_len, type, size)  \
+    ADD(buf, offset, "1:t", size);                      \
+    ADD_STR(buf, offset, tid, tid_len, size);           \
+    ADD_V(buf, offset, size);                           \
+    ADD(buf, offset, type, size)
+
+/* Write value in decimal, return the number of characters or -1 if
+   it does not fit. */
+static int
+format_uint(char *buf, int size, unsigned value)
+{
+    char tmp[10];
+    int n = 0, i;
+
+    do {
+        tmp[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+
+    if(n > size)
+        return -1;
+
+    for(i = 0; i < n; i++)
+        buf[i] = tmp[n - 1 - i];
+
+    return n;
+}
+
 static int
 dht_send(const void *buf, size_t len, int flags,
          const struct sockaddr *sa, int salen)
@@ -2498,9 +3746,9 @@ dht_send(const void *buf, size_t len, int flags,
     }
 
     if(sa->sa_family == AF_INET)
-        s = dht_socket;
+        s = self->socket;
     else if(sa->sa_family == AF_INET6)
-        s = dht_socket6;
+        s = self->socket6;
     else
         s = -1;
 
@@ -2518,13 +3766,9 @@ send_ping(const struct sockaddr *sa, int salen,
 {
     char buf[512];
     int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:q4:ping1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
+    COPY(buf, i, self->query_prefix, 32, 512);
+    ADD(buf, i, "e1:q4:ping", 512);
+    ADD_TAIL(buf, i, tid, tid_len, "1:y1:qe", 512);
     return dht_send(buf, i, 0, sa, salen);
 
  fail:
@@ -2538,12 +3782,9 @@ send_pong(const struct sockaddr *sa, int salen,
 {
     char buf[512];
     int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:rd2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len); INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
+    COPY(buf, i, self->reply_prefix, 32, 512);
+    ADD(buf, i, "e", 512);
+    ADD_TAIL(buf, i, tid, tid_len, "1:y1:re", 512);
     return dht_send(buf, i, 0, sa, salen);
 
  fail:
@@ -2558,21 +3799,14 @@ send_find_node(const struct sockaddr *sa, int salen,
 {
     char buf[512];
     int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "6:target20:"); INC(i, rc, 512);
+    COPY(buf, i, self->query_prefix, 32, 512);
+    ADD(buf, i, "6:target20:", 512);
     COPY(buf, i, target, 20, 512);
     if(want > 0) {
-        rc = snprintf(buf + i, 512 - i, "4:wantl%s%se",
-                      (want & WANT4) ? "2:n4" : "",
-                      (want & WANT6) ? "2:n6" : "");
-        INC(i, rc, 512);
-    }
-    rc = snprintf(buf + i, 512 - i, "e1:q9:find_node1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
+        ADD_WANT(buf, i, want, 512);
+    }
+    ADD(buf, i, "e1:q9:find_node", 512);
+    ADD_TAIL(buf, i, tid, tid_len, "1:y1:qe", 512);
     return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
 
  fail:
@@ -2591,22 +3825,18 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
     char buf[2048];
     int i = 0, rc, j0, j, k, len;
 
-    rc = snprintf(buf + i, 2048 - i, "d1:rd2:id20:"); INC(i, rc, 2048);
-    COPY(buf, i, myid, 20, 2048);
+    COPY(buf, i, self->reply_prefix, 32, 2048);
     if(nodes_len > 0) {
-        rc = snprintf(buf + i, 2048 - i, "5:nodes%d:", nodes_len);
-        INC(i, rc, 2048);
-        COPY(buf, i, nodes, nodes_len, 2048);
+        ADD(buf, i, "5:nodes", 2048);
+        ADD_STR(buf, i, nodes, nodes_len, 2048);
     }
     if(nodes6_len > 0) {
-         rc = snprintf(buf + i, 2048 - i, "6:nodes6%d:", nodes6_len);
-         INC(i, rc, 2048);
-         COPY(buf, i, nodes6, nodes6_len, 2048);
+        ADD(buf, i, "6:nodes6", 2048);
+        ADD_STR(buf, i, nodes6, nodes6_len, 2048);
     }
     if(token_len > 0) {
-        rc = snprintf(buf + i, 2048 - i, "5:token%d:", token_len);
-        INC(i, rc, 2048);
-        COPY(buf, i, token, token_len, 2048);
+        ADD(buf, i, "5:token", 2048);
+        ADD_STR(buf, i, token, token_len, 2048);
     }
 
     if(st && st->numpeers > 0) {
@@ -2619,26 +3849,27 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
         j = j0;
         k = 0;
 
-        rc = snprintf(buf + i, 2048 - i, "6:valuesl"); INC(i, rc, 2048);
+        ADD(buf, i, "6:valuesl", 2048);
         do {
             if(st->peers[j].len == len) {
                 unsigned short swapped;
                 swapped = htons(st->peers[j].port);
-                rc = snprintf(buf + i, 2048 - i, "%d:", len + 2);
-                INC(i, rc, 2048);
+                if(len == 4) {
+                    ADD(buf, i, "6:", 2048);
+                } else {
+                    ADD(buf, i, "18:", 2048);
+                }
                 COPY(buf, i, st->peers[j].ip, len, 2048);
                 COPY(buf, i, &swapped, 2, 2048);
                 k++;
             }
             j = (j + 1) % st->numpeers;
         } while(j != j0 && k < 50);
-        rc = snprintf(buf + i, 2048 - i, "e"); INC(i, rc, 2048);
+        ADD(buf, i, "e", 2048);
     }
 
-    rc = snprintf(buf + i, 2048 - i, "e1:t%d:", tid_len); INC(i, rc, 2048);
-    COPY(buf, i, tid, tid_len, 2048);
-    ADD_V(buf, i, 2048);
-    rc = snprintf(buf + i, 2048 - i, "1:y1:re"); INC(i, rc, 2048);
+    ADD(buf, i, "e", 2048);
+    ADD_TAIL(buf, i, tid, tid_len, "1:y1:re", 2048);
 
     return dht_send(buf, i, 0, sa, salen);
 
@@ -2647,23 +3878,91 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
     return -1;
 }
 
+static void
+compact_node(unsigned char *p, const struct node *n, int size)
+{
+    memcpy(p, n->id, 20);
+    memcpy(p + 20, n->addr.ip, size - 22);
+    memcpy(p + size - 2, &n->addr.port, 2);
+}
+
+/* Return the compact encoding of the good nodes of a bucket.  It is
+   rebuilt only after the bucket changed or one of the nodes got old. */
 static int
-insert_closest_node(unsigned char *nodes, int numnodes,
-                    const unsigned char *id, struct node *n)
+bucket_good_nodes(struct bucket *b, const unsigned char **nodes_return)
 {
-    int i, size;
+    int size = b->af == AF_INET ? 26 : 38;
+    struct node *n;
 
-    if(n->ss.ss_family == AF_INET)
-        size = 26;
-    else if(n->ss.ss_family == AF_INET6)
-        size = 38;
-    else
-        abort();
+    if(b->good_valid && b->good_expiry >= now) {
+        *nodes_return = b->good;
+        return b->good_count;
+    }
+
+    if(b->good_max < b->count) {
+        unsigned char *good = realloc(b->good, b->count * size);
+        if(good == NULL)
+            return 0;
+        b->good = good;
+        b->good_max = b->count;
+    }
+
+    b->good_count = 0;
+    b->good_expiry = INT64_MAX;
+    n = b->nodes;
+    while(n) {
+        if(node_good(n)) {
+            compact_node(b->good + size * b->good_count, n, size);
+            b->good_count++;
+            /* See node_good. */
+            b->good_expiry = MIN(b->good_expiry,
+                                 MIN(n->reply_time + 7200 * 1000,
+                                     n->time + 900 * 1000));
+        }
+        n = n->next;
+    }
+    b->good_valid = 1;
+
+    *nodes_return = b->good;
+    return b->good_count;
+}
+
+/* Return the number of good nodes of a family.  The buckets are only
+   walked after one of them changed or one of the good nodes got old,
+   and only changed buckets are recounted. */
+static int
+count_good(int af)
+{
+    struct bucket_table *t = bucket_table(af);
+    const unsigned char *nodes;
+    int i;
+
+    if(t->good_valid && t->good_expiry >= now)
+        return t->good;
+
+    t->good = 0;
+    t->good_expiry = INT64_MAX;
+    for(i = 0; i < t->count; i++) {
+        struct bucket *b = t->list[i];
+        t->good += bucket_good_nodes(b, &nodes);
+        t->good_expiry = MIN(t->good_expiry, b->good_expiry);
+    }
+    t->good_valid = 1;
+
+    return t->good;
+}
+
+static int
+insert_closest_node(unsigned char *nodes, int numnodes,
+                    const unsigned char *id, const unsigned char *node,
+                    int size)
+{
+    int i;
 
     for(i = 0; i< numnodes; i++) {
-        if(id_cmp(n->id, nodes + size * i) == 0)
+        if(id_cmp(node, nodes + size * i) == 0)
             return numnodes;
-        if(xorcmp(n->id, nodes + size * i, id) < 0)
+        if(xorcmp(node, nodes + size * i, id) < 0)
             break;
     }
 
@@ -2677,19 +3976,7 @@ insert_closest_node(unsigned char *nodes, int numnodes,
         memmove(nodes + size * (i + 1), nodes + size * i,
                 size * (numnodes - i - 1));
 
-    if(n->ss.ss_family == AF_INET) {
-        struct sockaddr_in *sin = (struct sockaddr_in*)&n->ss;
-        memcpy(nodes + size * i, n->id, 20);
-        memcpy(nodes + size * i + 20, &sin->sin_addr, 4);
-        memcpy(nodes + size * i + 24, &sin->sin_port, 2);
-    } else if(n->ss.ss_family == AF_INET6) {
-        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&n->ss;
-        memcpy(nodes + size * i, n->id, 20);
-        memcpy(nodes + size * i + 20, &sin6->sin6_addr, 16);
-        memcpy(nodes + size * i + 36, &sin6->sin6_port, 2);
-    } else {
-        abort();
-    }
+    memcpy(nodes + size * i, node, size);
 
     return numnodes;
 }
@@ -2698,12 +3985,27 @@ static int
 buffer_closest_nodes(unsigned char *nodes, int numnodes,
                      const unsigned char *id, struct bucket *b)
 {
-    struct node *n = b->nodes;
-    while(n) {
-        if(node_good(n))
-            numnodes = insert_closest_node(nodes, numnodes, id, n);
-        n = n->next;
+    int size = b->af == AF_INET ? 26 : 38;
+    const unsigned char *good;
+    int i, count;
+
+    if(read_only && !(b->good_valid && b->good_expiry >= now)) {
+        /* The encoding cannot be rebuilt, walk the nodes. */
+        unsigned char node[38];
+        struct node *n;
+        for(n = b->nodes; n; n = n->next) {
+            if(!node_good(n))
+                continue;
+            compact_node(node, n, size);
+            numnodes = insert_closest_node(nodes, numnodes, id, node, size);
+        }
+        return numnodes;
     }
+
+    count = bucket_good_nodes(b, &good);
+    for(i = 0; i < count; i++)
+        numnodes = insert_closest_node(nodes, numnodes, id,
+                                       good + size * i, size);
     return numnodes;
 }
 
@@ -2726,8 +4028,9 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
         b = find_bucket(id, AF_INET);
         if(b) {
             numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
-            if(b->next)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b->next);
+            if(next_bucket(b))
+                numnodes = buffer_closest_nodes(nodes, numnodes, id,
+                                                next_bucket(b));
             b = previous_bucket(b);
             if(b)
                 numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
@@ -2738,9 +4041,10 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
         b = find_bucket(id, AF_INET6);
         if(b) {
             numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
-            if(b->next)
+            if(next_bucket(b))
                 numnodes6 =
-                    buffer_closest_nodes(nodes6, numnodes6, id, b->next);
+                    buffer_closest_nodes(nodes6, numnodes6, id,
+                                         next_bucket(b));
             b = previous_bucket(b);
             if(b)
                 numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
@@ -2762,21 +4066,14 @@ send_get_peers(const struct sockaddr *sa, int salen,
     char buf[512];
     int i = 0, rc;
 
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "9:info_hash20:"); INC(i, rc, 512);
+    COPY(buf, i, self->query_prefix, 32, 512);
+    ADD(buf, i, "9:info_hash20:", 512);
     COPY(buf, i, infohash, 20, 512);
     if(want > 0) {
-        rc = snprintf(buf + i, 512 - i, "4:wantl%s%se",
-                      (want & WANT4) ? "2:n4" : "",
-                      (want & WANT6) ? "2:n6" : "");
-        INC(i, rc, 512);
-    }
-    rc = snprintf(buf + i, 512 - i, "e1:q9:get_peers1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
+        ADD_WANT(buf, i, want, 512);
+    }
+    ADD(buf, i, "e1:q9:get_peers", 512);
+    ADD_TAIL(buf, i, tid, tid_len, "1:y1:qe", 512);
     return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
 
  fail:
@@ -2793,19 +4090,15 @@ send_announce_peer(const struct sockaddr *sa, int salen,
     char buf[512];
     int i = 0, rc;
 
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "9:info_hash20:"); INC(i, rc, 512);
+    COPY(buf, i, self->query_prefix, 32, 512);
+    ADD(buf, i, "9:info_hash20:", 512);
     COPY(buf, i, infohash, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "4:porti%ue5:token%d:", (unsigned)port,
-                  token_len);
-    INC(i, rc, 512);
-    COPY(buf, i, token, token_len, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:q13:announce_peer1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
+    ADD(buf, i, "4:porti", 512);
+    ADD_UINT(buf, i, port, 512);
+    ADD(buf, i, "e5:token", 512);
+    ADD_STR(buf, i, token, token_len, 512);
+    ADD(buf, i, "e1:q13:announce_peer", 512);
+    ADD_TAIL(buf, i, tid, tid_len, "1:y1:qe", 512);
 
     return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, sa, salen);
 
@@ -2816,18 +4109,14 @@ send_announce_peer(const struct sockaddr *sa, int salen,
 
 static int
 send_peer_announced(const struct sockaddr *sa, int salen,
-                    unsigned char *tid, int tid_len)
+                    const unsigned char *tid, int tid_len)
 {
     char buf[512];
     int i = 0, rc;
 
-    rc = snprintf(buf + i, 512 - i, "d1:rd2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
+    COPY(buf, i, self->reply_prefix, 32, 512);
+    ADD(buf, i, "e", 512);
+    ADD_TAIL(buf, i, tid, tid_len, "1:y1:re", 512);
     return dht_send(buf, i, 0, sa, salen);
 
  fail:
@@ -2837,20 +4126,19 @@ send_peer_announced(const struct sockaddr *sa, int salen,
 
 static int
 send_error(const struct sockaddr *sa, int salen,
-           unsigned char *tid, int tid_len,
+           const unsigned char *tid, int tid_len,
            int code, const char *message)
 {
     char buf[512];
     int i = 0, rc, message_len;
 
     message_len = strlen(message);
-    rc = snprintf(buf + i, 512 - i, "d1:eli%de%d:", code, message_len);
-    INC(i, rc, 512);
-    COPY(buf, i, message, message_len, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len); INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:ee"); INC(i, rc, 512);
+    ADD(buf, i, "d1:eli", 512);
+    ADD_UINT(buf, i, code, 512);
+    ADD(buf, i, "e", 512);
+    ADD_STR(buf, i, message, message_len, 512);
+    ADD(buf, i, "e", 512);
+    ADD_TAIL(buf, i, tid, tid_len, "1:y1:ee", 512);
     return dht_send(buf, i, 0, sa, salen);
 
  fail:
@@ -2862,211 +4150,340 @@ send_error(const struct sockaddr *sa, int salen,
 #undef INC
 #undef COPY
 #undef ADD_V
+#undef ADD
+#undef ADD_UINT
+#undef ADD_WANT
+#undef ADD_STR
+#undef ADD_TAIL
 
-#ifdef HAVE_MEMMEM
+/* A single pass bencode reader.  Each function reads one item at *p,
+   advances *p past it and returns -1 on malformed input.  The buffer is
+   NUL-terminated, so looking at *p when *p == end is safe. */
 
-static void *
-dht_memmem(const void *haystack, size_t haystacklen,
-           const void *needle, size_t needlelen)
-{
-    return memmem(haystack, haystacklen, needle, needlelen);
-}
+#define BDECODE_MAX_DEPTH 8
 
-#else
-
-static void *
-dht_memmem(const void *haystack, size_t haystacklen,
-           const void *needle, size_t needlelen)
+static int
+bdecode_str(const unsigned char **p, const unsigned char *end,
+            const unsigned char **s, int *len)
 {
-    const char *h = haystack;
-    const char *n = needle;
-    size_t i;
+    const unsigned char *q = *p;
+    int l = 0;
 
-    /* size_t is unsigned */
-    if(needlelen > haystacklen)
-        return NULL;
-
-    for(i = 0; i <= haystacklen - needlelen; i++) {
-        if(memcmp(h + i, n, needlelen) == 0)
-            return (void*)(h + i);
+    if(*q < '0' || *q > '9')
+        return -1;
+    while(*q >= '0' && *q <= '9') {
+        l = l * 10 + (*q - '0');
+        if(l > end - q)
+            return -1;
+        q++;
     }
-    return NULL;
+    if(*q != ':' || l > end - q - 1)
+        return -1;
+    *s = q + 1;
+    *len = l;
+    *p = q + 1 + l;
+    return 0;
 }
 
-#endif
-
 static int
-parse_message(const unsigned char *buf, int buflen,
-              struct parsed_message *m)
+bdecode_int(const unsigned char **p, const unsigned char *end, long *v)
 {
-    const unsigned char *p;
+    const unsigned char *q = *p;
+    int neg = 0, digits = 0;
+    long l = 0;
 
-    /* This code will happily crash if the buffer is not NUL-terminated. */
-    if(buf[buflen] != '\0') {
-        debugf("Eek!  parse_message with unterminated buffer.\n");
+    if(*q != 'i')
         return -1;
+    q++;
+    if(*q == '-') {
+        neg = 1;
+        q++;
+    }
+    while(*q >= '0' && *q <= '9') {
+        if(++digits > 18)
+            return -1;
+        l = l * 10 + (*q - '0');
+        q++;
     }
+    if(digits == 0 || q >= end || *q != 'e')
+        return -1;
+    *v = neg ? -l : l;
+    *p = q + 1;
+    return 0;
+}
 
+static int
+bdecode_skip(const unsigned char **p, const unsigned char *end, int depth)
+{
+    const unsigned char *s;
+    int len;
+    long v;
 
-#define CHECK(ptr, len)                                                 \
-    if(((unsigned char*)ptr) + (len) > (buf) + (buflen)) goto overflow;
+    if(*p >= end)
+        return -1;
 
-    p = dht_memmem(buf, buflen, "1:t", 3);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 3, &q, 10);
-        if(q && *q == ':' && l > 0 && l < PARSE_TID_LEN) {
-            CHECK(q + 1, l);
-            memcpy(m->tid, q + 1, l);
-            m->tid_len = l;
+    switch(**p) {
+    case 'i':
+        return bdecode_int(p, end, &v);
+    case 'l':
+    case 'd':
+        if(depth >= BDECODE_MAX_DEPTH)
+            return -1;
+        (*p)++;
+        while(*p < end && **p != 'e') {
+            if(bdecode_skip(p, end, depth + 1) < 0)
+                return -1;
         }
+        if(*p >= end)
+            return -1;
+        (*p)++;
+        return 0;
+    default:
+        return bdecode_str(p, end, &s, &len);
     }
+}
 
-    p = dht_memmem(buf, buflen, "2:id20:", 7);
-    if(p) {
-        CHECK(p + 7, 20);
-        memcpy(m->id, p + 7, 20);
-    }
+#define KEY_IS(k, klen, str) \
+    ((klen) == sizeof(str) - 1 && memcmp((k), (str), (klen)) == 0)
 
-    p = dht_memmem(buf, buflen, "9:info_hash20:", 14);
-    if(p) {
-        CHECK(p + 14, 20);
-        memcpy(m->info_hash, p + 14, 20);
-    }
+/* Check a list of compact peer values and remember where it is. */
+static int
+parse_values(const unsigned char **p, const unsigned char *end,
+             struct parsed_message *m)
+{
+    const unsigned char *s;
+    int l;
 
-    p = dht_memmem(buf, buflen, "4:porti", 7);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 7, &q, 10);
-        if(q && *q == 'e' && l > 0 && l < 0x10000)
-            m->port = l;
+    if(**p != 'l')
+        return -1;
+    (*p)++;
+    m->values = *p;
+    m->values_count = 0;
+    m->values6_count = 0;
+    while(*p < end && **p != 'e') {
+        if(bdecode_str(p, end, &s, &l) < 0)
+            return -1;
+        if(l == 6)
+            m->values_count++;
+        else if(l == 18)
+            m->values6_count++;
+        else
+            debugf("Received weird value -- %d bytes.\n", l);
     }
+    if(*p >= end)
+        return -1;
+    m->values_len = *p - m->values;
+    (*p)++;
+    return 0;
+}
 
-    p = dht_memmem(buf, buflen, "12:implied_porti", 16);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 16, &q, 10);
-        if(q && *q == 'e' && l > 0 && l < 0x10000)
-            m->implied_port = l;
+/* Return the next IPv4 or IPv6 value of a list checked by
+   parse_values(), or 0 at the end. */
+static int
+values_next(const unsigned char **p, const unsigned char *end,
+            const unsigned char **value, int *value_len)
+{
+    while(*p < end) {
+        if(bdecode_str(p, end, value, value_len) < 0)
+            return 0;
+        if(*value_len == 6 || *value_len == 18)
+            return 1;
     }
+    return 0;
+}
 
-    p = dht_memmem(buf, buflen, "6:target20:", 11);
-    if(p) {
-        CHECK(p + 11, 20);
-        memcpy(m->target, p + 11, 20);
-    }
+static int
+parse_want(const unsigned char **p, const unsigned char *end,
+           struct parsed_message *m)
+{
+    const unsigned char *s;
+    int l;
 
-    p = dht_memmem(buf, buflen, "5:token", 7);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 7, &q, 10);
-        if(q && *q == ':' && l > 0 && l < PARSE_TOKEN_LEN) {
-            CHECK(q + 1, l);
-            memcpy(m->token, q + 1, l);
-            m->token_len = l;
-        }
+    if(**p != 'l')
+        return -1;
+    (*p)++;
+    while(*p < end && **p != 'e') {
+        if(bdecode_str(p, end, &s, &l) < 0)
+            return -1;
+        if(l == 2 && memcmp(s, "n4", 2) == 0)
+            m->want |= WANT4;
+        else if(l == 2 && memcmp(s, "n6", 2) == 0)
+            m->want |= WANT6;
+        else
+            debugf("eek... unexpected want flag.\n");
     }
+    if(*p >= end)
+        return -1;
+    (*p)++;
+    return 0;
+}
+
+/* Parse the arguments ("a") of a query or the body ("r") of a reply. */
+static int
+parse_args(const unsigned char **p, const unsigned char *end,
+           struct parsed_message *m)
+{
+    const unsigned char *k, *s;
+    int klen, l;
+    long v;
 
-    p = dht_memmem(buf, buflen, "5:nodes", 7);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 7, &q, 10);
-        if(q && *q == ':' && l > 0 && l <= PARSE_NODES_LEN) {
-            CHECK(q + 1, l);
-            memcpy(m->nodes, q + 1, l);
-            m->nodes_len = l;
+    if(**p != 'd')
+        return -1;
+    (*p)++;
+    while(*p < end && **p != 'e') {
+        if(bdecode_str(p, end, &k, &klen) < 0 || *p >= end)
+            return -1;
+
+        if(KEY_IS(k, klen, "id")) {
+            if(bdecode_str(p, end, &s, &l) < 0)
+                return -1;
+            if(l == 20)
+                m->id = s;
+        } else if(KEY_IS(k, klen, "info_hash")) {
+            if(bdecode_str(p, end, &s, &l) < 0)
+                return -1;
+            if(l == 20)
+                m->info_hash = s;
+        } else if(KEY_IS(k, klen, "target")) {
+            if(bdecode_str(p, end, &s, &l) < 0)
+                return -1;
+            if(l == 20)
+                m->target = s;
+        } else if(KEY_IS(k, klen, "port")) {
+            if(bdecode_int(p, end, &v) < 0)
+                return -1;
+            if(v > 0 && v < 0x10000)
+                m->port = v;
+        } else if(KEY_IS(k, klen, "implied_port")) {
+            if(bdecode_int(p, end, &v) < 0)
+                return -1;
+            if(v > 0 && v < 0x10000)
+                m->implied_port = v;
+        } else if(KEY_IS(k, klen, "token")) {
+            if(bdecode_str(p, end, &s, &l) < 0)
+                return -1;
+            if(l > 0 && l < PARSE_TOKEN_LEN) {
+                m->token = s;
+                m->token_len = l;
+            }
+        } else if(KEY_IS(k, klen, "nodes")) {
+            if(bdecode_str(p, end, &s, &l) < 0)
+                return -1;
+            if(l > 0 && l <= PARSE_NODES_LEN) {
+                m->nodes = s;
+                m->nodes_len = l;
+            }
+        } else if(KEY_IS(k, klen, "nodes6")) {
+            if(bdecode_str(p, end, &s, &l) < 0)
+                return -1;
+            if(l > 0 && l <= PARSE_NODES6_LEN) {
+                m->nodes6 = s;
+                m->nodes6_len = l;
+            }
+        } else if(KEY_IS(k, klen, "values")) {
+            if(parse_values(p, end, m) < 0)
+                return -1;
+        } else if(KEY_IS(k, klen, "want")) {
+            if(parse_want(p, end, m) < 0)
+                return -1;
+        } else {
+            if(bdecode_skip(p, end, 1) < 0)
+                return -1;
         }
     }
+    if(*p >= end)
+        return -1;
+    (*p)++;
+    return 0;
+}
 
-    p = dht_memmem(buf, buflen, "6:nodes6", 8);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 8, &q, 10);
-        if(q && *q == ':' && l > 0 && l <= PARSE_NODES6_LEN) {
-            CHECK(q + 1, l);
-            memcpy(m->nodes6, q + 1, l);
-            m->nodes6_len = l;
-        }
+static int
+parse_message(const unsigned char *buf, int buflen,
+              struct parsed_message *m)
+{
+    const unsigned char *p = buf, *end = buf + buflen;
+    const unsigned char *k, *s, *q = NULL;
+    int klen, l, qlen = 0;
+    int y = 0;
+
+    /* The readers look one byte past the end. */
+    if(buf[buflen] != '\0') {
+        debugf("Eek!  parse_message with unterminated buffer.\n");
+        return -1;
     }
 
-    p = dht_memmem(buf, buflen, "6:valuesl", 9);
-    if(p) {
-        int i = p - buf + 9;
-        int j = 0, j6 = 0;
-        while(1) {
-            long l;
-            char *q;
-            l = strtol((char*)buf + i, &q, 10);
-            if(q && *q == ':' && l > 0) {
-                CHECK(q + 1, l);
-                i = q + 1 + l - (char*)buf;
-                if(l == 6) {
-                    if(j + l > PARSE_VALUES_LEN)
-                        continue;
-                    memcpy((char*)m->values + j, q + 1, l);
-                    j += l;
-                } else if(l == 18) {
-                    if(j6 + l > PARSE_VALUES6_LEN)
-                        continue;
-                    memcpy((char*)m->values6 + j6, q + 1, l);
-                    j6 += l;
-                } else {
-                    debugf("Received weird value -- %d bytes.\n", (int)l);
-                }
-            } else {
-                break;
+    m->tid = zeroes;
+    m->tid_len = 0;
+    m->id = zeroes;
+    m->info_hash = zeroes;
+    m->target = zeroes;
+    m->port = 0;
+    m->implied_port = 0;
+    m->token = zeroes;
+    m->token_len = 0;
+    m->nodes = zeroes;
+    m->nodes_len = 0;
+    m->nodes6 = zeroes;
+    m->nodes6_len = 0;
+    m->values = zeroes;
+    m->values_len = 0;
+    m->values_count = 0;
+    m->values6_count = 0;
+    m->want = 0;
+
+    if(buflen < 2 || *p != 'd')
+        goto malformed;
+    p++;
+
+    while(p < end && *p != 'e') {
+        if(bdecode_str(&p, end, &k, &klen) < 0 || p >= end)
+            goto malformed;
+
+        if(KEY_IS(k, klen, "t")) {
+            if(bdecode_str(&p, end, &s, &l) < 0)
+                goto malformed;
+            if(l > 0 && l < PARSE_TID_LEN) {
+                m->tid = s;
+                m->tid_len = l;
             }
+        } else if(KEY_IS(k, klen, "y")) {
+            if(bdecode_str(&p, end, &s, &l) < 0)
+                goto malformed;
+            if(l == 1)
+                y = s[0];
+        } else if(KEY_IS(k, klen, "q")) {
+            if(bdecode_str(&p, end, &q, &qlen) < 0)
+                goto malformed;
+        } else if(KEY_IS(k, klen, "a") || KEY_IS(k, klen, "r")) {
+            if(parse_args(&p, end, m) < 0)
+                goto malformed;
+        } else {
+            if(bdecode_skip(&p, end, 1) < 0)
+                goto malformed;
         }
-        if(i >= buflen || buf[i] != 'e')
-            debugf("eek... unexpected end for values.\n");
-        m->values_len = j;
-        m->values6_len = j6;
-    }
-
-    p = dht_memmem(buf, buflen, "4:wantl", 7);
-    if(p) {
-        int i = p - buf + 7;
-        m->want = 0;
-        while(buf[i] > '0' && buf[i] <= '9' && buf[i + 1] == ':' &&
-              i + 2 + buf[i] - '0' < buflen) {
-            CHECK(buf + i + 2, buf[i] - '0');
-            if(buf[i] == '2' && memcmp(buf + i + 2, "n4", 2) == 0)
-                m->want |= WANT4;
-            else if(buf[i] == '2' && memcmp(buf + i + 2, "n6", 2) == 0)
-                m->want |= WANT6;
-            else
-                debugf("eek... unexpected want flag (%c)\n", buf[i]);
-            i += 2 + buf[i] - '0';
-        }
-        if(i >= buflen || buf[i] != 'e')
-            debugf("eek... unexpected end for want.\n");
     }
+    if(p >= end)
+        goto malformed;
 
-#undef CHECK
-
-    if(dht_memmem(buf, buflen, "1:y1:r", 6))
+    if(y == 'r')
         return REPLY;
-    if(dht_memmem(buf, buflen, "1:y1:e", 6))
+    if(y == 'e')
         return ERROR;
-    if(!dht_memmem(buf, buflen, "1:y1:q", 6))
+    if(y != 'q' || q == NULL)
         return -1;
-    if(dht_memmem(buf, buflen, "1:q4:ping", 9))
+    if(KEY_IS(q, qlen, "ping"))
         return PING;
-    if(dht_memmem(buf, buflen, "1:q9:find_node", 14))
-       return FIND_NODE;
-    if(dht_memmem(buf, buflen, "1:q9:get_peers", 14))
+    if(KEY_IS(q, qlen, "find_node"))
+        return FIND_NODE;
+    if(KEY_IS(q, qlen, "get_peers"))
         return GET_PEERS;
-    if(dht_memmem(buf, buflen, "1:q13:announce_peer", 19))
-       return ANNOUNCE_PEER;
+    if(KEY_IS(q, qlen, "announce_peer"))
+        return ANNOUNCE_PEER;
     return -1;
 
- overflow:
-    debugf("Truncated message.\n");
+ malformed:
+    debugf("Malformed message.\n");
     return -1;
 }
+
+#undef KEY_IS
@@ -39,11 +39,17 @@ dht_callback_t(void *closure, int event,
 extern FILE *dht_debug;
 
 int dht_init(int s, int s6, const unsigned char *id, const unsigned char *v);
+int dht_add_id(int s, int s6, const unsigned char *id);
+int dht_set_buckets(int k, int depth);
+int dht_set_rate(int rate);
 int dht_insert_node(const unsigned char *id, struct sockaddr *sa, int salen);
 int dht_ping_node(const struct sockaddr *sa, int salen);
-int dht_periodic(const void *buf, size_t buflen,
-                 const struct sockaddr *from, int fromlen, time_t *tosleep,
+int dht_periodic(int s, const void *buf, size_t buflen,
+                 const struct sockaddr *from, int fromlen, int64_t *tosleep,
                  dht_callback_t *callback, void *closure);
+int dht_answer(int s, const void *buf, size_t buflen,
+               const struct sockaddr *from, int fromlen);
+int dht_answer_flush(void);
 int dht_search(const unsigned char *id, int port, int af,
                dht_callback_t *callback, void *closure);
 int dht_nodes(int af,
@@ -63,6 +69,8 @@ void dht_hash(void *hash_return, int hash_size,
               const void *v2, int len2,
               const void *v3, int len3);
 int dht_random_bytes(void *buf, size_t size);
+/* Monotonic clock in milliseconds. */
+int64_t dht_time_ms(void);
 
 #ifdef __cplusplus
 }
@@ -36,6 +36,7 @@ static const char* g_server_usage =
     "  status\n"
     "  help\n"
     "  lookup <id>\n"
+    "  watch <id>\n"
     "  search <id>\n"
     "  results <id>\n"
     "  announce-start <id>[:<port>]\n"
@@ -54,6 +55,8 @@ static const char* g_server_help =
     "    The current state of this node.\n"
     "  lookup <id>\n"
     "    Start search and print results.\n"
+    "  watch <id>\n"
+    "    Start search and print results as they arrive until the search is done.\n"
     "  search <id>\n"
     "    Start a search for announced values.\n"
     "  results <id>\n"
@@ -78,6 +81,113 @@ static const char* g_server_help =
 
 static int g_cli_sock = -1;
 
+// Client that waits for new results of a search
+struct watch_t {
+    uint8_t id[SHA1_BIN_LENGTH];
+    FILE *fp;
+    struct watch_t *next;
+};
+
+static struct watch_t *g_watches = NULL;
+
+static void cli_watch_handler(int rc, int clientsock);
+
+static bool watch_add(FILE *fp, const uint8_t id[])
+{
+    struct watch_t *watch = calloc(1, sizeof(struct watch_t));
+    if (watch == NULL) {
+        return false;
+    }
+
+    memcpy(&watch->id, id, SHA1_BIN_LENGTH);
+    watch->fp = fp;
+
+    watch->next = g_watches;
+    g_watches = watch;
+
+    return true;
+}
+
+// Close the connection of a watch, the local console stays open
+static void watch_free(struct watch_t *watch)
+{
+    if (watch->fp != stdout) {
+        net_remove_handler(fileno(watch->fp), &cli_watch_handler);
+        fclose(watch->fp);
+    }
+    free(watch);
+}
+
+static void watch_remove(struct watch_t **pwatch)
+{
+    struct watch_t *watch = *pwatch;
+    *pwatch = watch->next;
+    watch_free(watch);
+}
+
+void cli_watch_result(const uint8_t id[], const uint8_t *ip, uint8_t length, uint16_t port)
+{
+    struct watch_t **pwatch = &g_watches;
+    while (*pwatch) {
+        struct watch_t *watch = *pwatch;
+        if (memcmp(&watch->id, id, SHA1_BIN_LENGTH) == 0) {
+            fprintf(watch->fp, "%s\n", str_addr2(ip, length, port));
+            fflush(watch->fp);
+            if (ferror(watch->fp)) {
+                // client is gone
+                watch_remove(pwatch);
+                continue;
+            }
+        }
+        pwatch = &watch->next;
+    }
+}
+
+void cli_watch_done(const uint8_t id[])
+{
+    // wait for the search of the other address family
+    if (kad_search_running(id)) {
+        return;
+    }
+
+    struct watch_t **pwatch = &g_watches;
+    while (*pwatch) {
+        struct watch_t *watch = *pwatch;
+        if (memcmp(&watch->id, id, SHA1_BIN_LENGTH) == 0) {
+            fprintf(watch->fp, "Search done.\n");
+            fflush(watch->fp);
+            watch_remove(pwatch);
+        } else {
+            pwatch = &watch->next;
+        }
+    }
+}
+
+// Only notice when a watching client closes the connection
+static void cli_watch_handler(int rc, int clientsock)
+{
+    char buffer[256];
+
+    if (rc <= 0) {
+        return;
+    }
+
+    ssize_t size = read(clientsock, buffer, sizeof(buffer));
+    if (size > 0 || (size == -1 && (errno == EAGAIN || errno == EINTR))) {
+        return;
+    }
+
+    struct watch_t **pwatch = &g_watches;
+    while (*pwatch) {
+        struct watch_t *watch = *pwatch;
+        if (watch->fp != stdout && fileno(watch->fp) == clientsock) {
+            watch_remove(pwatch);
+            break;
+        }
+        pwatch = &watch->next;
+    }
+}
+
 static void cmd_ping(FILE *fp, const IP *addr)
 {
     if (kad_ping(addr)) {
@@ -93,6 +203,7 @@ enum {
     oSearch,
     oResults,
     oLookup,
+    oWatch,
     oStatus,
     oAnnounceStart,
     oAnnounceStop,
@@ -113,6 +224,7 @@ static const option_t g_options[] = {
     {"results", 2, oResults},
     {"lookup", 2, oLookup},
     {"query", 2, oLookup}, // for backwards compatibility
+    {"watch", 2, oWatch},
     {"status", 1, oStatus},
     {"announce-start", 2, oAnnounceStart},
     {"announce-stop", 2, oAnnounceStop},
@@ -126,7 +238,8 @@ static const option_t g_options[] = {
     {NULL, 0, 0}
 };
 
-static void cmd_exec(FILE *fp, char request[], bool allow_debug)
+// Returns true if a watch took over fp
+static bool cmd_exec(FILE *fp, char request[], bool allow_debug)
 {
     uint8_t id[SHA1_BIN_LENGTH];
     const char *argv[8];
@@ -135,27 +248,27 @@ static void cmd_exec(FILE *fp, char request[], bool allow_debug)
     if (argc == 0) {
         // Print usage
         fprintf(fp, "%s", g_server_usage);
-        return;
+        return false;
     }
 
     const option_t *option = find_option(g_options, argv[0]);
 
     if (option == NULL) {
         fprintf(fp, "Unknown command.\n");
-        return;
+        return false;
     }
 
     if (option->num_args != argc) {
         fprintf(fp, "Unexpected number of arguments.\n");
-        return;
+        return false;
     }
 
     // parse identifier
     switch (option->code) {
-        case oSearch: case oResults: case oLookup: case oAnnounceStop:
+        case oSearch: case oResults: case oLookup: case oWatch: case oAnnounceStop:
         if (!parse_id(id, sizeof(id), argv[1], strlen(argv[1]))) {
             fprintf(fp, "Failed to parse identifier.\n");
-            return;
+            return false;
         }
     }
 
@@ -201,6 +314,21 @@ static void cmd_exec(FILE *fp, char request[], bool allow_debug)
         kad_start_search(NULL, id, 0);
         results_print(fp, id);
         break;
+    case oWatch:
+        if (!kad_start_search(NULL, id, 0)) {
+            fprintf(fp, "Failed to start search.\n");
+            break;
+        }
+        results_print(fp, id);
+        if (kad_search_running(id)) {
+            if (watch_add(fp, id)) {
+                return true;
+            }
+            fprintf(fp, "Failed to watch search.\n");
+            break;
+        }
+        fprintf(fp, "Search done.\n");
+        break;
     case oSearch:
         kad_start_search(fp, id, 0);
         break;
@@ -244,6 +372,8 @@ static void cmd_exec(FILE *fp, char request[], bool allow_debug)
         kad_print_storage(fp);
         break;
     }
+
+    return false;
 }
 
 static void cli_client_handler(int rc, int clientsock)
@@ -281,11 +411,22 @@ static void cli_client_handler(int rc, int clientsock)
             if (next) {
                 *next = '\0'; // replace newline with 0
                 #ifdef DEBUG
-                    cmd_exec(current_clientfd, cur, true);
+                    bool watching = cmd_exec(current_clientfd, cur, true);
                 #else
-                    cmd_exec(current_clientfd, cur, false);
+                    bool watching = cmd_exec(current_clientfd, cur, false);
                 #endif
                 fflush(current_clientfd);
+
+                if (watching) {
+                    // the connection stays open until the search is done
+                    net_remove_handler(clientsock, &cli_client_handler);
+                    net_add_handler(clientsock, &cli_watch_handler);
+
+                    current_clientsock = -1;
+                    current_clientfd = NULL;
+                    request_length = 0;
+                    return;
+                }
                 cur = next + 1;
 
                 // force connection to be
@@ -374,6 +515,10 @@ bool cli_setup(void)
 
 void cli_free(void)
 {
+    while (g_watches) {
+        watch_remove(&g_watches);
+    }
+
     if (g_cli_sock >= 0) {
         unix_remove_unix_socket(gconf->cli_path, g_cli_sock);
     }
@@ -9,4 +9,8 @@ int cli_client(int argc, char *argv[]);
 bool cli_setup(void);
 void cli_free(void);
 
+// Stream new results and the end of a search to watching clients
+void cli_watch_result(const uint8_t id[], const uint8_t *ip, uint8_t length, uint16_t port);
+void cli_watch_done(const uint8_t id[]);
+
 #endif // _EXT_CLI_H_
@@ -38,7 +38,6 @@ enum {
 
 struct lpd_state {
     IP mcast_addr;
-    time_t mcast_time;
     int packet_limit;
     int sock_send;
     int sock_listen;
@@ -46,7 +45,6 @@ struct lpd_state {
 
 struct lpd_state g_lpd4 = {
     .mcast_addr = {0},
-    .mcast_time = 0,
     .packet_limit = PACKET_LIMIT_MAX,
     .sock_send = -1,
     .sock_listen = -1
@@ -54,7 +52,6 @@ struct lpd_state g_lpd4 = {
 
 struct lpd_state g_lpd6 = {
     .mcast_addr = {0},
-    .mcast_time = 0,
     .packet_limit = PACKET_LIMIT_MAX,
     .sock_send = -1,
     .sock_listen = -1
@@ -162,31 +159,46 @@ static void send_mcasts(const struct lpd_state* lpd, const struct ifaddrs *ifas)
     }
 }
 
-static void handle_mcast(int mcast_rc, struct lpd_state* lpd)
+static void handle_mcast_timer(struct lpd_state* lpd, const struct ifaddrs *ifaddrs)
 {
-    // called at least every second
-    if (lpd->mcast_time <= time_now_sec()) {
-        struct ifaddrs *ifaddrs;
-        if (getifaddrs(&ifaddrs) == 0) {
-            // join multicast group (in case of new interfaces)
-            join_mcast(lpd, ifaddrs);
-
-            // No peers known, send multicast
-            if (kad_count_nodes(false) == 0) {
-                send_mcasts(lpd, ifaddrs);
-            }
-            freeifaddrs(ifaddrs);
-        } else {
-            log_error("getifaddrs() %s", strerror(errno));
+    if (lpd->sock_listen < 0 || lpd->sock_send < 0) {
+        return;
+    }
+
+    if (ifaddrs) {
+        // join multicast group (in case of new interfaces)
+        join_mcast(lpd, ifaddrs);
+
+        // No peers known, send multicast
+        if (kad_count_nodes(false) == 0) {
+            send_mcasts(lpd, ifaddrs);
         }
+    }
 
-        // Cap number of received packets to 10 per minute
-        lpd->packet_limit = 5 * PACKET_LIMIT_MAX;
+    // Cap number of received packets to 10 per minute
+    lpd->packet_limit = 5 * PACKET_LIMIT_MAX;
+}
 
-        // Try again in ~5 minutes
-        lpd->mcast_time = time_add_mins(5);
+static void handle_timer(void)
+{
+    struct ifaddrs *ifaddrs;
+
+    if (getifaddrs(&ifaddrs) == 0) {
+        handle_mcast_timer(&g_lpd4, ifaddrs);
+        handle_mcast_timer(&g_lpd6, ifaddrs);
+        freeifaddrs(ifaddrs);
+    } else {
+        log_error("getifaddrs() %s", strerror(errno));
+        handle_mcast_timer(&g_lpd4, NULL);
+        handle_mcast_timer(&g_lpd6, NULL);
     }
 
+    // Try again in ~5 minutes
+    net_add_timer(time_add_mins(5), &handle_timer);
+}
+
+static void handle_mcast(int mcast_rc, struct lpd_state* lpd)
+{
     if (mcast_rc <= 0) {
         return;
     }
@@ -356,6 +368,10 @@ bool lpd_setup(void)
         ready = true;
     }
 
+    if (ready) {
+        net_add_timer(time_now_ms(), &handle_timer);
+    }
+
     return ready;
 }
 
@@ -2,10 +2,13 @@
 #define _GNU_SOURCE
 
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "log.h"
 #include "main.h"
@@ -15,188 +18,1518 @@
 #include "net.h"
 #include "announces.h"
 #include "results.h"
+#include "ext-cli.h"
+#include "pool.h"
+#ifdef URING
+#include "uring.h"
+#endif
+#ifdef WORKERS
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/filter.h>
+#endif
+
+// Objects allocated up front with --preallocate
+#define DHT_PREALLOC_NODES 1024
+#define DHT_PREALLOC_SEARCHES 32
+
+// Routing table nodes and searches of the DHT
+static struct pool g_node_pool;
+static struct pool g_search_pool;
+
+#define DHT_NODE_ALLOC() pool_alloc(&g_node_pool)
+#define DHT_NODE_FREE(n) pool_free(&g_node_pool, n)
+#define DHT_SEARCH_ALLOC() pool_alloc(&g_search_pool)
+#define DHT_SEARCH_FREE(sr) pool_free(&g_search_pool, sr)
+
+#ifdef WORKERS
+// Workers call dht_answer() at the same time
+#define DHT_THREAD_LOCAL __thread
+
+// Guards the nodes that workers hand over with dht_answer_flush()
+static pthread_mutex_t g_seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define DHT_SEEN_LOCK() pthread_mutex_lock(&g_seen_lock)
+#define DHT_SEEN_UNLOCK() pthread_mutex_unlock(&g_seen_lock)
+#endif
+
+// include dht.c instead of dht.h to access private vars
+#include "dht.c"
+
+
+/*
+* The interface that is used to interact with the DHT.
+*/
+
+// Size of a receive buffer, the last byte is reserved for a null terminator
+#define DHT_PACKET_SIZE 1500
+
+// Receive buffers for up to gconf->dht_recv_budget packets
+struct recv_ring {
+    uint8_t *bufs;
+    IP *addrs;
+#ifdef __linux__
+    struct iovec *iovs;
+    struct mmsghdr *msgs;
+#endif
+};
+
+static struct recv_ring g_recv;
+
+// Number of receive syscalls, packets received and packets dropped
+static uint64_t g_recv_calls = 0;
+static uint64_t g_recv_packets = 0;
+static uint64_t g_recv_dropped = 0;
+
+// Maximum number of queued outgoing packets per socket
+#define DHT_SEND_QUEUE 32
+
+// Outgoing packets, sent at the end of an event loop iteration
+struct send_queue {
+    int sock;
+    // queued packets are at [head, count)
+    int head;
+    int count;
+    int flags[DHT_SEND_QUEUE];
+    IP addrs[DHT_SEND_QUEUE];
+    struct iovec iovs[DHT_SEND_QUEUE];
+#ifdef __linux__
+    struct mmsghdr msgs[DHT_SEND_QUEUE];
+#endif
+    // statistics not yet added to the totals, see send_queue_account()
+    uint64_t calls;
+    uint64_t packets;
+    uint64_t dropped;
+    uint64_t bytes;
+    // the socket is in the event loop
+    bool watched;
+    uint8_t bufs[DHT_SEND_QUEUE * DHT_PACKET_SIZE];
+};
+
+// Sockets of a node id, every id listens on its own port
+struct kad_socket {
+    int sock4;
+    int sock6;
+    struct send_queue *queue4;
+    struct send_queue *queue6;
+};
+
+// The sockets of the event loop, the DHT code knows the ids by them
+static struct kad_socket g_dht_sockets[DHT_NODE_IDS_MAX];
+static int g_dht_sockets_count = 0;
+
+#ifdef WORKERS
+#ifndef __linux__
+#error "DHT workers are only supported on Linux"
+#endif
+
+// Packets that a worker passes to the event loop
+#define WORKER_INBOX_SIZE 64
+
+struct worker_inbox {
+    int count;
+    int socks[WORKER_INBOX_SIZE];
+    size_t lens[WORKER_INBOX_SIZE];
+    IP addrs[WORKER_INBOX_SIZE];
+    socklen_t addrlens[WORKER_INBOX_SIZE];
+    uint8_t bufs[WORKER_INBOX_SIZE * DHT_PACKET_SIZE];
+};
+
+// Statistics of a worker, see worker_publish()
+struct worker_stats {
+    uint64_t recv_calls;
+    uint64_t recv_packets;
+    uint64_t recv_bytes;
+    uint64_t inbox_dropped;
+    uint64_t send_calls;
+    uint64_t send_packets;
+    uint64_t send_dropped;
+    uint64_t send_bytes;
+};
+
+// A thread with its own SO_REUSEPORT sockets. Requests are answered
+// with the event loop lock shared by all workers. Replies and
+// announcements change the DHT state, the event loop handles them.
+struct worker {
+    pthread_t thread;
+    int cpu;
+    // same order as g_dht_sockets
+    struct kad_socket sockets[DHT_NODE_IDS_MAX];
+    struct recv_ring recv;
+    // statistics of the worker thread only
+    struct worker_stats stats;
+    int64_t publish_time;
+    // guards inbox, inboxes and published
+    pthread_mutex_t lock;
+    // filled by the worker, the event loop handles the other one
+    struct worker_inbox *inbox;
+    struct worker_inbox inboxes[2];
+    // statistics not yet added to the totals, see worker_collect()
+    struct worker_stats published;
+};
+
+static struct worker *g_workers = NULL;
+static int g_workers_count = 0;
+
+// Set by workers that passed packets or nodes to the event loop
+static bool g_workers_pending = false;
+
+// Written to on shutdown to wake up the workers
+static int g_workers_pipe[2] = { -1, -1 };
+
+// The worker of the current thread, NULL for the event loop
+static __thread struct worker *t_worker = NULL;
+#endif
+
+// Number of send syscalls, packets sent and packets dropped
+static uint64_t g_send_calls = 0;
+static uint64_t g_send_packets = 0;
+static uint64_t g_send_dropped = 0;
+
+// This callback is called when a search result arrives or a search completes
+void dht_callback_func(void *closure, int event, const uint8_t *info_hash, const void *data, size_t data_len)
+{
+    switch (event) {
+        case DHT_EVENT_VALUES:
+            results_add(info_hash, AF_INET, data, data_len);
+            break;
+        case DHT_EVENT_VALUES6:
+            results_add(info_hash, AF_INET6, data, data_len);
+            break;
+        case DHT_EVENT_SEARCH_DONE:
+        case DHT_EVENT_SEARCH_DONE6:
+#ifdef CLI
+            cli_watch_done(info_hash);
+#endif
+            break;
+        case DHT_EVENT_SEARCH_EXPIRED:
+            results_clear(info_hash);
+#ifdef CLI
+            cli_watch_done(info_hash);
+#endif
+            break;
+    }
+}
+
+static void clear_old_traffic_counters(void)
+{
+    size_t idx = gconf->time_now % TRAFFIC_DURATION_SECONDS;
+    uint32_t since = (gconf->time_now - gconf->traffic_time);
+    size_t n = MIN(since, TRAFFIC_DURATION_SECONDS);
+
+    // clear old traffic measurement buckets
+    for (size_t i = 0; i < n; ++i) {
+        size_t j = (TRAFFIC_DURATION_SECONDS + idx + i + 1) % TRAFFIC_DURATION_SECONDS;
+        gconf->traffic_in[j] = 0;
+        gconf->traffic_out[j] = 0;
+    }
+}
+
+static void record_traffic(uint32_t in_bytes, uint32_t out_bytes)
+{
+    clear_old_traffic_counters();
+
+    gconf->traffic_in_sum += in_bytes;
+    gconf->traffic_out_sum += out_bytes;
+
+    size_t idx = gconf->time_now % TRAFFIC_DURATION_SECONDS;
+    gconf->traffic_time = gconf->time_now;
+    gconf->traffic_in[idx] += in_bytes;
+    gconf->traffic_out[idx] += out_bytes;
+}
+
+static void dht_maintenance(void);
+
+// Deadline of the pending dht_maintenance() timer
+static int64_t g_maintenance_deadline = INT64_MAX;
+
+// Call dht_periodic() again after time_wait milliseconds. An earlier
+// pending call is kept, it schedules the next one. This spares the
+// timer heap an update for every received packet.
+static void dht_schedule_maintenance(int64_t time_wait)
+{
+    int64_t deadline = time_add_ms(MAX(time_wait, 1));
+
+    if (deadline < g_maintenance_deadline) {
+        g_maintenance_deadline = deadline;
+        net_add_timer(deadline, &dht_maintenance);
+    }
+}
+
+// Pass a packet received on a socket of the event loop to the DHT code
+static void dht_handle_packet(int sock, uint8_t buf[], size_t buflen, IP *from, socklen_t fromlen)
+{
+    int64_t time_wait = 0;
+    int rc;
+
+    record_traffic(buflen, 0);
+
+    // The DHT code expects the message to be null-terminated.
+    buf[buflen] = '\0';
+
+    rc = dht_periodic(sock, buf, buflen, (struct sockaddr*) from, fromlen, &time_wait, dht_callback_func, NULL);
+
+    if (rc < 0 && errno != EINTR) {
+        if (rc == EINVAL || rc == EFAULT) {
+            log_error("KAD: Error calling dht_periodic");
+            exit(1);
+        }
+        dht_schedule_maintenance(1000);
+    } else {
+        dht_schedule_maintenance(time_wait);
+    }
+}
+
+#ifdef __linux__
+// Receive up to gconf->dht_recv_budget packets with a single syscall
+static int recv_ring_receive(struct recv_ring *r, int sock)
+{
+    int budget = gconf->dht_recv_budget;
+
+    for (int i = 0; i < budget; i++) {
+        r->msgs[i].msg_hdr.msg_namelen = sizeof(IP);
+        r->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    int n = recvmmsg(sock, r->msgs, budget, MSG_DONTWAIT, NULL);
+
+    return (n > 0) ? n : 0;
+}
+
+// Pass n packets received for the event loop socket sock to the DHT code
+static void recv_ring_handle(struct recv_ring *r, int n, int sock)
+{
+    for (int i = 0; i < n; i++) {
+        const struct msghdr *hdr = &r->msgs[i].msg_hdr;
+        size_t buflen = r->msgs[i].msg_len;
+
+        if (buflen == 0 || (hdr->msg_flags & MSG_TRUNC)) {
+            continue;
+        }
+
+        dht_handle_packet(sock, &r->bufs[i * DHT_PACKET_SIZE], buflen, &r->addrs[i], hdr->msg_namelen);
+    }
+}
+
+static int dht_receive(int sock)
+{
+    int n = recv_ring_receive(&g_recv, sock);
+
+    if (n > 0) {
+        g_recv_calls += 1;
+        g_recv_packets += n;
+        recv_ring_handle(&g_recv, n, sock);
+    }
+
+    return n;
+}
+#else
+// Receive up to gconf->dht_recv_budget packets
+static int dht_receive(int sock)
+{
+    int budget = gconf->dht_recv_budget;
+    int n;
+
+    for (n = 0; n < budget; n++) {
+        socklen_t fromlen = sizeof(IP);
+        ssize_t buflen = recvfrom(sock, g_recv.bufs, DHT_PACKET_SIZE - 1, 0, (struct sockaddr*) &g_recv.addrs[0], &fromlen);
+
+        if (buflen < 0) {
+            break;
+        }
+
+        g_recv_calls += 1;
+        g_recv_packets += 1;
+
+        if (buflen > 0) {
+            dht_handle_packet(sock, g_recv.bufs, buflen, &g_recv.addrs[0], fromlen);
+        }
+    }
+
+    return n;
+}
+#endif
+
+void dht_handler(int rc, int sock);
+
+#ifdef URING
+// Called by the io_uring engine for every received packet
+static void dht_uring_recv(int sock, uint8_t buf[], size_t buflen, IP *from, socklen_t fromlen)
+{
+    g_recv_packets += 1;
+    dht_handle_packet(sock, buf, buflen, from, fromlen);
+}
+
+// Called by the io_uring engine when a send request completed
+static void dht_uring_sent(int sock, int rc)
+{
+    if (rc > 0) {
+        g_send_packets += 1;
+        record_traffic(0, rc);
+    } else {
+        g_send_dropped += 1;
+    }
+}
+#endif
+
+static struct send_queue *send_queue_get(int sock)
+{
+    struct kad_socket *sockets = g_dht_sockets;
+
+#ifdef WORKERS
+    // The DHT code only knows the sockets of the event loop
+    if (t_worker) {
+        sockets = t_worker->sockets;
+    }
+#endif
+
+    for (int i = 0; i < g_dht_sockets_count; i++) {
+        if (sock == g_dht_sockets[i].sock4) {
+            return sockets[i].queue4;
+        }
+        if (sock == g_dht_sockets[i].sock6) {
+            return sockets[i].queue6;
+        }
+    }
+
+    return NULL;
+}
+
+#ifdef __linux__
+// Send n packets with the same flags, return the number of packets sent or -1
+static int send_queue_send(struct send_queue *q, int n, int flags)
+{
+    int rc = sendmmsg(q->sock, &q->msgs[q->head], n, flags);
+
+    if (rc > 0) {
+        q->calls += 1;
+        for (int i = 0; i < rc; i++) {
+            q->bytes += q->msgs[q->head + i].msg_len;
+        }
+    }
+
+    return rc;
+}
+#else
+// Send n packets with the same flags, return the number of packets sent or -1
+static int send_queue_send(struct send_queue *q, int n, int flags)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        const struct iovec *iov = &q->iovs[q->head + i];
+        const IP *addr = &q->addrs[q->head + i];
+        ssize_t rc = sendto(q->sock, iov->iov_base, iov->iov_len, flags, (const struct sockaddr*) addr, addr_len(addr));
+
+        if (rc < 0) {
+            break;
+        }
+
+        q->calls += 1;
+        q->bytes += rc;
+    }
+
+    return (i > 0) ? i : -1;
+}
+#endif
+
+// Send all queued packets, return false if the socket buffer is full
+static bool send_queue_flush(struct send_queue *q)
+{
+    while (q->head < q->count) {
+        // Packets with the same flags (e.g. MSG_CONFIRM) are sent together
+        int flags = q->flags[q->head];
+        int n = 1;
+        while ((q->head + n) < q->count && q->flags[q->head + n] == flags) {
+            n += 1;
+        }
+
+        int rc = send_queue_send(q, n, flags);
+
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                // Socket buffer full
+                return false;
+            }
+
+            // Drop the packet that cannot be sent (e.g. unreachable network)
+            q->dropped += 1;
+            rc = 1;
+        } else {
+            q->packets += rc;
+        }
+
+        q->head += rc;
+    }
+
+    q->head = 0;
+    q->count = 0;
+
+    return true;
+}
+
+// Add the statistics of a queue to the totals
+static void send_queue_account(struct send_queue *q)
+{
+    g_send_calls += q->calls;
+    g_send_packets += q->packets;
+    g_send_dropped += q->dropped;
+    record_traffic(0, q->bytes);
+
+    q->calls = 0;
+    q->packets = 0;
+    q->dropped = 0;
+    q->bytes = 0;
+}
+
+// Send queued packets of the event loop sockets
+static void dht_flush_queue(struct send_queue *q)
+{
+    bool done = send_queue_flush(q);
+
+#ifdef WORKERS
+    if (t_worker) {
+        // Accounted by worker_publish()
+        return;
+    }
+#endif
+
+    send_queue_account(q);
+
+    if (q->watched) {
+        // Otherwise continue when the socket becomes writable
+        net_want_writable(q->sock, &dht_handler, !done);
+    }
+}
+
+// Called at the end of every event loop iteration
+static void dht_flush_handler(void)
+{
+    for (int i = 0; i < g_dht_sockets_count; i++) {
+        struct kad_socket *s = &g_dht_sockets[i];
+
+        if (s->queue4 && s->queue4->count > 0) {
+            dht_flush_queue(s->queue4);
+        }
+
+        if (s->queue6 && s->queue6->count > 0) {
+            dht_flush_queue(s->queue6);
+        }
+    }
+}
+
+// Append a packet to the queue, return false if the queue is full
+static bool send_queue_add(struct send_queue *q, const void *buf, int buflen, int flags, const struct sockaddr *to, int tolen)
+{
+    if (q->count == DHT_SEND_QUEUE) {
+        if (q->head == 0) {
+            return false;
+        }
+
+        // Move unsent packets to the front
+        for (int i = q->head; i < q->count; i++) {
+            int j = i - q->head;
+            memcpy(&q->bufs[j * DHT_PACKET_SIZE], q->iovs[i].iov_base, q->iovs[i].iov_len);
+            q->addrs[j] = q->addrs[i];
+            q->flags[j] = q->flags[i];
+            q->iovs[j].iov_len = q->iovs[i].iov_len;
+#ifdef __linux__
+            q->msgs[j].msg_hdr.msg_namelen = q->msgs[i].msg_hdr.msg_namelen;
+#endif
+        }
+        q->count -= q->head;
+        q->head = 0;
+    }
+
+    int i = q->count;
+
+    memcpy(&q->bufs[i * DHT_PACKET_SIZE], buf, buflen);
+    memcpy(&q->addrs[i], to, tolen);
+    q->flags[i] = flags;
+    q->iovs[i].iov_len = buflen;
+#ifdef __linux__
+    q->msgs[i].msg_hdr.msg_namelen = tolen;
+#endif
+    q->count += 1;
+
+    return true;
+}
+
+// Handle incoming packets and pass them to the DHT code
+void dht_handler(int rc, int sock)
+{
+    if (rc & POLLOUT) {
+        // Socket became writable again
+        struct send_queue *q = send_queue_get(sock);
+        if (q) {
+            dht_flush_queue(q);
+        }
+    }
+
+    if (rc & ~POLLOUT) {
+        dht_receive(sock);
+    }
+}
+
+// Do a maintenance call, e.g. to expire nodes and advance searches
+static void dht_maintenance(void)
+{
+    int64_t time_wait = 0;
+    int rc = dht_periodic(-1, NULL, 0, NULL, 0, &time_wait, dht_callback_func, NULL);
+
+    // Replace the pending call, if any
+    g_maintenance_deadline = INT64_MAX;
+
+    if (rc < 0) {
+        if (rc == EINVAL || rc == EFAULT) {
+            log_error("KAD: Error using select: %s", strerror(errno));
+        }
+        dht_schedule_maintenance(1000);
+    } else {
+        // Wait for the next maintenance call
+        dht_schedule_maintenance(time_wait);
+        //log_debug("KAD: Next maintenance call in %u ms.", (unsigned) time_wait);
+    }
+}
+
+/*
+* Kademlia needs dht_blacklisted/dht_hash/dht_random_bytes functions to be present.
+*/
+
+// Queue packet, it will be sent at the end of the current event loop iteration
+int dht_sendto(int sockfd, const void *buf, int buflen, int flags, const struct sockaddr *to, int tolen)
+{
+    struct send_queue *q = send_queue_get(sockfd);
+
+#ifdef URING
+    if (q == NULL && uring_enabled() && buflen < DHT_PACKET_SIZE) {
+        // Submitted with the next io_uring_enter() call
+        if (uring_sendto(sockfd, buf, buflen, flags, to, tolen) < 0) {
+            g_send_dropped += 1;
+            return -1;
+        }
+        return buflen;
+    }
+#endif
+
+    if (q == NULL || buflen >= DHT_PACKET_SIZE || tolen > sizeof(IP)) {
+        // Send oversized packets right away
+        if (q && q->count > 0) {
+            dht_flush_queue(q);
+        }
+
+        int rc = sendto(q ? q->sock : sockfd, buf, buflen, flags, to, tolen);
+        if (rc > 0 && q) {
+            // Accounted with the queue
+            q->calls += 1;
+            q->packets += 1;
+            q->bytes += rc;
+        } else if (rc > 0) {
+            g_send_calls += 1;
+            g_send_packets += 1;
+            record_traffic(0, rc);
+        }
+        return rc;
+    }
+
+    if (q->count == DHT_SEND_QUEUE && q->head == 0) {
+        dht_flush_queue(q);
+    }
+
+    if (!send_queue_add(q, buf, buflen, flags, to, tolen)) {
+        // Socket is congested
+        q->dropped += 1;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return buflen;
+}
+
+int dht_blacklisted(const struct sockaddr *sa, int salen)
+{
+    return 0;
+}
+
+// Hashing for the DHT - implementation does not matter for interoperability
+void dht_hash(void *hash_return, int hash_size,
+        const void *v1, int len1,
+        const void *v2, int len2,
+        const void *v3, int len3)
+{
+    union {
+        uint8_t data[8];
+        uint16_t num4[4];
+        uint32_t num2[2];
+        uint64_t num1[1];
+    } hash;
+
+    assert(len1 == 8);
+    memcpy(&hash.data, v1, 8);
+
+    assert(len2 == 4 || len2 == 16);
+    if (len2 == 4) {
+        const uint32_t d2 = *((uint32_t*) v2);
+        hash.num2[0] ^= d2;
+        hash.num2[1] ^= d2;
+    } else {
+        hash.num1[0] ^= *((uint64_t*) v2);
+        hash.num1[0] ^= *((uint64_t*) v2 + 8);
+    }
+
+    assert(len3 == 2);
+    const uint16_t d3 = *((uint16_t*) v3);
+    hash.num4[0] ^= d3;
+    hash.num4[1] ^= d3;
+    hash.num4[2] ^= d3;
+    hash.num4[3] ^= d3;
+
+    assert(hash_size == 8);
+    memcpy(hash_return, &hash.data, 8);
+}
+
+int dht_random_bytes(void *buf, size_t size)
+{
+    return bytes_random(buf, size);
+}
+
+// The DHT uses the cached clock instead of calling gettimeofday()
+int64_t dht_time_ms(void)
+{
+#ifdef WORKERS
+    // Only the event loop updates time_now_ms()
+    if (t_worker) {
+        return time_read_ms();
+    }
+#endif
+    return time_now_ms();
+}
+
+static bool recv_ring_setup(struct recv_ring *r, int budget)
+{
+    r->bufs = (uint8_t*) malloc(budget * DHT_PACKET_SIZE);
+    r->addrs = (IP*) calloc(budget, sizeof(IP));
+
+    if (r->bufs == NULL || r->addrs == NULL) {
+        return false;
+    }
+
+#ifdef __linux__
+    r->iovs = (struct iovec*) calloc(budget, sizeof(struct iovec));
+    r->msgs = (struct mmsghdr*) calloc(budget, sizeof(struct mmsghdr));
+
+    if (r->iovs == NULL || r->msgs == NULL) {
+        return false;
+    }
+
+    for (int i = 0; i < budget; i++) {
+        r->iovs[i].iov_base = &r->bufs[i * DHT_PACKET_SIZE];
+        r->iovs[i].iov_len = DHT_PACKET_SIZE - 1;
+        r->msgs[i].msg_hdr.msg_name = &r->addrs[i];
+        r->msgs[i].msg_hdr.msg_namelen = sizeof(IP);
+        r->msgs[i].msg_hdr.msg_iov = &r->iovs[i];
+        r->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+
+    return true;
+}
+
+static void recv_ring_free(struct recv_ring *r)
+{
+    free(r->bufs);
+    free(r->addrs);
+#ifdef __linux__
+    free(r->iovs);
+    free(r->msgs);
+#endif
+}
+
+static struct send_queue *kad_setup_send(int sock)
+{
+    struct send_queue *q = (struct send_queue*) calloc(1, sizeof(struct send_queue));
+
+    if (q == NULL) {
+        return NULL;
+    }
+
+    q->sock = sock;
+
+    for (int i = 0; i < DHT_SEND_QUEUE; i++) {
+        q->iovs[i].iov_base = &q->bufs[i * DHT_PACKET_SIZE];
+#ifdef __linux__
+        q->msgs[i].msg_hdr.msg_name = &q->addrs[i];
+        q->msgs[i].msg_hdr.msg_iov = &q->iovs[i];
+        q->msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+    }
+
+    return q;
+}
+
+// Receive and send packets with io_uring or the event loop
+static void kad_add_socket(int sock, struct send_queue **q)
+{
+#ifdef URING
+    if (uring_add_socket(sock, &dht_uring_recv, &dht_uring_sent, &dht_handler)) {
+        return;
+    }
+#endif
+
+    *q = kad_setup_send(sock);
+    if (*q == NULL) {
+        log_error("KAD: Cannot allocate send queue.");
+        exit(1);
+    }
+
+    (*q)->watched = true;
+    net_add_handler(sock, &dht_handler);
+}
+
+#ifdef WORKERS
+// Move the statistics of a worker send queue to the worker statistics
+static void worker_take_queue_stats(struct worker_stats *stats, struct send_queue *q)
+{
+    if (q == NULL) {
+        return;
+    }
+
+    stats->send_calls += q->calls;
+    stats->send_packets += q->packets;
+    stats->send_dropped += q->dropped;
+    stats->send_bytes += q->bytes;
+
+    q->calls = 0;
+    q->packets = 0;
+    q->dropped = 0;
+    q->bytes = 0;
+}
+
+// Publish the statistics of the worker thread, needs w->lock
+static void worker_publish(struct worker *w)
+{
+    struct worker_stats *stats = &w->stats;
+    struct worker_stats *published = &w->published;
+
+    for (int i = 0; i < g_dht_sockets_count; i++) {
+        worker_take_queue_stats(stats, w->sockets[i].queue4);
+        worker_take_queue_stats(stats, w->sockets[i].queue6);
+    }
+
+    published->recv_calls += stats->recv_calls;
+    published->recv_packets += stats->recv_packets;
+    published->recv_bytes += stats->recv_bytes;
+    published->inbox_dropped += stats->inbox_dropped;
+    published->send_calls += stats->send_calls;
+    published->send_packets += stats->send_packets;
+    published->send_dropped += stats->send_dropped;
+    published->send_bytes += stats->send_bytes;
+
+    memset(stats, 0, sizeof(*stats));
+    w->publish_time = time_read_ms();
+}
+
+// Copy the n received packets that dht_answer() did not handle to the
+// inbox of the worker, needs w->lock
+static void worker_forward(struct worker *w, int n, int dht_sock)
+{
+    struct recv_ring *r = &w->recv;
+    struct worker_inbox *inbox = w->inbox;
+
+    for (int i = 0; i < n; i++) {
+        const struct msghdr *hdr = &r->msgs[i].msg_hdr;
+        size_t buflen = r->msgs[i].msg_len;
+
+        if (buflen == 0 || (hdr->msg_flags & MSG_TRUNC)) {
+            continue;
+        }
+
+        if (inbox->count == WORKER_INBOX_SIZE) {
+            // The event loop is behind
+            w->stats.inbox_dropped += 1;
+            continue;
+        }
+
+        int j = inbox->count;
+        memcpy(&inbox->bufs[j * DHT_PACKET_SIZE], &r->bufs[i * DHT_PACKET_SIZE], buflen);
+        inbox->socks[j] = dht_sock;
+        inbox->lens[j] = buflen;
+        inbox->addrs[j] = r->addrs[i];
+        inbox->addrlens[j] = hdr->msg_namelen;
+        inbox->count += 1;
+    }
+}
+
+// Receive from a worker socket. Requests are answered right away, all
+// other packets are passed to the event loop as if they were received
+// on the event loop socket dht_sock of the same id.
+static void worker_receive(struct worker *w, int sock, int dht_sock)
+{
+    struct recv_ring *r = &w->recv;
+    int forward = 0;
+    int n = recv_ring_receive(r, sock);
+
+    if (n == 0) {
+        return;
+    }
+
+    w->stats.recv_calls += 1;
+    w->stats.recv_packets += n;
+
+    // Answer requests together with the other workers
+    net_lock_shared();
+    for (int i = 0; i < n; i++) {
+        struct msghdr *hdr = &r->msgs[i].msg_hdr;
+        uint8_t *buf = &r->bufs[i * DHT_PACKET_SIZE];
+        size_t buflen = r->msgs[i].msg_len;
+
+        if (buflen == 0 || (hdr->msg_flags & MSG_TRUNC)) {
+            continue;
+        }
+
+        buf[buflen] = '\0';
+
+        if (dht_answer(dht_sock, buf, buflen, (struct sockaddr*) &r->addrs[i], hdr->msg_namelen) == 0) {
+            forward += 1;
+        } else {
+            // Skipped by worker_forward()
+            w->stats.recv_bytes += buflen;
+            r->msgs[i].msg_len = 0;
+        }
+    }
+    net_unlock();
+
+    // The senders of the requests are added within a second, or right
+    // away once many of them are waiting
+    bool wakeup = dht_answer_flush() || (forward > 0);
+
+    if (wakeup || w->publish_time + 1000 <= time_read_ms()) {
+        pthread_mutex_lock(&w->lock);
+        if (forward > 0) {
+            worker_forward(w, n, dht_sock);
+        }
+        worker_publish(w);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    if (wakeup && !__atomic_exchange_n(&g_workers_pending, true, __ATOMIC_SEQ_CST)) {
+        net_wakeup();
+    }
+}
+
+// Add the published statistics of a worker to the totals and handle
+// the packets of its inbox, returns the number of packets
+static int worker_collect(struct worker *w)
+{
+    struct worker_stats stats;
+    struct worker_inbox *inbox;
+
+    pthread_mutex_lock(&w->lock);
+    inbox = w->inbox;
+    w->inbox = (inbox == &w->inboxes[0]) ? &w->inboxes[1] : &w->inboxes[0];
+    stats = w->published;
+    memset(&w->published, 0, sizeof(w->published));
+    pthread_mutex_unlock(&w->lock);
+
+    g_recv_calls += stats.recv_calls;
+    g_recv_packets += stats.recv_packets;
+    g_recv_dropped += stats.inbox_dropped;
+    g_send_calls += stats.send_calls;
+    g_send_packets += stats.send_packets;
+    g_send_dropped += stats.send_dropped;
+    record_traffic(stats.recv_bytes, stats.send_bytes);
+
+    int count = inbox->count;
+
+    for (int i = 0; i < count; i++) {
+        dht_handle_packet(inbox->socks[i], &inbox->bufs[i * DHT_PACKET_SIZE],
+            inbox->lens[i], &inbox->addrs[i], inbox->addrlens[i]);
+    }
+    inbox->count = 0;
+
+    return count;
+}
+
+// Called at the end of every event loop iteration, before the packets
+// of the event loop sockets are sent
+static void workers_flush_handler(void)
+{
+    int count = 0;
+
+    if (!__atomic_exchange_n(&g_workers_pending, false, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    for (int i = 0; i < g_workers_count; i++) {
+        count += worker_collect(&g_workers[i]);
+    }
+
+    if (count == 0) {
+        // Add the nodes handed over by dht_answer_flush()
+        dht_maintenance();
+    }
+}
+
+// Collect the statistics of the workers and add the nodes handed over
+// by dht_answer_flush() every second
+static void workers_collect_timer(void)
+{
+    int count = 0;
+
+    for (int i = 0; i < g_workers_count; i++) {
+        count += worker_collect(&g_workers[i]);
+    }
+
+    if (count == 0) {
+        dht_maintenance();
+    }
+
+    net_add_timer(time_add_ms(1000), &workers_collect_timer);
+}
+
+// Send the queued replies of a worker, return false if the socket is congested
+static bool worker_flush(struct send_queue *q)
+{
+    if (q == NULL || q->count == 0) {
+        return true;
+    }
+
+    return send_queue_flush(q);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = (struct worker*) arg;
+    // the shutdown pipe and two sockets per node id, poll() skips fd -1
+    struct pollfd fds[1 + 2 * DHT_NODE_IDS_MAX];
+    int count = 1 + 2 * g_dht_sockets_count;
+    cpu_set_t cpus;
+
+    t_worker = w;
+
+    // Stay on the CPU whose packets worker_steer() passes to us
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    fds[0].fd = g_workers_pipe[0];
+    fds[0].events = POLLIN;
+    for (int i = 0; i < g_dht_sockets_count; i++) {
+        fds[1 + 2 * i].fd = w->sockets[i].sock4;
+        fds[1 + 2 * i].events = POLLIN;
+        fds[2 + 2 * i].fd = w->sockets[i].sock6;
+        fds[2 + 2 * i].events = POLLIN;
+    }
+
+    while (true) {
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("KAD: Worker poll(): %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents) {
+            // Shutdown
+            break;
+        }
+
+        for (int i = 0; i < g_dht_sockets_count; i++) {
+            struct kad_socket *s = &w->sockets[i];
+            struct pollfd *fd4 = &fds[1 + 2 * i];
+            struct pollfd *fd6 = &fds[2 + 2 * i];
+
+            if (fd4->revents & POLLIN) {
+                worker_receive(w, s->sock4, g_dht_sockets[i].sock4);
+            }
+
+            if (fd6->revents & POLLIN) {
+                worker_receive(w, s->sock6, g_dht_sockets[i].sock6);
+            }
+
+            // Wait for a congested socket to become writable
+            fd4->events = POLLIN | (worker_flush(s->queue4) ? 0 : POLLOUT);
+            fd6->events = POLLIN | (worker_flush(s->queue6) ? 0 : POLLOUT);
+        }
+    }
+
+    return NULL;
+}
+
+// Pass a packet received on CPU c to worker c % count, which runs on
+// that CPU if there are as many workers as CPUs. The socket of the event
+// loop is the first of each SO_REUSEPORT group and gets no requests.
+static void worker_steer(int sock)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, g_workers_count),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 1),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    struct sock_fprog prog = {
+        .len = ARRAY_SIZE(code),
+        .filter = code
+    };
+
+    if (sock >= 0 && setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        log_warning("KAD: Cannot steer packets to the workers: %s", strerror(errno));
+    }
+#endif
+}
+
+// Create sockets and buffers of the workers
+static bool kad_setup_workers(int count)
+{
+    long cpus = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    g_workers = (struct worker*) calloc(count, sizeof(struct worker));
+    if (g_workers == NULL || pipe(g_workers_pipe) < 0) {
+        return false;
+    }
+
+    if (count > cpus) {
+        log_warning("KAD: %d workers but only %ld CPUs, %ld workers get no packets.", count, cpus, count - cpus);
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct worker *w = &g_workers[i];
+
+        // See worker_steer()
+        w->cpu = i % cpus;
+        w->inbox = &w->inboxes[0];
+        pthread_mutex_init(&w->lock, NULL);
+
+        for (int j = 0; j < g_dht_sockets_count; j++) {
+            const struct kad_socket *d = &g_dht_sockets[j];
+            struct kad_socket *s = &w->sockets[j];
+            int port = gconf->dht_port + j;
+
+            s->sock4 = (d->sock4 >= 0) ? net_bind("KAD", "0.0.0.0", port, gconf->dht_ifname, IPPROTO_UDP, true) : -1;
+            s->sock6 = (d->sock6 >= 0) ? net_bind("KAD", "::", port, gconf->dht_ifname, IPPROTO_UDP, true) : -1;
+
+            if ((d->sock4 >= 0 && s->sock4 < 0) || (d->sock6 >= 0 && s->sock6 < 0)) {
+                return false;
+            }
 
-// include dht.c instead of dht.h to access private vars
-#include "dht.c"
+            s->queue4 = (s->sock4 >= 0) ? kad_setup_send(s->sock4) : NULL;
+            s->queue6 = (s->sock6 >= 0) ? kad_setup_send(s->sock6) : NULL;
+
+            if ((s->sock4 >= 0 && s->queue4 == NULL) || (s->sock6 >= 0 && s->queue6 == NULL)) {
+                return false;
+            }
+        }
+
+        if (!recv_ring_setup(&w->recv, gconf->dht_recv_budget)) {
+            return false;
+        }
+
+        g_workers_count += 1;
+    }
+
+    for (int j = 0; j < g_dht_sockets_count; j++) {
+        worker_steer(g_dht_sockets[j].sock4);
+        worker_steer(g_dht_sockets[j].sock6);
+    }
+
+    return true;
+}
+
+// Called from the event loop once the setup is complete
+static void kad_start_workers(void)
+{
+    sigset_t all;
+    sigset_t old;
 
+    // Signals are handled by the event loop thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (int i = 0; i < g_workers_count; i++) {
+        if (pthread_create(&g_workers[i].thread, NULL, &worker_main, &g_workers[i]) != 0) {
+            log_error("KAD: Failed to start worker thread.");
+            exit(1);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    net_add_timer(time_add_ms(1000), &workers_collect_timer);
+
+    log_info("KAD: Started %d worker threads.", g_workers_count);
+}
+
+static void kad_free_workers(void)
+{
+    if (g_workers_count > 0 && write(g_workers_pipe[1], "", 1) < 0) {
+        log_error("KAD: Failed to stop worker threads.");
+    }
+
+    for (int i = 0; i < g_workers_count; i++) {
+        struct worker *w = &g_workers[i];
+
+        pthread_join(w->thread, NULL);
+        worker_publish(w);
+        worker_collect(w);
+        pthread_mutex_destroy(&w->lock);
+        for (int j = 0; j < g_dht_sockets_count; j++) {
+            close(w->sockets[j].sock4);
+            close(w->sockets[j].sock6);
+            free(w->sockets[j].queue4);
+            free(w->sockets[j].queue6);
+        }
+        recv_ring_free(&w->recv);
+    }
+
+    close(g_workers_pipe[0]);
+    close(g_workers_pipe[1]);
+
+    free(g_workers);
+    g_workers = NULL;
+    g_workers_count = 0;
+}
+#endif
 
 /*
-* The interface that is used to interact with the DHT.
+* Snapshot of the routing table (--table-file). All numbers are in network byte order.
+*
+* header: magic (8), export time in seconds (4), node id (20)
+* per family: address length (1), number of buckets (4)
+*  per bucket: first id (20), maximum number of nodes (2), number of nodes (2)
+*   per node: id (20), address (4 or 16), port (2), seconds since the last reply (4)
+* end: zero (1)
 */
 
-// Next time to do DHT maintenance
-static time_t g_dht_maintenance = 0;
-static int g_dht_socket4 = -1;
-static int g_dht_socket6 = -1;
+#define TABLE_MAGIC "DHTDTBL1"
+#define TABLE_NO_REPLY UINT32_MAX
 
-// This callback is called when a search result arrives or a search completes
-void dht_callback_func(void *closure, int event, const uint8_t *info_hash, const void *data, size_t data_len)
+// Ping the restored nodes of one bucket per family and tick
+#define TABLE_REVALIDATE_MS 100
+
+static int g_revalidate_index = 0;
+
+static bool table_write(FILE *fp, const void *data, size_t len)
 {
-    switch (event) {
-        case DHT_EVENT_VALUES:
-            results_add(info_hash, AF_INET, data, data_len);
-            break;
-        case DHT_EVENT_VALUES6:
-            results_add(info_hash, AF_INET6, data, data_len);
-            break;
-        case DHT_EVENT_SEARCH_DONE:
-        case DHT_EVENT_SEARCH_DONE6:
-            break;
-        case DHT_EVENT_SEARCH_EXPIRED:
-            results_clear(info_hash);
-            break;
-    }
+    return fwrite(data, 1, len, fp) == len;
 }
 
-static void clear_old_traffic_counters(void)
+static bool table_read(FILE *fp, void *data, size_t len)
 {
-    size_t idx = gconf->time_now % TRAFFIC_DURATION_SECONDS;
-    uint32_t since = (gconf->time_now - gconf->traffic_time);
-    size_t n = MIN(since, TRAFFIC_DURATION_SECONDS);
+    return fread(data, 1, len, fp) == len;
+}
 
-    // clear old traffic measurement buckets
-    for (size_t i = 0; i < n; ++i) {
-        size_t j = (TRAFFIC_DURATION_SECONDS + idx + i + 1) % TRAFFIC_DURATION_SECONDS;
-        gconf->traffic_in[j] = 0;
-        gconf->traffic_out[j] = 0;
+static bool kad_write_table_family(FILE *fp, int af)
+{
+    struct bucket_table *t = bucket_table(af);
+    uint8_t addr_len = (af == AF_INET) ? 4 : 16;
+    uint32_t bucket_count = htonl(t->count);
+
+    // Family not in use
+    if (t->count == 0) {
+        return true;
+    }
+
+    if (!table_write(fp, &addr_len, 1) || !table_write(fp, &bucket_count, 4)) {
+        return false;
+    }
+
+    for (int i = 0; i < t->count; i++) {
+        const struct bucket *b = t->list[i];
+        uint16_t max_count = htons(b->max_count);
+        uint16_t node_count = htons(b->count);
+
+        if (!table_write(fp, b->first, 20)
+                || !table_write(fp, &max_count, 2)
+                || !table_write(fp, &node_count, 2)) {
+            return false;
+        }
+
+        for (const struct node *n = b->nodes; n; n = n->next) {
+            uint32_t age = htonl((n->reply_time > 0) ? (now - n->reply_time) / 1000 : TABLE_NO_REPLY);
+
+            if (!table_write(fp, n->id, 20)
+                    || !table_write(fp, n->addr.ip, addr_len)
+                    || !table_write(fp, &n->addr.port, 2)
+                    || !table_write(fp, &age, 4)) {
+                return false;
+            }
+        }
     }
+
+    return true;
 }
 
-static void record_traffic(uint32_t in_bytes, uint32_t out_bytes)
+static void kad_write_table(void)
 {
-    clear_old_traffic_counters();
+    const char *path = gconf->table_file;
+    char tmp_path[PATH_MAX];
+    uint32_t time_now = htonl(time_now_sec());
+    uint8_t end = 0;
 
-    gconf->traffic_in_sum += in_bytes;
-    gconf->traffic_out_sum += out_bytes;
+    int nodes = bucket_table(AF_INET)->nodes + bucket_table(AF_INET6)->nodes;
 
-    size_t idx = gconf->time_now % TRAFFIC_DURATION_SECONDS;
-    gconf->traffic_time = gconf->time_now;
-    gconf->traffic_in[idx] += out_bytes;
-    gconf->traffic_out[idx] += in_bytes;
+    if (path == NULL || nodes == 0) {
+        return;
+    }
+
+    // Replace the old snapshot only after it was written completely
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        log_warning("KAD: Cannot open file '%s' for table export: %s", tmp_path, strerror(errno));
+        return;
+    }
+
+    now = dht_time_ms();
+
+    bool ok = table_write(fp, TABLE_MAGIC, 8)
+        && table_write(fp, &time_now, 4)
+        && table_write(fp, self->myid, 20)
+        && kad_write_table_family(fp, AF_INET)
+        && kad_write_table_family(fp, AF_INET6)
+        && table_write(fp, &end, 1);
+
+    if (fclose(fp) != 0 || !ok) {
+        log_warning("KAD: Failed to write table to '%s'", tmp_path);
+        unlink(tmp_path);
+        return;
+    }
+
+    if (rename(tmp_path, path) != 0) {
+        log_warning("KAD: Cannot rename '%s' to '%s': %s", tmp_path, path, strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+
+    log_info("KAD: Exported %d nodes to %s", nodes, path);
 }
 
-// Handle incoming packets and pass them to the DHT code
-void dht_handler(int rc, int sock)
+// Open the snapshot and read the node id and export time
+static FILE *kad_open_table(uint8_t node_id[], time_t *time_return)
 {
-    uint8_t buf[1500];
-    ssize_t buflen = 0;
-    IP from;
+    const char *path = gconf->table_file;
+    char magic[8];
+    uint32_t time_saved;
 
-    if (rc > 0) {
-        // Check which socket received the data
-        socklen_t fromlen = sizeof(from);
-        buflen = recvfrom(sock, buf, sizeof(buf) - 1, 0, (struct sockaddr*) &from, &fromlen);
+    if (path == NULL) {
+        return NULL;
+    }
 
-        if (buflen <= 0 || buflen >= sizeof(buf)) {
-            return;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            log_warning("KAD: Cannot open file '%s' for table import: %s", path, strerror(errno));
         }
+        return NULL;
+    }
 
-        record_traffic(buflen, 0);
+    if (!table_read(fp, magic, 8) || memcmp(magic, TABLE_MAGIC, 8) != 0
+            || !table_read(fp, &time_saved, 4)
+            || !table_read(fp, node_id, SHA1_BIN_LENGTH)) {
+        log_warning("KAD: Invalid table file: %s", path);
+        fclose(fp);
+        return NULL;
+    }
 
-        // The DHT code expects the message to be null-terminated.
-        buf[buflen] = '\0';
+    *time_return = ntohl(time_saved);
+
+    return fp;
+}
+
+// Restore the buckets and nodes of one family, return -1 on error
+static int kad_read_table_family(FILE *fp, int af, uint32_t downtime)
+{
+    struct bucket_table *t = bucket_table(af);
+    size_t addr_len = (af == AF_INET) ? 4 : 16;
+    uint32_t bucket_count;
+    int nodes = 0;
+
+    if (!table_read(fp, &bucket_count, 4)) {
+        return -1;
     }
+    bucket_count = ntohl(bucket_count);
+
+    // Restore the bucket layout into a fresh table only
+    bool layout = (t->count == 1 && t->list[0]->count == 0);
 
-    if (buflen > 0) {
-        // Handle incoming data
-        time_t time_wait = 0;
-        socklen_t fromlen = sizeof(from);
-        rc = dht_periodic(buf, buflen, (struct sockaddr*) &from, fromlen, &time_wait, dht_callback_func, NULL);
+    for (uint32_t i = 0; i < bucket_count; i++) {
+        uint8_t first[20];
+        uint16_t max_count;
+        uint16_t node_count;
 
-        if (rc < 0 && errno != EINTR) {
-            if (rc == EINVAL || rc == EFAULT) {
-                log_error("KAD: Error calling dht_periodic");
-                exit(1);
+        if (!table_read(fp, first, 20)
+                || !table_read(fp, &max_count, 2)
+                || !table_read(fp, &node_count, 2)) {
+            return -1;
+        }
+        max_count = MAX(ntohs(max_count), bucket_size);
+        node_count = ntohs(node_count);
+
+        if (layout && i == 0) {
+            // The first bucket starts at zero
+            layout = (id_cmp(first, zeroes) == 0);
+            if (layout) {
+                t->list[0]->max_count = max_count;
+            }
+        } else if (layout) {
+            layout = (id_cmp(t->list[t->count - 1]->first, first) < 0);
+            if (layout) {
+                struct bucket *b = calloc(1, sizeof(struct bucket));
+                if (b == NULL) {
+                    return -1;
+                }
+                b->af = af;
+                memcpy(b->first, first, 20);
+                b->max_count = max_count;
+                b->time = now;
+                if (insert_bucket(b, t->count) < 0) {
+                    free(b);
+                    return -1;
+                }
             }
-            g_dht_maintenance = time_now_sec() + 1;
-        } else {
-            g_dht_maintenance = time_now_sec() + time_wait;
         }
-    } else if (g_dht_maintenance <= time_now_sec()) {
-        // Do a maintenance call
-        time_t time_wait = 0;
-        rc = dht_periodic(NULL, 0, NULL, 0, &time_wait, dht_callback_func, NULL);
 
-        // Wait for the next maintenance call
-        g_dht_maintenance = time_now_sec() + time_wait;
-        //log_debug("KAD: Next maintenance call in %u seconds.", (unsigned) time_wait);
-    } else {
-        rc = 0;
-    }
+        for (uint16_t j = 0; j < node_count; j++) {
+            struct node_addr addr = { .family = af };
+            uint8_t id[20];
+            uint32_t age;
+            IP sa;
+
+            if (!table_read(fp, id, 20)
+                    || !table_read(fp, addr.ip, addr_len)
+                    || !table_read(fp, &addr.port, 2)
+                    || !table_read(fp, &age, 4)) {
+                return -1;
+            }
+            age = ntohl(age);
 
-    if (rc < 0) {
-        if (errno == EINTR) {
-            return;
-        } else if (rc == EINVAL || rc == EFAULT) {
-            log_error("KAD: Error using select: %s", strerror(errno));
-            return;
-        } else {
-            g_dht_maintenance = time_now_sec() + 1;
+            int sa_len = node_sockaddr(&addr, (struct sockaddr*) &sa);
+            struct node *n = new_node(id, (struct sockaddr*) &sa, sa_len, 0);
+            if (n == NULL) {
+                continue;
+            }
+
+            // The node is not good until it replies to a ping again
+            if (age != TABLE_NO_REPLY) {
+                n->reply_time = now - ((int64_t) age + downtime) * 1000;
+            }
+            nodes += 1;
         }
     }
-}
 
-/*
-* Kademlia needs dht_blacklisted/dht_hash/dht_random_bytes functions to be present.
-*/
+    return nodes;
+}
 
-int dht_sendto(int sockfd, const void *buf, int buflen, int flags, const struct sockaddr *to, int tolen)
+// Ping restored nodes that were not heard from since the start
+static bool kad_revalidate_bucket(int af, int index)
 {
-    record_traffic(0, buflen);
+    struct bucket_table *t = bucket_table(af);
+
+    if (index >= t->count) {
+        return false;
+    }
+
+    struct bucket *b = t->list[index];
+    for (struct node *n = b->nodes; n; n = n->next) {
+        if (n->time == 0 && n->pinged == 0) {
+            IP addr;
+            int addr_len = node_sockaddr(&n->addr, (struct sockaddr*) &addr);
+            dht_ping_node((struct sockaddr*) &addr, addr_len);
+            pinged(n, b);
+        }
+    }
 
-    return sendto(sockfd, buf, buflen, flags, to, tolen);
+    return true;
 }
 
-int dht_blacklisted(const struct sockaddr *sa, int salen)
+static void kad_revalidate_table(void)
 {
-    return 0;
+    bool more = false;
+
+    now = dht_time_ms();
+
+    more |= kad_revalidate_bucket(AF_INET, g_revalidate_index);
+    more |= kad_revalidate_bucket(AF_INET6, g_revalidate_index);
+    g_revalidate_index += 1;
+
+    if (more) {
+        net_add_timer(time_add_ms(TABLE_REVALIDATE_MS), &kad_revalidate_table);
+    }
 }
 
-// Hashing for the DHT - implementation does not matter for interoperability
-void dht_hash(void *hash_return, int hash_size,
-        const void *v1, int len1,
-        const void *v2, int len2,
-        const void *v3, int len3)
+// Restore the routing table of the node id from the snapshot
+static void kad_import_table(void)
 {
-    union {
-        uint8_t data[8];
-        uint16_t num4[4];
-        uint32_t num2[2];
-        uint64_t num1[1];
-    } hash;
+    uint8_t node_id[SHA1_BIN_LENGTH];
+    time_t time_saved;
+    int nodes = 0;
+    uint8_t addr_len;
 
-    assert(len1 == 8);
-    memcpy(&hash.data, v1, 8);
+    FILE *fp = kad_open_table(node_id, &time_saved);
+    if (fp == NULL) {
+        return;
+    }
 
-    assert(len2 == 4 || len2 == 16);
-    if (len2 == 4) {
-        const uint32_t d2 = *((uint32_t*) v2);
-        hash.num2[0] ^= d2;
-        hash.num2[1] ^= d2;
-    } else {
-        hash.num1[0] ^= *((uint64_t*) v2);
-        hash.num1[0] ^= *((uint64_t*) v2 + 8);
+    // The bucket layout depends on the node id
+    if (id_cmp(node_id, ids[0]->myid) != 0) {
+        fclose(fp);
+        return;
     }
 
-    assert(len3 == 2);
-    const uint16_t d3 = *((uint16_t*) v3);
-    hash.num4[0] ^= d3;
-    hash.num4[1] ^= d3;
-    hash.num4[2] ^= d3;
-    hash.num4[3] ^= d3;
+    uint32_t downtime = MAX(time_now_sec() - time_saved, 0);
 
-    assert(hash_size == 8);
-    memcpy(hash_return, &hash.data, 8);
+    now = dht_time_ms();
+
+    while (table_read(fp, &addr_len, 1) && addr_len != 0) {
+        int rc = -1;
+
+        if (addr_len == 4) {
+            rc = kad_read_table_family(fp, AF_INET, downtime);
+        } else if (addr_len == 16) {
+            rc = kad_read_table_family(fp, AF_INET6, downtime);
+        }
+
+        if (rc < 0) {
+            log_warning("KAD: Invalid table file: %s", gconf->table_file);
+            break;
+        }
+        nodes += rc;
+    }
+
+    fclose(fp);
+
+    log_info("KAD: Restored %d nodes from %s", nodes, gconf->table_file);
+
+    if (nodes > 0) {
+        net_add_timer(time_now_ms(), &kad_revalidate_table);
+    }
 }
 
-int dht_random_bytes(void *buf, size_t size)
+static void kad_handle_table_export(void)
 {
-    return bytes_random(buf, size);
+    kad_write_table();
+
+    // Export again in ~1 hour
+    net_add_timer(time_add_hours(1), &kad_handle_table_export);
+}
+
+void kad_export_table(void)
+{
+    // Worker threads might still be running
+    net_lock();
+    kad_write_table();
+    net_unlock();
 }
 
 bool kad_setup(void)
 {
     uint8_t node_id[SHA1_BIN_LENGTH];
+    time_t table_time;
     int af = gconf->af;
 
 #ifdef DEBUG
@@ -204,57 +1537,160 @@ bool kad_setup(void)
     dht_debug = stdout;
 #endif
 
-    bytes_random(node_id, SHA1_BIN_LENGTH);
+    // Keep the node id of the table snapshot
+    FILE *table = kad_open_table(node_id, &table_time);
+    if (table) {
+        fclose(table);
+    } else {
+        bytes_random(node_id, SHA1_BIN_LENGTH);
+    }
+
+    pool_init(&g_node_pool, "nodes", sizeof(struct node), 64, DHT_PREALLOC_NODES);
+    pool_init(&g_search_pool, "searches", sizeof(struct search), 8, DHT_PREALLOC_SEARCHES);
+
+    if (!recv_ring_setup(&g_recv, gconf->dht_recv_budget)) {
+        log_error("KAD: Failed to allocate receive buffers.");
+        return false;
+    }
+
+#ifdef WORKERS
+    // All sockets of the workers share the port
+    bool reuseport = (gconf->dht_workers > 0);
+#else
+    bool reuseport = false;
+#endif
 
-    if (af == AF_INET || af == AF_UNSPEC) {
-        g_dht_socket4 = net_bind("KAD", "0.0.0.0", gconf->dht_port, gconf->dht_ifname, IPPROTO_UDP);
+    // Every node id has its own port, replies then always carry the id
+    // that other nodes know for that address
+    int last_port = gconf->dht_port + gconf->dht_node_ids - 1;
+    if (last_port > 65535) {
+        log_error("KAD: Ports %d-%d for %d node ids are out of range.",
+            gconf->dht_port, last_port, gconf->dht_node_ids);
+        return false;
     }
 
-    if (af == AF_INET6 || af == AF_UNSPEC) {
-        g_dht_socket6 = net_bind("KAD", "::", gconf->dht_port, gconf->dht_ifname, IPPROTO_UDP);
+#ifdef WORKERS
+    if (gconf->dht_workers > 0) {
+        // Handle the packets of the workers before sending
+        net_add_flush_handler(&workers_flush_handler);
     }
+#endif
+    net_add_flush_handler(&dht_flush_handler);
+
+    for (int i = 0; i < gconf->dht_node_ids; i++) {
+        struct kad_socket *s = &g_dht_sockets[i];
+        int port = gconf->dht_port + i;
+
+        s->sock4 = -1;
+        s->sock6 = -1;
+
+        if (af == AF_INET || af == AF_UNSPEC) {
+            s->sock4 = net_bind("KAD", "0.0.0.0", port, gconf->dht_ifname, IPPROTO_UDP, reuseport);
+        }
+
+        if (af == AF_INET6 || af == AF_UNSPEC) {
+            s->sock6 = net_bind("KAD", "::", port, gconf->dht_ifname, IPPROTO_UDP, reuseport);
+        }
+
+        if (s->sock4 >= 0) {
+            kad_add_socket(s->sock4, &s->queue4);
+        }
+
+        if (s->sock6 >= 0) {
+            kad_add_socket(s->sock6, &s->queue6);
+        }
+
+        g_dht_sockets_count += 1;
 
-    if (g_dht_socket4 >= 0) {
-        net_add_handler(g_dht_socket4, &dht_handler);
+        if (s->sock4 < 0 && s->sock6 < 0) {
+            return false;
+        }
     }
 
-    if (g_dht_socket6 >= 0) {
-        net_add_handler(g_dht_socket6, &dht_handler);
+    if (dht_set_buckets(gconf->dht_bucket_size, gconf->dht_split_depth) < 0) {
+        log_error("KAD: Invalid routing table size.");
+        return false;
     }
 
-    if (g_dht_socket4 < 0 && g_dht_socket6 < 0) {
+    if (dht_set_rate(gconf->dht_request_rate) < 0) {
+        log_error("KAD: Invalid request rate.");
         return false;
     }
 
     // Init the DHT.  Also set the sockets into non-blocking mode.
-    if (dht_init(g_dht_socket4, g_dht_socket6, node_id, (uint8_t*) "DD\0\0") < 0) {
+    if (dht_init(g_dht_sockets[0].sock4, g_dht_sockets[0].sock6, node_id, (uint8_t*) "DD\0\0") < 0) {
         log_error("KAD: Failed to initialize the DHT.");
         return false;
     }
 
+    // Additional node ids get their own sockets and routing table
+    for (int i = 1; i < g_dht_sockets_count; i++) {
+        bytes_random(node_id, SHA1_BIN_LENGTH);
+        if (dht_add_id(g_dht_sockets[i].sock4, g_dht_sockets[i].sock6, node_id) < 0) {
+            log_error("KAD: Failed to add node id %s.", str_id(node_id));
+            return false;
+        }
+    }
+
+    if (gconf->table_file) {
+        kad_import_table();
+        net_add_timer(time_add_hours(1), &kad_handle_table_export);
+    }
+
+    // First maintenance call right away
+    dht_schedule_maintenance(0);
+
+#ifdef WORKERS
+    if (gconf->dht_workers > 0) {
+        if (!kad_setup_workers(gconf->dht_workers)) {
+            log_error("KAD: Failed to setup worker threads.");
+            return false;
+        }
+        net_add_timer(time_now_ms(), &kad_start_workers);
+    }
+#endif
+
     return true;
 }
 
 void kad_free(void)
 {
+#ifdef WORKERS
+    kad_free_workers();
+#endif
+
+    // Send remaining packets
+    dht_flush_handler();
+#ifdef URING
+    uring_submit();
+#endif
+
     dht_uninit();
+
+    pool_destroy(&g_node_pool);
+    pool_destroy(&g_search_pool);
+
+    for (int i = 0; i < g_dht_sockets_count; i++) {
+        free(g_dht_sockets[i].queue4);
+        free(g_dht_sockets[i].queue6);
+    }
+
+    recv_ring_free(&g_recv);
+}
+
+// The counts are kept up to date by dht.c
+static unsigned kad_count_bucket(int af, bool good)
+{
+    return good ? count_good(af) : bucket_table(af)->nodes;
 }
 
-static unsigned kad_count_bucket(const struct bucket *bucket, bool good)
+// Nodes in the routing tables of the additional node ids
+static unsigned kad_count_extra_nodes(void)
 {
     unsigned count = 0;
 
-    while (bucket) {
-        if (good) {
-            struct node *node = bucket->nodes;
-            while (node) {
-                count += node_good(node) ? 1 : 0;
-                node = node->next;
-            }
-        } else {
-            count += bucket->count;
-        }
-        bucket = bucket->next;
+    for (int i = 1; i < numids; i++) {
+        count += ids[i]->buckets.nodes + ids[i]->buckets6.nodes;
     }
 
     return count;
@@ -263,57 +1699,21 @@ static unsigned kad_count_bucket(const struct bucket *bucket, bool good)
 int kad_count_nodes(bool good)
 {
     // count nodes in IPv4 and IPv6 buckets
-    return kad_count_bucket(buckets, good) + kad_count_bucket(buckets6, good);
+    return kad_count_bucket(AF_INET, good) + kad_count_bucket(AF_INET6, good);
 }
 
 void kad_status(FILE *fp)
 {
-    struct storage *strg = storage;
-    struct search *srch = searches;
-    struct announcement_t *announcement = announces_get();
-    int numsearches4_active = 0;
-    int numsearches4_done = 0;
-    int numsearches6_active = 0;
-    int numsearches6_done = 0;
-    int numstorage = 0;
-    int numstorage_peers = 0;
-    int numannounces = 0;
-
-    // Count searches
-    while (srch) {
-        if (srch->af == AF_INET6) {
-            if (srch->done) {
-                numsearches6_done += 1;
-            } else {
-                numsearches6_active += 1;
-            }
-        } else {
-            if (srch->done) {
-                numsearches4_done += 1;
-            } else {
-                numsearches4_active += 1;
-            }
-        }
-        srch = srch->next;
-    }
-
-    // Count storage and peers
-    while (strg) {
-        numstorage_peers += strg->numpeers;
-        numstorage += 1;
-        strg = strg->next;
-    }
-
-    while (announcement) {
-        numannounces += 1;
-        announcement = announcement->next;
-    }
+    int numsearches4_active = numsearches_state[0][0];
+    int numsearches4_done = numsearches_state[0][1];
+    int numsearches6_active = numsearches_state[1][0];
+    int numsearches6_done = numsearches_state[1][1];
 
     // Use dht data structure!
-    int nodes4 = kad_count_bucket(buckets, false);
-    int nodes6 = kad_count_bucket(buckets6, false);
-    int nodes4_good = kad_count_bucket(buckets, true);
-    int nodes6_good = kad_count_bucket(buckets6, true);
+    int nodes4 = kad_count_bucket(AF_INET, false);
+    int nodes6 = kad_count_bucket(AF_INET6, false);
+    int nodes4_good = kad_count_bucket(AF_INET, true);
+    int nodes6_good = kad_count_bucket(AF_INET6, true);
 
     clear_old_traffic_counters();
     uint32_t traffic_sum_in = 0;
@@ -323,32 +1723,61 @@ void kad_status(FILE *fp)
         traffic_sum_out += gconf->traffic_out[i];
     }
 
+    char ports[16];
+    if (g_dht_sockets_count > 1) {
+        snprintf(ports, sizeof(ports), "%d-%d", gconf->dht_port, gconf->dht_port + g_dht_sockets_count - 1);
+    } else {
+        snprintf(ports, sizeof(ports), "%d", gconf->dht_port);
+    }
+
+    uint64_t recv_calls = g_recv_calls;
+    uint64_t send_calls = g_send_calls;
+#ifdef URING
+    // io_uring receives and sends with the same syscall
+    recv_calls += uring_enter_count();
+    send_calls += uring_enter_count();
+#endif
+
     fprintf(
         fp,
         "%s\n"
         "DHT id: %s\n"
+        "DHT node ids: %d (%u nodes in additional tables)\n"
         "DHT uptime: %s\n"
-        "DHT listen on: %s / device: %s / port: %d\n"
+        "DHT listen on: %s / device: %s / port: %s\n"
         "DHT nodes: %d IPv4 (%d good), %d IPv6 (%d good)\n"
+        "DHT replacement cache: %d IPv4, %d IPv6 (%lu promoted, %lu pinged)\n"
         "DHT storage: %d entries with %d addresses\n"
         "DHT searches: %d IPv4 (%d done), %d IPv6 active (%d done)\n"
         "DHT announcements: %d\n"
         "DHT blocklist: %d\n"
-        "DHT traffic: %s, %s/s (in) / %s, %s/s (out)\n",
+        "DHT traffic: %s, %s/s (in) / %s, %s/s (out)\n"
+        "DHT receive: %.2f packets per call (budget %d, %llu dropped)\n"
+        "DHT send: %.2f packets per call (%llu dropped)\n",
         dhtd_version_str,
-        str_id(myid),
+        str_id(self->myid),
+        numids, kad_count_extra_nodes(),
         str_time(gconf->time_now - gconf->startup_time),
-        str_af(gconf->af), gconf->dht_ifname ? gconf->dht_ifname : "<any>", gconf->dht_port,
+        str_af(gconf->af), gconf->dht_ifname ? gconf->dht_ifname : "<any>", ports,
         nodes4, nodes4_good, nodes6, nodes6_good,
+        bucket_table(AF_INET)->cached, bucket_table(AF_INET6)->cached,
+        cache_promoted, cache_pinged,
         numstorage, numstorage_peers,
         numsearches4_active, numsearches4_done, numsearches6_active, numsearches6_done,
-        numannounces,
+        announces_count(),
         (next_blacklisted % DHT_MAX_BLACKLISTED),
         str_bytes(gconf->traffic_in_sum),
         str_bytes(traffic_sum_in / TRAFFIC_DURATION_SECONDS),
         str_bytes(gconf->traffic_out_sum),
-        str_bytes(traffic_sum_out / TRAFFIC_DURATION_SECONDS)
+        str_bytes(traffic_sum_out / TRAFFIC_DURATION_SECONDS),
+        recv_calls ? ((double) g_recv_packets / recv_calls) : 0.0, gconf->dht_recv_budget,
+        (unsigned long long) g_recv_dropped,
+        send_calls ? ((double) g_send_packets / send_calls) : 0.0, (unsigned long long) g_send_dropped
     );
+
+    fprintf(fp, "DHT pools: ");
+    pool_print_all(fp);
+    fprintf(fp, "\n");
 }
 
 bool kad_ping(const IP* addr)
@@ -385,6 +1814,14 @@ bool kad_start_search(FILE *fp, const uint8_t id[], uint16_t port)
     return false;
 }
 
+bool kad_search_running(const uint8_t id[])
+{
+    struct search *sr4 = find_search_id(id, AF_INET);
+    struct search *sr6 = find_search_id(id, AF_INET6);
+
+    return (sr4 && !sr4->done) || (sr6 && !sr6->done);
+}
+
 bool kad_block(const IP* addr)
 {
     blacklist_node(NULL, (struct sockaddr *) addr, sizeof(IP));
@@ -396,8 +1833,8 @@ bool kad_block(const IP* addr)
 int kad_export_peers(FILE *fp)
 {
     // get number of good nodes
-    int num4 = kad_count_bucket(buckets, true);
-    int num6 = kad_count_bucket(buckets6, true);
+    int num4 = kad_count_bucket(AF_INET, true);
+    int num6 = kad_count_bucket(AF_INET6, true);
 
     IP4 *addr4 = (IP4*) malloc(num4 * sizeof(IP4));
     IP6 *addr6 = (IP6*) malloc(num6 * sizeof(IP6));
@@ -439,8 +1876,9 @@ int kad_export_peers(FILE *fp)
     return num4 + num6;
 }
 
-static void kad_print_buckets_interal(FILE* fp, int af, const struct bucket *b)
+static void kad_print_buckets_interal(FILE* fp, int af)
 {
+    struct bucket *b = first_bucket(af);
     unsigned bucket_i, node_i, all_nodes = 0;
 
     for (bucket_i = 0; b; ++bucket_i) {
@@ -448,14 +1886,19 @@ static void kad_print_buckets_interal(FILE* fp, int af, const struct bucket *b)
 
         struct node *n = b->nodes;
         for (node_i = 0; n; ++node_i) {
+            IP addr;
+            node_sockaddr(&n->addr, (struct sockaddr*) &addr);
             fprintf(fp, "   id: %s\n", str_id(n->id));
-            fprintf(fp, "	 address: %s\n", str_addr(&n->ss));
+            fprintf(fp, "	 address: %s\n", str_addr(&addr));
             fprintf(fp, "	 pinged: %d\n", n->pinged);
+            if (n->srtt) {
+                fprintf(fp, "	 rtt: %d ms (+/- %d ms)\n", n->srtt, n->rttvar);
+            }
             n = n->next;
         }
         fprintf(fp, "  %u nodes.\n", node_i);
         all_nodes += node_i;
-        b = b->next;
+        b = next_bucket(b);
     }
 
     fprintf(fp, "Found %u %s buckets with %u nodes.\n", bucket_i, (af == AF_INET) ? "IPv4" : "IPv6", all_nodes);
@@ -467,11 +1910,11 @@ void kad_print_buckets(FILE* fp)
     int af = gconf->af;
 
     if (af == AF_UNSPEC || af == AF_INET) {
-        kad_print_buckets_interal(fp, AF_INET, buckets);
+        kad_print_buckets_interal(fp, AF_INET);
     }
 
     if (af == AF_UNSPEC || af == AF_INET6) {
-        kad_print_buckets_interal(fp, AF_INET6, buckets6);
+        kad_print_buckets_interal(fp, AF_INET6);
     }
 }
 
@@ -493,8 +1936,10 @@ void kad_print_searches(FILE *fp)
         if (do_print_nodes) {
             for (j = 0; j < s->numnodes; ++j) {
                 struct search_node *sn = &s->nodes[j];
+                IP addr;
+                node_sockaddr(&sn->addr, (struct sockaddr*) &addr);
                 fprintf(fp, "   node: %s\n", str_id(sn->id));
-                fprintf(fp, "	 address: %s\n", str_addr(&sn->ss));
+                fprintf(fp, "	 address: %s\n", str_addr(&addr));
                 fprintf(fp, "	 pinged: %d, pinged: %d, acked: %d\n",
                     sn->pinged, sn->replied, sn->acked);
             }
@@ -17,9 +17,15 @@ bool kad_block(const IP* addr);
 
 bool kad_start_search(FILE *fp, const uint8_t id[], uint16_t port);
 
+// Check if a search for this id is still in progress
+bool kad_search_running(const uint8_t id[]);
+
 // Export good peers
 int kad_export_peers(FILE *fp);
 
+// Save the routing table to the --table-file
+void kad_export_table(void);
+
 // Print status information
 void kad_status(FILE *fp);
 
@@ -14,6 +14,7 @@
 #include "utils.h"
 #include "unix.h"
 #include "net.h"
+#include "results.h"
 #include "announces.h"
 #include "peerfile.h"
 #ifdef __CYGWIN__
@@ -40,6 +41,9 @@ int main_run(void)
     // Setup the Kademlia DHT
     rc &= kad_setup();
 
+    // Setup storage of search results
+    results_setup();
+
     // Setup handler for announcements
     announces_setup();
 
@@ -65,6 +69,9 @@ int main_run(void)
     // Export peers if a file is provided
     peerfile_export();
 
+    // Save the routing table for the next start
+    kad_export_table();
+
     /* Free resources */
 
 #ifdef CLI
@@ -78,6 +85,8 @@ int main_run(void)
 
     announces_free();
 
+    results_free();
+
     kad_free();
 
     conf_free();
@@ -1,8 +1,11 @@
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <netdb.h>
 #include <unistd.h> // close()
 #include <net/if.h>
@@ -12,20 +15,99 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include <fcntl.h>
+#ifdef WORKERS
+#include <pthread.h>
+#endif
 
 #include "main.h"
 #include "conf.h"
 #include "log.h"
 #include "utils.h"
 #include "net.h"
+#ifdef URING
+#include "uring.h"
+#endif
+
+
+// Use epoll on Linux, poll() everywhere else
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#endif
+
+#if defined(URING) && !defined(USE_EPOLL)
+#error "io_uring support requires epoll"
+#endif
 
+struct handler {
+    int fd;
+    int events;
+    net_callback *cb;
+#ifdef USE_EPOLL
+    // false if epoll cannot watch the fd, e.g. a regular file
+    bool polled;
+#endif
+};
 
-static struct pollfd g_fds[16] = { 0 };
-static net_callback* g_cbs[16] = { NULL };
-static int g_count = 0;
+// Growable handler table, entries are removed lazily
+static struct handler **g_handlers = NULL;
+static size_t g_handlers_count = 0;
+static size_t g_handlers_capacity = 0;
 static bool g_entry_removed = false;
 
+// Called at the end of every loop iteration
+static net_flush_callback **g_flush_cbs = NULL;
+static size_t g_flush_cbs_count = 0;
+
+struct timer {
+    int64_t deadline;
+    // order of timers with the same deadline
+    uint64_t seq;
+    // entry in g_timer_slots
+    size_t slot;
+};
+
+// Binary min-heap of pending timers, ordered by deadline
+static struct timer *g_timers = NULL;
+static size_t g_timers_count = 0;
+static size_t g_timers_capacity = 0;
+static uint64_t g_timers_seq = 0;
+
+// The heap index of every callback, -1 if it is not pending.
+// A hash table with linear probing. Slots are never removed,
+// the same few callbacks are scheduled over and over again.
+struct timer_slot {
+    net_timer_callback *cb;
+    ssize_t index;
+};
+
+static struct timer_slot *g_timer_slots = NULL;
+static size_t g_timer_slots_count = 0;
+static size_t g_timer_slots_size = 0; // power of two
+
+#ifdef WORKERS
+// Writers are preferred, readers cannot starve the event loop
+static pthread_rwlock_t g_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static pthread_t g_loop_thread;
+// Written to by other threads to interrupt the wait of the event loop
+static int g_wakeup_pipe[2] = { -1, -1 };
+#endif
+
+#ifdef USE_EPOLL
+static int g_epoll_fd = -1;
+static struct epoll_event g_events[64];
+// Handlers that are called on every loop iteration
+static size_t g_unpolled_count = 0;
+#else
+// Rebuilt from the handler table when it changes
+static struct pollfd *g_fds = NULL;
+static size_t g_fds_capacity = 0;
+static bool g_fds_changed = true;
+#endif
+
 
 // Set a socket non-blocking
 int net_set_nonblocking(int fd)
@@ -40,20 +122,63 @@ void net_add_handler(int fd, net_callback *cb)
         exit(1);
     }
 
-    if (g_count == ARRAY_SIZE(g_cbs)) {
-        log_error("net_add_handler() No more space for handlers.");
+    if (fd < 0) {
+        log_error("net_add_handler() Invalid file descriptor, use net_add_timer().");
+        exit(1);
+    }
+
+    if (g_handlers_count == g_handlers_capacity) {
+        size_t capacity = g_handlers_capacity ? (2 * g_handlers_capacity) : 16;
+        struct handler **handlers = realloc(g_handlers, capacity * sizeof(struct handler*));
+        if (handlers == NULL) {
+            log_error("net_add_handler() Cannot allocate handler table.");
+            exit(1);
+        }
+        g_handlers = handlers;
+        g_handlers_capacity = capacity;
+    }
+
+    struct handler *handler = (struct handler*) calloc(1, sizeof(struct handler));
+    if (handler == NULL) {
+        log_error("net_add_handler() Cannot allocate handler.");
         exit(1);
     }
 
-    if (fd >= 0) {
-        net_set_nonblocking(fd);
+    handler->fd = fd;
+    handler->events = POLLIN;
+    handler->cb = cb;
+
+    net_set_nonblocking(fd);
+
+#ifdef USE_EPOLL
+    if (g_epoll_fd < 0) {
+        g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (g_epoll_fd < 0) {
+            log_error("epoll_create1(): %s", strerror(errno));
+            exit(1);
+        }
     }
 
-    g_cbs[g_count] = cb;
-    g_fds[g_count].fd = fd;
-    g_fds[g_count].events = POLLIN;
+    struct epoll_event ev = {
+        .events = handler->events,
+        .data.ptr = handler
+    };
+
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        handler->polled = true;
+    } else if (errno == EPERM) {
+        // e.g. regular files, they are always ready like with poll()
+        g_unpolled_count += 1;
+    } else {
+        log_error("net_add_handler() Cannot watch fd %d: %s", fd, strerror(errno));
+        exit(1);
+    }
+#else
+    g_fds_changed = true;
+#endif
 
-    g_count += 1;
+    g_handlers[g_handlers_count] = handler;
+    g_handlers_count += 1;
 }
 
 void net_remove_handler(int fd, net_callback *cb)
@@ -63,10 +188,21 @@ void net_remove_handler(int fd, net_callback *cb)
         exit(1);
     }
 
-    for (size_t i = 0; i < g_count; i++) {
-        if (g_cbs[i] == cb && g_fds[i].fd == fd) {
+    for (size_t i = 0; i < g_handlers_count; i++) {
+        struct handler *handler = g_handlers[i];
+        if (handler->cb == cb && handler->fd == fd) {
+#ifdef USE_EPOLL
+            if (handler->polled) {
+                // fails if the fd is already closed - the kernel dropped it then
+                epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            } else {
+                g_unpolled_count -= 1;
+            }
+#else
+            g_fds_changed = true;
+#endif
             // mark for removal in compress_entries()
-            g_cbs[i] = NULL;
+            handler->cb = NULL;
             g_entry_removed = true;
             return;
         }
@@ -76,57 +212,497 @@ void net_remove_handler(int fd, net_callback *cb)
     exit(1);
 }
 
-static void compress_entries(void)
+void net_want_writable(int fd, net_callback *cb, bool enable)
 {
-    for (size_t i = 0; i < g_count; i += 1) {
-        while (g_cbs[i] == NULL && i < g_count) {
-            g_count -= 1;
-            g_cbs[i] = g_cbs[g_count];
-            g_fds[i].fd = g_fds[g_count].fd;
-            g_fds[i].events = g_fds[g_count].events;
+    for (size_t i = 0; i < g_handlers_count; i++) {
+        struct handler *handler = g_handlers[i];
+        if (handler->cb == cb && handler->fd == fd) {
+            int events = enable ? (POLLIN | POLLOUT) : POLLIN;
+            if (handler->events == events) {
+                return;
+            }
+
+            handler->events = events;
+#ifdef USE_EPOLL
+            struct epoll_event ev = {
+                .events = events,
+                .data.ptr = handler
+            };
+
+            if (handler->polled && epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+                log_warning("net_want_writable() Cannot watch fd %d: %s", fd, strerror(errno));
+            }
+#else
+            g_fds_changed = true;
+#endif
+            return;
         }
     }
+
+    log_error("net_want_writable() handler not found");
+    exit(1);
 }
 
-void net_loop(void)
+void net_add_flush_handler(net_flush_callback *cb)
 {
-    bool call_all = false;
-    time_t call_all_time = time(NULL);
+    net_flush_callback **cbs = realloc(g_flush_cbs, (g_flush_cbs_count + 1) * sizeof(net_flush_callback*));
+    if (cbs == NULL) {
+        log_error("net_add_flush_handler() Cannot allocate handler.");
+        exit(1);
+    }
 
-    // call all callbacks immediately
-    for (size_t i = 0; i < g_count; i++) {
-        g_cbs[i](-1, g_fds[i].fd);
+    cbs[g_flush_cbs_count] = cb;
+    g_flush_cbs = cbs;
+    g_flush_cbs_count += 1;
+}
+
+static bool timer_before(const struct timer *a, const struct timer *b)
+{
+    return (a->deadline < b->deadline)
+        || (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+// Store a timer at heap index i
+static void timer_set(size_t i, const struct timer *timer)
+{
+    g_timers[i] = *timer;
+    g_timer_slots[timer->slot].index = i;
+}
+
+static void timer_swap(size_t i, size_t j)
+{
+    struct timer tmp = g_timers[i];
+    timer_set(i, &g_timers[j]);
+    timer_set(j, &tmp);
+}
+
+static void timer_sift_up(size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!timer_before(&g_timers[i], &g_timers[parent])) {
+            break;
+        }
+        timer_swap(i, parent);
+        i = parent;
     }
+}
 
-    while (gconf->is_running) {
-        int rc = poll(g_fds, g_count, 1000);
+static void timer_sift_down(size_t i)
+{
+    while (true) {
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        size_t min = i;
+
+        if (left < g_timers_count && timer_before(&g_timers[left], &g_timers[min])) {
+            min = left;
+        }
+
+        if (right < g_timers_count && timer_before(&g_timers[right], &g_timers[min])) {
+            min = right;
+        }
+
+        if (min == i) {
+            break;
+        }
+
+        timer_swap(i, min);
+        i = min;
+    }
+}
+
+static void timer_remove_at(size_t i)
+{
+    g_timer_slots[g_timers[i].slot].index = -1;
+    g_timers_count -= 1;
+
+    if (i < g_timers_count) {
+        timer_set(i, &g_timers[g_timers_count]);
+        timer_sift_up(i);
+        timer_sift_down(i);
+    }
+}
+
+// Slot of the callback, or the free slot to put it in
+static size_t timer_slot_find(net_timer_callback *cb)
+{
+    size_t mask = g_timer_slots_size - 1;
+    size_t i = (((uintptr_t) cb >> 4) * 2654435761u) & mask;
+
+    while (g_timer_slots[i].cb != NULL && g_timer_slots[i].cb != cb) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+// Double the slot table, pending timers follow their slot
+static void timer_slots_grow(void)
+{
+    struct timer_slot *old_slots = g_timer_slots;
+    size_t old_size = g_timer_slots_size;
+    size_t size = old_size ? (2 * old_size) : 16;
+
+    struct timer_slot *slots = calloc(size, sizeof(struct timer_slot));
+    if (slots == NULL) {
+        log_error("net_add_timer() Cannot allocate timer table.");
+        exit(1);
+    }
+
+    g_timer_slots = slots;
+    g_timer_slots_size = size;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_slots[i].cb) {
+            size_t j = timer_slot_find(old_slots[i].cb);
+            g_timer_slots[j] = old_slots[i];
+            if (old_slots[i].index >= 0) {
+                g_timers[old_slots[i].index].slot = j;
+            }
+        }
+    }
+
+    free(old_slots);
+}
+
+// Heap index of the pending timer of the callback, or -1
+static ssize_t timer_find(net_timer_callback *cb)
+{
+    if (g_timer_slots_size == 0) {
+        return -1;
+    }
+
+    size_t slot = timer_slot_find(cb);
+
+    return g_timer_slots[slot].cb ? g_timer_slots[slot].index : -1;
+}
+
+void net_add_timer(int64_t deadline, net_timer_callback *cb)
+{
+    if (cb == NULL) {
+        log_error("net_add_timer() Callback is null.");
+        exit(1);
+    }
+
+    // keep the slot table at most half full
+    if (2 * (g_timer_slots_count + 1) > g_timer_slots_size) {
+        timer_slots_grow();
+    }
+
+    size_t slot = timer_slot_find(cb);
+    if (g_timer_slots[slot].cb == NULL) {
+        g_timer_slots[slot].cb = cb;
+        g_timer_slots[slot].index = -1;
+        g_timer_slots_count += 1;
+    }
+
+    ssize_t i = g_timer_slots[slot].index;
+#ifdef WORKERS
+    int64_t earliest = g_timers_count ? g_timers[0].deadline : INT64_MAX;
+#endif
+
+    if (i < 0) {
+        if (g_timers_count == g_timers_capacity) {
+            size_t capacity = g_timers_capacity ? (2 * g_timers_capacity) : 16;
+            struct timer *timers = realloc(g_timers, capacity * sizeof(struct timer));
+            if (timers == NULL) {
+                log_error("net_add_timer() Cannot allocate timer table.");
+                exit(1);
+            }
+            g_timers = timers;
+            g_timers_capacity = capacity;
+        }
+
+        i = g_timers_count;
+        g_timers_count += 1;
+    }
+
+    // a pending timer is moved to the new deadline
+    struct timer timer = {
+        .deadline = deadline,
+        .seq = g_timers_seq++,
+        .slot = slot,
+    };
+    timer_set(i, &timer);
+
+    timer_sift_up(i);
+    timer_sift_down(i);
+
+#ifdef WORKERS
+    // The event loop may sleep past the new deadline
+    if (deadline < earliest && !pthread_equal(pthread_self(), g_loop_thread)) {
+        net_wakeup();
+    }
+#endif
+}
+
+void net_remove_timer(net_timer_callback *cb)
+{
+    ssize_t i = timer_find(cb);
+
+    if (i >= 0) {
+        timer_remove_at(i);
+    }
+}
 
-        if (rc < 0) {
-            //log_error("poll(): %s", strerror(errno));
+// Milliseconds until the next timer is due, -1 if there is none
+static int timers_timeout(void)
+{
+    if (g_timers_count == 0) {
+        return -1;
+    }
+
+    int64_t deadline = g_timers[0].deadline;
+
+    if (deadline <= time_now_ms()) {
+        return 0;
+    }
+
+    return MIN(deadline - time_now_ms(), 24 * 60 * 60 * 1000);
+}
+
+static void timers_run(void)
+{
+    // timers added by the callbacks are run next time
+    uint64_t seq = g_timers_seq;
+
+    while (g_timers_count > 0) {
+        struct timer *timer = &g_timers[0];
+        if (timer->deadline > time_now_ms() || timer->seq >= seq) {
             break;
         }
 
-        gconf->time_now = time(NULL);
+        net_timer_callback *cb = g_timer_slots[timer->slot].cb;
+        timer_remove_at(0);
+        cb();
+    }
+}
+
+static void compress_entries(void)
+{
+    size_t j = 0;
 
-        if ((gconf->time_now - call_all_time) >= 1) {
-            call_all = true;
-            call_all_time = gconf->time_now;
+    for (size_t i = 0; i < g_handlers_count; i += 1) {
+        if (g_handlers[i]->cb == NULL) {
+            free(g_handlers[i]);
         } else {
-            call_all = false;
+            g_handlers[j++] = g_handlers[i];
         }
+    }
+
+    g_handlers_count = j;
+}
+
+#ifdef WORKERS
+void net_lock(void)
+{
+    pthread_rwlock_wrlock(&g_lock);
+}
+
+void net_lock_shared(void)
+{
+    pthread_rwlock_rdlock(&g_lock);
+}
+
+void net_unlock(void)
+{
+    pthread_rwlock_unlock(&g_lock);
+}
+
+void net_wakeup(void)
+{
+    // a full pipe already wakes up the loop
+    if (g_wakeup_pipe[1] >= 0 && write(g_wakeup_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+        log_error("net_wakeup() Cannot wake up event loop: %s", strerror(errno));
+    }
+}
+
+// Only wakes up the loop, the timeout is calculated again
+static void net_wakeup_handler(int rc, int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+        continue;
+    }
+}
+
+static void net_setup_wakeup(void)
+{
+    g_loop_thread = pthread_self();
+
+    if (pipe(g_wakeup_pipe) < 0 || net_set_nonblocking(g_wakeup_pipe[1]) < 0) {
+        log_error("net_loop() Cannot create wakeup pipe: %s", strerror(errno));
+        exit(1);
+    }
+
+    net_add_handler(g_wakeup_pipe[0], &net_wakeup_handler);
+}
+#endif
+
+#ifdef USE_EPOLL
+// Call the handlers of fds that epoll cannot watch
+static void net_call_unpolled(void)
+{
+    // g_handlers may grow while handlers are called
+    size_t count = g_handlers_count;
+
+    for (size_t i = 0; i < count && g_unpolled_count > 0; i++) {
+        struct handler *handler = g_handlers[i];
+        if (handler->cb && !handler->polled) {
+            handler->cb(handler->events, handler->fd);
+        }
+    }
+}
+
+// Wait for events, return false on error
+static bool net_wait(int timeout_ms)
+{
+    int rc;
+
+    if (g_unpolled_count > 0) {
+        // do not sleep, those fds are always ready
+        timeout_ms = 0;
+    }
+
+#ifdef URING
+    if (uring_enabled()) {
+        bool epoll_ready = false;
+
+        // io_uring waits for the DHT sockets and the epoll fd
+        if (!uring_wait(g_epoll_fd, timeout_ms, &epoll_ready)) {
+            return false;
+        }
+
+        if (!epoll_ready) {
+            net_call_unpolled();
+            return true;
+        }
+
+        timeout_ms = 0;
+    }
+#endif
+
+    net_unlock();
 
-        for (size_t i = 0; i < g_count; i++) {
-            int revents = g_fds[i].revents;
-            if (revents || call_all) {
-                g_cbs[i](revents, g_fds[i].fd);
+    if (g_epoll_fd < 0) {
+        // nothing to watch (yet)
+        rc = poll(NULL, 0, timeout_ms);
+    } else {
+        rc = epoll_wait(g_epoll_fd, g_events, ARRAY_SIZE(g_events), timeout_ms);
+    }
+
+    net_lock();
+
+    if (rc < 0) {
+        //log_error("epoll_wait(): %s", strerror(errno));
+        return false;
+    }
+
+    time_update();
+
+    // only handlers with pending events are visited
+    for (size_t i = 0; i < rc; i++) {
+        struct handler *handler = (struct handler*) g_events[i].data.ptr;
+        if (handler->cb) {
+            handler->cb(g_events[i].events, handler->fd);
+        }
+    }
+
+    net_call_unpolled();
+
+    return true;
+}
+#else
+static void rebuild_fds(void)
+{
+    if (g_fds_capacity < g_handlers_count) {
+        struct pollfd *fds = realloc(g_fds, g_handlers_capacity * sizeof(struct pollfd));
+        if (fds == NULL) {
+            log_error("net_loop() Cannot allocate poll table.");
+            exit(1);
+        }
+        g_fds = fds;
+        g_fds_capacity = g_handlers_capacity;
+    }
+
+    for (size_t i = 0; i < g_handlers_count; i++) {
+        g_fds[i].fd = g_handlers[i]->cb ? g_handlers[i]->fd : -1;
+        g_fds[i].events = g_handlers[i]->events;
+        g_fds[i].revents = 0;
+    }
+
+    g_fds_changed = false;
+}
+
+// Wait for events, return false on error
+static bool net_wait(int timeout_ms)
+{
+    if (g_fds_changed) {
+        rebuild_fds();
+    }
+
+    // g_handlers may grow while handlers are called
+    size_t count = g_handlers_count;
+
+    net_unlock();
+    int rc = poll(g_fds, count, timeout_ms);
+    net_lock();
+
+    if (rc < 0) {
+        //log_error("poll(): %s", strerror(errno));
+        return false;
+    }
+
+    time_update();
+
+    for (size_t i = 0; i < count && rc > 0; i++) {
+        int revents = g_fds[i].revents;
+        if (revents) {
+            struct handler *handler = g_handlers[i];
+            if (handler->cb && handler->fd == g_fds[i].fd) {
+                handler->cb(revents, handler->fd);
             }
+            rc -= 1;
+        }
+    }
+
+    return true;
+}
+#endif
+
+void net_loop(void)
+{
+    net_lock();
+
+#ifdef WORKERS
+    net_setup_wakeup();
+#endif
+
+    while (gconf->is_running) {
+        // sleep until the next timer is due
+        if (!net_wait(timers_timeout())) {
+            break;
+        }
+
+        timers_run();
+
+        // e.g. send queued packets
+        for (size_t i = 0; i < g_flush_cbs_count; i++) {
+            g_flush_cbs[i]();
         }
 
         if (g_entry_removed) {
             compress_entries();
+#ifndef USE_EPOLL
+            g_fds_changed = true;
+#endif
             g_entry_removed = false;
         }
     }
+
+    net_unlock();
 }
 
 int net_socket(const char name[], const char ifname[], const int protocol, const int af)
@@ -179,7 +755,8 @@ int net_bind(
     const char addr[],
     const int port,
     const char ifname[],
-    const int protocol)
+    const int protocol,
+    const bool reuseport)
 {
     const int opt_on = 1;
     socklen_t addrlen;
@@ -197,6 +774,19 @@ int net_bind(
         goto fail;
     }
 
+    if (reuseport) {
+#ifdef SO_REUSEPORT
+        // e.g. multiple sockets for the same port
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt_on, sizeof(opt_on)) < 0) {
+            log_error("%s: Unable to set SO_REUSEPORT: %s", name, strerror(errno));
+            goto fail;
+        }
+#else
+        log_error("%s: SO_REUSEPORT not supported.", name);
+        goto fail;
+#endif
+    }
+
     if (sockaddr.ss_family == AF_INET6) {
         if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt_on, sizeof(opt_on)) < 0) {
             log_error("%s: Failed to set IPV6_V6ONLY for %s: %s",
@@ -233,11 +823,54 @@ fail:
 
 void net_free(void)
 {
-    int i;
+    for (size_t i = 0; i < g_handlers_count; i++) {
+        struct handler *handler = g_handlers[i];
+        if (handler->cb && handler->fd >= 0) {
+            close(handler->fd);
+        }
+        free(handler);
+    }
 
-    for (i = 0; i < g_count; i++) {
-        g_cbs[i] = NULL;
-        close(g_fds[i].fd);
-        g_fds[i] = (struct pollfd){ 0 };
+    free(g_handlers);
+    g_handlers = NULL;
+    g_handlers_count = 0;
+    g_handlers_capacity = 0;
+
+    free(g_flush_cbs);
+    g_flush_cbs = NULL;
+    g_flush_cbs_count = 0;
+
+    free(g_timers);
+    g_timers = NULL;
+    g_timers_count = 0;
+    g_timers_capacity = 0;
+
+    free(g_timer_slots);
+    g_timer_slots = NULL;
+    g_timer_slots_count = 0;
+    g_timer_slots_size = 0;
+
+#ifdef WORKERS
+    // the read end was closed with the handlers
+    if (g_wakeup_pipe[1] >= 0) {
+        close(g_wakeup_pipe[1]);
+        g_wakeup_pipe[0] = -1;
+        g_wakeup_pipe[1] = -1;
     }
+#endif
+
+#ifdef URING
+    uring_free();
+#endif
+
+#ifdef USE_EPOLL
+    if (g_epoll_fd >= 0) {
+        close(g_epoll_fd);
+        g_epoll_fd = -1;
+    }
+#else
+    free(g_fds);
+    g_fds = NULL;
+    g_fds_capacity = 0;
+#endif
 }
@@ -3,9 +3,18 @@
 #define _NET_H
 
 
+#include <stdbool.h>
+#include <stdint.h>
+
 // Callback for event loop
 typedef void net_callback(int revents, int fd);
 
+// Callback for the end of an event loop iteration
+typedef void net_flush_callback(void);
+
+// Callback for timers
+typedef void net_timer_callback(void);
+
 // Create a socket and bind to interface
 int net_socket(
     const char name[],
@@ -20,7 +29,8 @@ int net_bind(
     const char addr[],
     const int port,
     const char ifname[],
-    const int protocol
+    const int protocol,
+    const bool reuseport
 );
 
 // Add callback with file descriptor to listen for packets
@@ -29,9 +39,38 @@ void net_add_handler(int fd, net_callback *callback);
 // Remove callback
 void net_remove_handler(int fd, net_callback *callback);
 
+// Call the callback once at deadline in milliseconds (see time_now_ms()).
+// Adding a pending timer again moves it to the new deadline.
+// Other threads need to hold net_lock(), the event loop is woken up.
+void net_add_timer(int64_t deadline, net_timer_callback *callback);
+
+// Remove a pending timer
+void net_remove_timer(net_timer_callback *callback);
+
+// Also call the callback when the file descriptor becomes writable
+void net_want_writable(int fd, net_callback *callback, bool enable);
+
+// Add callback that is called after all events of a loop iteration
+void net_add_flush_handler(net_flush_callback *callback);
+
 // Start loop for all network events
 void net_loop(void);
 
+#ifdef WORKERS
+// Held by the event loop while it handles events. Other
+// threads need to hold it to access shared state.
+void net_lock(void);
+// Held by threads that only read shared state, at the same time
+void net_lock_shared(void);
+void net_unlock(void);
+// Interrupt the wait of the event loop, e.g. to call the flush handlers
+void net_wakeup(void);
+#else
+#define net_lock()
+#define net_lock_shared()
+#define net_unlock()
+#endif
+
 // Close sockets
 void net_free(void);
 
@@ -20,12 +20,6 @@ struct peer {
     char* addr_str;
 };
 
-// Next time to import peers from peer file
-static time_t peerfile_import_time = 0;
-
-// Next time to export peers to peer file
-static time_t peerfile_export_time = 0;
-
 // A list of static peers, given by --peer argument
 static struct peer *g_peers = NULL;
 
@@ -164,10 +158,10 @@ bool peerfile_add_peer(const char addr_str[])
     return true;
 }
 
-static void peerfile_handle_peerfile(int _rc, int _sock)
+static void peerfile_handle_import(void)
 {
     // We know no peers
-    if (peerfile_import_time <= time_now_sec() && kad_count_nodes(false) == 0) {
+    if (kad_count_nodes(false) == 0) {
         // Ping peers from peerfile, if present
         peerfile_import();
 
@@ -175,24 +169,32 @@ static void peerfile_handle_peerfile(int _rc, int _sock)
         peerfile_import_static(g_peers);
 
         // Try again in ~5 minutes
-        peerfile_import_time = time_add_mins(5);
+        net_add_timer(time_add_mins(5), &peerfile_handle_import);
+    } else {
+        // Import again soon after all nodes are lost
+        net_add_timer(time_add_secs(5), &peerfile_handle_import);
     }
+}
 
+static void peerfile_handle_export(void)
+{
     // We know good peers
-    if (peerfile_export_time <= time_now_sec() && kad_count_nodes(true) != 0) {
+    if (kad_count_nodes(true) != 0) {
         // Export peers
         peerfile_export();
 
         // Try again in 24 hours
-        peerfile_export_time = time_add_hours(24);
+        net_add_timer(time_add_hours(24), &peerfile_handle_export);
+    } else {
+        // Check again in ~1 minute
+        net_add_timer(time_add_mins(1), &peerfile_handle_export);
     }
 }
 
 void peerfile_setup(void)
 {
-    peerfile_import_time = time_add_secs(10);
-    peerfile_export_time = time_add_hours(24);
-    net_add_handler(-1 , &peerfile_handle_peerfile);
+    net_add_timer(time_add_secs(10), &peerfile_handle_import);
+    net_add_timer(time_add_hours(24), &peerfile_handle_export);
 }
 
 void peerfile_free(void)
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "log.h"
+#include "conf.h"
+#include "pool.h"
+
+
+// Objects are aligned like malloc() would do
+#define POOL_ALIGN (2 * sizeof(void*))
+
+struct slab {
+    struct slab *next;
+};
+
+// Offset of the first object in a slab
+#define SLAB_HEADER ((sizeof(struct slab) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+static struct pool *g_pools = NULL;
+
+
+// Size of an object slot, unused slots hold the free list
+static size_t pool_slot_size(const struct pool *pool)
+{
+    size_t size = (pool->size < sizeof(void*)) ? sizeof(void*) : pool->size;
+    return (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+}
+
+static void pool_list(struct pool *pool)
+{
+    struct pool **p = &g_pools;
+
+    if (pool->listed) {
+        return;
+    }
+
+    // Append to keep the order of creation
+    while (*p) {
+        p = &(*p)->next;
+    }
+    *p = pool;
+    pool->next = NULL;
+    pool->listed = true;
+}
+
+static void pool_unlist(struct pool *pool)
+{
+    struct pool **p = &g_pools;
+
+    while (*p) {
+        if (*p == pool) {
+            *p = pool->next;
+            break;
+        }
+        p = &(*p)->next;
+    }
+    pool->listed = false;
+}
+
+static bool pool_add_slab(struct pool *pool)
+{
+    size_t slot_size = pool_slot_size(pool);
+    size_t count = pool->slab_objects;
+
+    if (pool->slabs == NULL && gconf->preallocate && pool->reserve > count) {
+        count = pool->reserve;
+    }
+
+    struct slab *slab = (struct slab*) malloc(SLAB_HEADER + count * slot_size);
+    if (slab == NULL) {
+        log_error("Failed to allocate %zu objects for pool %s", count, pool->name);
+        return false;
+    }
+
+    slab->next = (struct slab*) pool->slabs;
+    pool->slabs = slab;
+
+    // Add objects to the free list, the first ends up at the head
+    uint8_t *objects = (uint8_t*) slab + SLAB_HEADER;
+    for (size_t i = count; i > 0; i--) {
+        void *obj = &objects[(i - 1) * slot_size];
+        *((void**) obj) = pool->free_list;
+        pool->free_list = obj;
+    }
+
+    pool->capacity += count;
+    pool_list(pool);
+
+    return true;
+}
+
+void pool_init(struct pool *pool, const char *name, size_t size, size_t slab_objects, size_t reserve)
+{
+    memset(pool, 0, sizeof(struct pool));
+    pool->name = name;
+    pool->size = size;
+    pool->slab_objects = slab_objects;
+    pool->reserve = reserve;
+
+    pool_list(pool);
+
+    if (gconf->preallocate && reserve > 0) {
+        pool_add_slab(pool);
+    }
+}
+
+void *pool_alloc(struct pool *pool)
+{
+    if (pool->free_list == NULL && !pool_add_slab(pool)) {
+        return NULL;
+    }
+
+    void *obj = pool->free_list;
+    pool->free_list = *((void**) obj);
+    pool->used += 1;
+
+    memset(obj, 0, pool->size);
+
+    return obj;
+}
+
+void pool_free(struct pool *pool, void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    *((void**) ptr) = pool->free_list;
+    pool->free_list = ptr;
+    pool->used -= 1;
+}
+
+void pool_destroy(struct pool *pool)
+{
+    struct slab *slab = (struct slab*) pool->slabs;
+
+    if (pool->used > 0) {
+        log_warning("Pool %s destroyed with %zu objects in use", pool->name, pool->used);
+    }
+
+    while (slab) {
+        struct slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    pool_unlist(pool);
+
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->capacity = 0;
+    pool->used = 0;
+}
+
+void pool_print_all(FILE *fp)
+{
+    const struct pool *pool = g_pools;
+
+    while (pool) {
+        fprintf(fp, "%s%s %zu/%zu", (pool == g_pools) ? "" : ", ",
+            pool->name, pool->used, pool->capacity);
+        pool = pool->next;
+    }
+}
@@ -0,0 +1,45 @@
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+/*
+* Pool of fixed size objects. Memory is taken from the heap in
+* slabs of many objects and is only returned on pool_destroy().
+* Freed objects are kept on a free list for reuse. This avoids
+* heap fragmentation from the steady churn of small objects.
+*
+* With --preallocate, the first slab holds reserve objects.
+*/
+
+struct pool {
+    const char *name;
+    size_t size; // object size
+    size_t slab_objects; // objects per slab
+    size_t reserve; // objects in the first slab with --preallocate
+    void *free_list;
+    void *slabs;
+    size_t used;
+    size_t capacity;
+    bool listed;
+    struct pool *next; // list of all pools
+};
+
+// Initialize a pool, allocates the reserve with --preallocate
+void pool_init(struct pool *pool, const char *name, size_t size, size_t slab_objects, size_t reserve);
+
+// Return a zeroed object or NULL
+void *pool_alloc(struct pool *pool);
+
+void pool_free(struct pool *pool, void *ptr);
+
+// Free all memory, all objects must have been returned
+void pool_destroy(struct pool *pool);
+
+// Print the occupancy of all pools, e.g. "nodes 10/64, searches 2/8"
+void pool_print_all(FILE *fp);
+
+#endif // _POOL_H_
@@ -11,6 +11,8 @@
 #include "net.h"
 #include "kad.h"
 #include "results.h"
+#include "ext-cli.h"
+#include "pool.h"
 
 
 /*
@@ -26,6 +28,11 @@ struct result_t {
     struct result_t *next;
 };
 
+// Results allocated up front with --preallocate
+#define RESULTS_PREALLOC MAX_RESULTS_PER_SEARCH
+
+static struct pool g_result_pool;
+
 struct search_t {
     uint8_t id[SHA1_BIN_LENGTH];
     uint16_t numresults4;
@@ -81,22 +88,19 @@ static void on_new_search_result(const char *path, const uint8_t id[], const uin
     }
 }
 
-struct dht_addr4_t {
-    uint8_t addr[4];
-    uint16_t port;
-};
-
-struct dht_addr6_t {
-    uint8_t addr[16];
-    uint16_t port;
-};
+// Compact peer info: address followed by the port (network byte order)
+#define DHT_ADDR4_LEN 6
+#define DHT_ADDR6_LEN 18
 
 static void result_add(struct search_t *search, const uint8_t id[], const uint8_t *ip, uint8_t length, uint16_t port)
 {
     struct result_t *result = find_result(search, ip, length, port);
     if (!result) {
         // add new result
-        result = calloc(1, sizeof(struct result_t));
+        result = pool_alloc(&g_result_pool);
+        if (result == NULL) {
+            return;
+        }
         memcpy(&result->ip, ip, length);
         result->length = length;
         result->port = port;
@@ -113,6 +117,10 @@ static void result_add(struct search_t *search, const uint8_t id[], const uint8_
         if (gconf->execute_path) {
             on_new_search_result(gconf->execute_path, id, ip, length, port);
         }
+
+#ifdef CLI
+        cli_watch_result(id, ip, length, port);
+#endif
     }
 }
 
@@ -134,20 +142,25 @@ void results_add(const uint8_t id[], int af, const void *data, size_t data_len)
 
     switch (af) {
         case AF_INET: {
-            size_t got = (data_len / sizeof(struct dht_addr4_t));
+            size_t got = (data_len / DHT_ADDR4_LEN);
             size_t add = MIN(got, search->maxresults - numresults);
-            struct dht_addr4_t *data4 = (struct dht_addr4_t *) data;
+            // data points into the packet and might not be aligned
+            const uint8_t *data4 = (const uint8_t *) data;
             for (size_t i = 0; i < add; ++i) {
-                result_add(search, id, &data4[i].addr[0], 4, (uint16_t) data4[i].port);
+                uint16_t port;
+                memcpy(&port, &data4[i * DHT_ADDR4_LEN + 4], sizeof(port));
+                result_add(search, id, &data4[i * DHT_ADDR4_LEN], 4, port);
             }
             break;
         }
         case AF_INET6: {
-            size_t got = (data_len / sizeof(struct dht_addr6_t));
+            size_t got = (data_len / DHT_ADDR6_LEN);
             size_t add = MIN(got, search->maxresults - numresults);
-            struct dht_addr6_t *data6 = (struct dht_addr6_t *) data;
+            const uint8_t *data6 = (const uint8_t *) data;
             for (size_t i = 0; i < add; ++i) {
-                result_add(search, id, &data6[i].addr[0], 16, (uint16_t) data6[i].port);
+                uint16_t port;
+                memcpy(&port, &data6[i * DHT_ADDR6_LEN + 16], sizeof(port));
+                result_add(search, id, &data6[i * DHT_ADDR6_LEN], 16, port);
             }
         }
     }
@@ -189,7 +202,7 @@ static void search_free(struct search_t *search)
     cur = search->results;
     while (cur) {
         next = cur->next;
-        free(cur);
+        pool_free(&g_result_pool, cur);
         cur = next;
     }
 
@@ -216,3 +229,23 @@ void results_clear(const uint8_t id[])
         search = search->next;
     }
 }
+
+void results_setup(void)
+{
+    pool_init(&g_result_pool, "results", sizeof(struct result_t), 64, RESULTS_PREALLOC);
+}
+
+void results_free(void)
+{
+    struct search_t *search = g_searches;
+    struct search_t *next;
+
+    while (search) {
+        next = search->next;
+        search_free(search);
+        search = next;
+    }
+    g_searches = NULL;
+
+    pool_destroy(&g_result_pool);
+}
@@ -8,4 +8,7 @@ bool results_print(FILE *fp, const uint8_t id[]);
 void results_clear(const uint8_t id[]);
 unsigned results_count(const uint8_t id[], int af);
 
+void results_setup(void);
+void results_free(void);
+
 #endif // _RESULTS_H
@@ -0,0 +1,561 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "uring.h"
+
+
+// Submission queue size, the completion queue is twice as large
+#define URING_ENTRIES 256
+
+// Number of receive buffers shared by all sockets (power of two)
+#define URING_RECV_BUFFERS 128
+#define URING_BUFFER_GROUP 0
+
+// Largest datagram, same as in kad.c
+#define URING_PACKET_SIZE 1500
+
+// A receive buffer holds the recvmsg header, the sender address and the
+// payload plus a null terminator, rounded up to keep the buffers aligned
+#define URING_RECV_BUFFER_SIZE \
+    ((sizeof(struct io_uring_recvmsg_out) + sizeof(IP) + URING_PACKET_SIZE + 63) & ~63)
+
+// Maximum number of send requests in flight
+#define URING_SEND_SLOTS 256
+
+// Request type in the upper half of user_data, an index in the lower half
+enum {
+    URING_EPOLL = 1,
+    URING_RECV,
+    URING_SEND
+};
+
+#define URING_DATA(type, idx) (((uint64_t) (type) << 32) | (uint32_t) (idx))
+
+struct uring_socket {
+    int fd;
+    // a multishot receive is active
+    bool armed;
+    // multishot receive is not supported, the fallback handler is used
+    bool disabled;
+    // only msg_namelen is used by multishot receive
+    struct msghdr msg;
+    uring_recv_callback *recv_cb;
+    uring_sent_callback *sent_cb;
+    net_callback *fallback;
+};
+
+struct uring_send {
+    int fd;
+    struct msghdr msg;
+    struct iovec iov;
+    IP addr;
+    uint8_t buf[URING_PACKET_SIZE];
+};
+
+static int g_ring_fd = -1;
+static bool g_setup_failed = false;
+
+// Memory shared with the kernel
+static void *g_sq_ring = NULL;
+static void *g_cq_ring = NULL;
+static size_t g_sq_ring_size = 0;
+static size_t g_cq_ring_size = 0;
+static size_t g_sqes_size = 0;
+
+// Submission queue, entries up to g_sq_local_tail are prepared
+static unsigned *g_sq_head;
+static unsigned *g_sq_tail;
+static unsigned *g_sq_array;
+static unsigned g_sq_mask;
+static unsigned g_sq_entries;
+static unsigned g_sq_local_tail;
+static struct io_uring_sqe *g_sqes = NULL;
+
+// Completion queue
+static unsigned *g_cq_head;
+static unsigned *g_cq_tail;
+static unsigned g_cq_mask;
+static struct io_uring_cqe *g_cqes;
+
+// Receive buffers handed to the kernel
+static struct io_uring_buf_ring *g_buf_ring = NULL;
+static size_t g_buf_ring_size = 0;
+static uint8_t *g_recv_bufs = NULL;
+
+// One socket per address family and node id
+static struct uring_socket g_sockets[2 * DHT_NODE_IDS_MAX];
+static int g_sockets_count = 0;
+
+// Send requests and a stack of unused slots
+static struct uring_send *g_sends = NULL;
+static int g_sends_free[URING_SEND_SLOTS];
+static int g_sends_free_count = 0;
+
+static bool g_epoll_armed = false;
+static uint64_t g_enter_count = 0;
+
+
+static int uring_enter(unsigned min_complete, int timeout_ms)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+        .ts = 0
+    };
+    unsigned flags = 0;
+
+    // publish prepared entries
+    __atomic_store_n(g_sq_tail, g_sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = g_sq_local_tail - __atomic_load_n(g_sq_head, __ATOMIC_ACQUIRE);
+
+    if (min_complete) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+    } else if (to_submit == 0) {
+        return 0;
+    }
+
+    g_enter_count += 1;
+
+    return syscall(__NR_io_uring_enter, g_ring_fd, to_submit, min_complete, flags,
+        (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+}
+
+void uring_submit(void)
+{
+    if (g_ring_fd >= 0 && uring_enter(0, 0) < 0) {
+        log_warning("io_uring_enter(): %s", strerror(errno));
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    if ((g_sq_local_tail - __atomic_load_n(g_sq_head, __ATOMIC_ACQUIRE)) == g_sq_entries) {
+        // queue is full, hand the entries to the kernel
+        uring_submit();
+        if ((g_sq_local_tail - __atomic_load_n(g_sq_head, __ATOMIC_ACQUIRE)) == g_sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned idx = g_sq_local_tail & g_sq_mask;
+    struct io_uring_sqe *sqe = &g_sqes[idx];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    g_sq_array[idx] = idx;
+    g_sq_local_tail += 1;
+
+    return sqe;
+}
+
+// Give a receive buffer back to the kernel
+static void uring_recycle_buffer(unsigned bid)
+{
+    unsigned short tail = g_buf_ring->tail;
+    struct io_uring_buf *buf = &g_buf_ring->bufs[tail & (URING_RECV_BUFFERS - 1)];
+
+    // do not touch buf->resv, it is the ring tail for the first entry
+    buf->addr = (uint64_t) (uintptr_t) &g_recv_bufs[bid * URING_RECV_BUFFER_SIZE];
+    buf->len = URING_RECV_BUFFER_SIZE - 1;
+    buf->bid = bid;
+
+    __atomic_store_n(&g_buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_arm_epoll(int epoll_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = epoll_fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        sqe->poll32_events = POLLIN << 16;
+#else
+        sqe->poll32_events = POLLIN;
+#endif
+        sqe->user_data = URING_DATA(URING_EPOLL, 0);
+        g_epoll_armed = true;
+    }
+}
+
+static void uring_arm_recv(int i)
+{
+    struct uring_socket *s = &g_sockets[i];
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe) {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = s->fd;
+        sqe->addr = (uint64_t) (uintptr_t) &s->msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = URING_DATA(URING_RECV, i);
+        s->armed = true;
+    }
+}
+
+static void uring_handle_recv(struct uring_socket *s, int res, unsigned flags)
+{
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t *buf = &g_recv_bufs[bid * URING_RECV_BUFFER_SIZE];
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) buf;
+
+        if (res >= (int) sizeof(struct io_uring_recvmsg_out) && !(out->flags & MSG_TRUNC)) {
+            uint8_t *name = buf + sizeof(struct io_uring_recvmsg_out);
+            uint8_t *payload = name + s->msg.msg_namelen + s->msg.msg_controllen;
+            socklen_t fromlen = MIN(out->namelen, sizeof(IP));
+            IP from;
+
+            memcpy(&from, name, fromlen);
+            if (out->payloadlen > 0) {
+                s->recv_cb(s->fd, payload, out->payloadlen, &from, fromlen);
+            }
+        }
+
+        uring_recycle_buffer(bid);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        s->armed = false;
+
+        if (res == -EINVAL || res == -EOPNOTSUPP) {
+            log_warning("io_uring: Multishot receive not supported, fall back to epoll.");
+            s->disabled = true;
+            net_add_handler(s->fd, s->fallback);
+        }
+        // otherwise re-armed with the next wait, e.g. after -ENOBUFS
+    }
+}
+
+static void uring_handle_send(int i, int res)
+{
+    struct uring_send *send = &g_sends[i];
+
+    for (size_t j = 0; j < g_sockets_count; j++) {
+        if (g_sockets[j].fd == send->fd) {
+            g_sockets[j].sent_cb(send->fd, res);
+            break;
+        }
+    }
+
+    g_sends_free[g_sends_free_count++] = i;
+}
+
+// Dispatch completions, at most gconf->dht_recv_budget received packets
+static void uring_dispatch(bool *epoll_ready)
+{
+    unsigned head = *g_cq_head;
+    unsigned tail = __atomic_load_n(g_cq_tail, __ATOMIC_ACQUIRE);
+    int budget = gconf->dht_recv_budget;
+
+    while (head != tail && budget > 0) {
+        const struct io_uring_cqe *cqe = &g_cqes[head & g_cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+
+        // free the entry before the callbacks queue new requests
+        head += 1;
+        __atomic_store_n(g_cq_head, head, __ATOMIC_RELEASE);
+
+        unsigned idx = (uint32_t) data;
+        switch (data >> 32) {
+        case URING_EPOLL:
+            g_epoll_armed = false;
+            if (res > 0) {
+                *epoll_ready = true;
+            }
+            break;
+        case URING_RECV:
+            uring_handle_recv(&g_sockets[idx], res, flags);
+            budget -= 1;
+            break;
+        case URING_SEND:
+            uring_handle_send(idx, res);
+            break;
+        }
+    }
+}
+
+bool uring_wait(int epoll_fd, int timeout_ms, bool *epoll_ready)
+{
+    *epoll_ready = false;
+
+    if (epoll_fd >= 0 && !g_epoll_armed) {
+        uring_arm_epoll(epoll_fd);
+    }
+
+    for (size_t i = 0; i < g_sockets_count; i++) {
+        if (!g_sockets[i].armed && !g_sockets[i].disabled) {
+            uring_arm_recv(i);
+        }
+    }
+
+    net_unlock();
+    int rc = uring_enter(1, timeout_ms);
+    net_lock();
+
+    if (rc < 0) {
+        if (errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+            //log_error("io_uring_enter(): %s", strerror(errno));
+            return false;
+        }
+    }
+
+    time_update();
+
+    uring_dispatch(epoll_ready);
+
+    return true;
+}
+
+int uring_sendto(int fd, const void *buf, int buflen, int flags, const struct sockaddr *to, int tolen)
+{
+    if (buflen > URING_PACKET_SIZE || tolen > sizeof(IP)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (g_sends_free_count == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int i = g_sends_free[--g_sends_free_count];
+    struct uring_send *send = &g_sends[i];
+
+    send->fd = fd;
+    memcpy(send->buf, buf, buflen);
+    memcpy(&send->addr, to, tolen);
+    send->iov.iov_len = buflen;
+    send->msg.msg_namelen = tolen;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) &send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = URING_DATA(URING_SEND, i);
+
+    return buflen;
+}
+
+static bool uring_setup(void)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+
+    g_ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (g_ring_fd < 0) {
+        log_info("io_uring: Not available: %s", strerror(errno));
+        return false;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        log_info("io_uring: Kernel is too old.");
+        goto fail;
+    }
+
+    g_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    g_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    g_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        g_sq_ring_size = MAX(g_sq_ring_size, g_cq_ring_size);
+        g_cq_ring_size = 0;
+    }
+
+    g_sq_ring = mmap(NULL, g_sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, g_ring_fd, IORING_OFF_SQ_RING);
+    if (g_sq_ring == MAP_FAILED) {
+        g_sq_ring = NULL;
+        goto fail;
+    }
+
+    if (g_cq_ring_size) {
+        g_cq_ring = mmap(NULL, g_cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, g_ring_fd, IORING_OFF_CQ_RING);
+        if (g_cq_ring == MAP_FAILED) {
+            g_cq_ring = NULL;
+            goto fail;
+        }
+    } else {
+        g_cq_ring = g_sq_ring;
+    }
+
+    g_sqes = mmap(NULL, g_sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, g_ring_fd, IORING_OFF_SQES);
+    if (g_sqes == MAP_FAILED) {
+        g_sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = (uint8_t*) g_sq_ring;
+    g_sq_head = (unsigned*) (sq + p.sq_off.head);
+    g_sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    g_sq_array = (unsigned*) (sq + p.sq_off.array);
+    g_sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+    g_sq_entries = *(unsigned*) (sq + p.sq_off.ring_entries);
+    g_sq_local_tail = *g_sq_tail;
+
+    uint8_t *cq = (uint8_t*) g_cq_ring;
+    g_cq_head = (unsigned*) (cq + p.cq_off.head);
+    g_cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    g_cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+    g_cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    // Register the receive buffers
+    g_buf_ring_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    g_buf_ring = mmap(NULL, g_buf_ring_size, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (g_buf_ring == MAP_FAILED) {
+        g_buf_ring = NULL;
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) (uintptr_t) g_buf_ring,
+        .ring_entries = URING_RECV_BUFFERS,
+        .bgid = URING_BUFFER_GROUP
+    };
+
+    if (syscall(__NR_io_uring_register, g_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_info("io_uring: Cannot register receive buffers: %s", strerror(errno));
+        goto fail;
+    }
+
+    g_recv_bufs = (uint8_t*) malloc(URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    g_sends = (struct uring_send*) calloc(URING_SEND_SLOTS, sizeof(struct uring_send));
+
+    if (g_recv_bufs == NULL || g_sends == NULL) {
+        goto fail;
+    }
+
+    for (unsigned bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+        uring_recycle_buffer(bid);
+    }
+
+    for (int i = 0; i < URING_SEND_SLOTS; i++) {
+        struct uring_send *send = &g_sends[i];
+        send->iov.iov_base = send->buf;
+        send->msg.msg_name = &send->addr;
+        send->msg.msg_iov = &send->iov;
+        send->msg.msg_iovlen = 1;
+        g_sends_free[i] = URING_SEND_SLOTS - 1 - i;
+    }
+    g_sends_free_count = URING_SEND_SLOTS;
+
+    log_info("io_uring: Enabled");
+
+    return true;
+
+fail:
+    uring_free();
+
+    return false;
+}
+
+bool uring_add_socket(int fd, uring_recv_callback *recv_cb, uring_sent_callback *sent_cb, net_callback *fallback)
+{
+    if (g_ring_fd < 0) {
+        if (g_setup_failed || !uring_setup()) {
+            g_setup_failed = true;
+            return false;
+        }
+    }
+
+    if (g_sockets_count == ARRAY_SIZE(g_sockets)) {
+        return false;
+    }
+
+    struct uring_socket *s = &g_sockets[g_sockets_count];
+
+    memset(s, 0, sizeof(struct uring_socket));
+    s->fd = fd;
+    s->msg.msg_namelen = sizeof(IP);
+    s->recv_cb = recv_cb;
+    s->sent_cb = sent_cb;
+    s->fallback = fallback;
+
+    g_sockets_count += 1;
+
+    return true;
+}
+
+bool uring_enabled(void)
+{
+    return (g_ring_fd >= 0);
+}
+
+uint64_t uring_enter_count(void)
+{
+    return g_enter_count;
+}
+
+void uring_free(void)
+{
+    // closing the ring cancels all pending requests
+    if (g_ring_fd >= 0) {
+        close(g_ring_fd);
+        g_ring_fd = -1;
+    }
+
+    if (g_sqes) {
+        munmap(g_sqes, g_sqes_size);
+        g_sqes = NULL;
+    }
+
+    if (g_cq_ring && g_cq_ring != g_sq_ring) {
+        munmap(g_cq_ring, g_cq_ring_size);
+    }
+    g_cq_ring = NULL;
+
+    if (g_sq_ring) {
+        munmap(g_sq_ring, g_sq_ring_size);
+        g_sq_ring = NULL;
+    }
+
+    if (g_buf_ring) {
+        munmap(g_buf_ring, g_buf_ring_size);
+        g_buf_ring = NULL;
+    }
+
+    free(g_recv_bufs);
+    g_recv_bufs = NULL;
+
+    free(g_sends);
+    g_sends = NULL;
+    g_sends_free_count = 0;
+
+    g_sockets_count = 0;
+    g_epoll_armed = false;
+}
@@ -0,0 +1,50 @@
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "main.h"
+#include "net.h"
+
+/*
+* io_uring engine for the DHT sockets (FEATURES=uring).
+*
+* Datagrams are received with a multishot recvmsg into a ring of
+* kernel selected buffers and sent with sendmsg requests that are
+* submitted together with the next wait. All other file descriptors
+* stay in epoll, the epoll fd itself is polled by io_uring.
+*/
+
+// Called for every received datagram, buf[buflen] may be overwritten
+typedef void uring_recv_callback(int fd, uint8_t buf[], size_t buflen, IP *from, socklen_t fromlen);
+
+// Called when a send request completes, rc is the result of sendmsg()
+typedef void uring_sent_callback(int fd, int rc);
+
+// Receive datagrams on a socket, return false if io_uring is not supported.
+// The fallback handler is added to the event loop if the kernel rejects
+// multishot receive later on.
+bool uring_add_socket(int fd, uring_recv_callback *recv_cb, uring_sent_callback *sent_cb, net_callback *fallback);
+
+// Queue a datagram, it is submitted with the next uring_wait() or uring_submit()
+int uring_sendto(int fd, const void *buf, int buflen, int flags, const struct sockaddr *to, int tolen);
+
+// Submit queued requests without waiting
+void uring_submit(void);
+
+// Wait for completions and dispatch them. epoll_ready is set if the
+// epoll fd has pending events. Return false on error.
+bool uring_wait(int epoll_fd, int timeout_ms, bool *epoll_ready);
+
+// True if the engine is set up
+bool uring_enabled(void);
+
+// Number of io_uring_enter() calls
+uint64_t uring_enter_count(void);
+
+void uring_free(void);
+
+#endif // _URING_H
@@ -9,6 +9,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <time.h>
 #include <limits.h>
 
 #include "main.h"
@@ -557,17 +558,47 @@ bool socket_addr(int sock, IP *addr)
     return getsockname(sock, (struct sockaddr *) addr, &len) == 0;
 }
 
-time_t time_add_secs(uint32_t seconds)
+// Read the monotonic clock, the value starts at the wall clock time
+// so that it can still be used as a timestamp.
+int64_t time_read_ms(void)
 {
-    return gconf->time_now + seconds;
+    static int64_t offset_ms = 0;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t ms = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    if (offset_ms == 0) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        offset_ms = ((int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000) - ms;
+    }
+
+    return ms + offset_ms;
+}
+
+void time_update(void)
+{
+    gconf->time_now_ms = time_read_ms();
+    gconf->time_now = gconf->time_now_ms / 1000;
+}
+
+int64_t time_add_ms(uint32_t milliseconds)
+{
+    return gconf->time_now_ms + milliseconds;
+}
+
+int64_t time_add_secs(uint32_t seconds)
+{
+    return gconf->time_now_ms + (1000LL * seconds);
 }
 
-time_t time_add_mins(uint32_t minutes)
+int64_t time_add_mins(uint32_t minutes)
 {
-    return gconf->time_now + (60 * minutes);
+    return gconf->time_now_ms + (60 * 1000LL * minutes);
 }
 
-time_t time_add_hours(uint32_t hours)
+int64_t time_add_hours(uint32_t hours)
 {
-    return gconf->time_now + (60 * 60 * hours);
+    return gconf->time_now_ms + (60 * 60 * 1000LL * hours);
 }
@@ -23,8 +23,9 @@
 // IPv6 address length including port, e.g. [::1]:12345
 #define FULL_ADDSTRLEN (INET6_ADDRSTRLEN + 8)
 
-// Direct access to time in seconds
+// Direct access to the cached clock, updated once per event loop iteration
 #define time_now_sec() (gconf->time_now)
+#define time_now_ms() (gconf->time_now_ms)
 
 typedef struct {
     const char *name;
@@ -71,8 +72,15 @@ bool addr_equal(const IP *addr1, const IP *addr2);
 
 bool socket_addr(int sock, IP *addr);
 
-time_t time_add_secs(uint32_t seconds);
-time_t time_add_mins(uint32_t minutes);
-time_t time_add_hours(uint32_t hours);
+// Set time_now_ms() and time_now_sec() from the clock
+void time_update(void);
+// Read the clock without updating the shared time, e.g. in other threads
+int64_t time_read_ms(void);
+
+// Deadlines in milliseconds, e.g. for net_add_timer()
+int64_t time_add_ms(uint32_t milliseconds);
+int64_t time_add_secs(uint32_t seconds);
+int64_t time_add_mins(uint32_t minutes);
+int64_t time_add_hours(uint32_t hours);
 
 #endif // _UTILS_H_